@@ -2,6 +2,7 @@
 #pragma once
 
 #include <algorithm>
+#include <functional>
 #include <list>
 #include <string>
 
@@ -49,13 +50,25 @@ using BtreePage = HeaderArray<BtreeHeader, Entry<Key,Data>>;
 
 /*
  * SearchPath
+ *
+ * An interior node with n keys k_0..k_{n-1} has n + 1 children: entry i
+ * holds k_i and child c_i, and the "past the end" entry holds c_n.
+ * Child c_i holds the keys in [k_{i-1}, k_i), so the search follows the
+ * first entry whose key is greater than the key.  Every page of the
+ * path is loaded (pinned) through load_page.
  */
-template<typename Key, typename InteriorDataType>
+template<
+  typename Key,
+  typename InteriorDataType,
+  typename LoadPage,
+  typename LessThan = std::less<Key>
+  >
 Path
 GetSearchPath(
     InteriorDataType start, 
     const Key& key, 
-    char*(*load_page)(InteriorDataType)) 
+    LoadPage load_page,
+    LessThan lessThan = LessThan()) 
 {
   using InteriorPage = BtreePage<Key,InteriorDataType>;
   using PageEntry    = typename InteriorPage::value_type;
@@ -68,13 +81,14 @@ GetSearchPath(
   {
     auto page = (InteriorPage*)pageHeader;
 
-
     auto nextEntry = 
-      std::lower_bound(
+      std::upper_bound(
           page->begin(),
           page->end(),
           key,
-          [key](const PageEntry& entry) { return entry.key <= key; }
+          [lessThan](const Key& key, const PageEntry& entry) { 
+            return lessThan(key, entry.key); 
+          }
       );
 
     searchPath.push_back({pageHeader, nextEntry});
@@ -87,6 +101,11 @@ GetSearchPath(
 }
 /*
  * SplitBtreeNode
+ *
+ * The upper half of the full childPage goes to the empty newPage, which
+ * becomes the child right after childEntry in parentNode.  A leaf
+ * leaves a copy of the first key of newPage in the parent, an interior
+ * node moves its middle key up.
  */
 template<
   typename Key,
@@ -97,21 +116,31 @@ void
 SplitBtreeNode(
     BtreePage<Key, Data1>* parentNode,
     Entry<    Key, Data1>* childEntry,
-    BtreePage<Key, Data2>*  childPage,
+    BtreePage<Key, Data2>* childPage,
     BtreeHeader* newPage)
 {
   newPage->CopyHeight(childPage);
 
-  //last n/2 go from childPage to newPage
-  SpliceLastN<Entry>( 
-      (BtreePage<Key,Data1>*)newPage,
-      childPage,
-      childPage->size()/2
-  );
-  
+  auto newNode = (BtreePage<Key,Data2>*)newPage;
+  Key  separator;
+
+  if (childPage->header()->IsLeaf())
+  {
+    //last n/2 go from childPage to newPage
+    SpliceLastN(newNode, childPage, childPage->size() / 2);
+    separator = newNode->begin()->key;
+  }
+  else
+  {
+    //the key in front of them moves up, its child stays as "past the end"
+    SpliceLastN(newNode, childPage, (childPage->size() - 1) / 2);
+    separator = (childPage->end() - 1)->key;
+    --childPage->header()->size;
+  }
+
   parentNode->insert(childEntry, *childEntry);
 
-  childEntry->key = (--childPage->end())->key;
+  childEntry->key = separator;
 
   ++childEntry; //childEntry now points to "new entry"
 
@@ -119,6 +148,10 @@ SplitBtreeNode(
 }
 /*
  * MergeNode
+ *
+ * rightPage, the child after leftEntry, is appended to leftPage and
+ * leftEntry's key leaves the parent; an interior leftPage takes it as
+ * the key of its "past the end" child first.
  */
 template<
   typename Key,
@@ -132,13 +165,85 @@ MergeNode(
     BtreePage<Key, Data2>* leftPage,
     BtreePage<Key, Data2>* rightPage)
 {
+  if (!leftPage->header()->IsLeaf())
+  {
+    leftPage->end()->key = leftEntry->key;
+    ++leftPage->header()->size;
+  }
+
   SpliceLastN(leftPage, rightPage, rightPage->size());
 
   Entry<Key, Data1>* hiEntry = leftEntry + 1;
 
-  leftEntry->key = hiEntry->key;
+  hiEntry->data = leftEntry->data;
+
+  parent->erase(leftEntry);
+}
+/*
+ * ShiftLeft
+ *
+ * Moves the first entry of rightPage, the child after leftEntry, to the
+ * end of leftPage (through the parent, for interior nodes).
+ */
+template<
+  typename Key,
+  typename Data1,
+  typename Data2
+  >
+void
+ShiftLeft(
+    Entry<Key, Data1>*     leftEntry,
+    BtreePage<Key, Data2>* leftPage,
+    BtreePage<Key, Data2>* rightPage)
+{
+  if (leftPage->header()->IsLeaf())
+  {
+    leftPage->push_back(*rightPage->begin());
+    rightPage->erase(rightPage->begin());
+    leftEntry->key = rightPage->begin()->key;
+  }
+  else
+  {
+    leftPage->end()->key = leftEntry->key;
+    ++leftPage->header()->size;
+    leftPage->end()->data = rightPage->begin()->data;
+    leftEntry->key = rightPage->begin()->key;
+    rightPage->erase(rightPage->begin());
+  }
+}
+/*
+ * ShiftRight
+ *
+ * Moves the last entry of leftPage to the front of rightPage, the child
+ * after leftEntry (through the parent, for interior nodes).
+ */
+template<
+  typename Key,
+  typename Data1,
+  typename Data2
+  >
+void
+ShiftRight(
+    Entry<Key, Data1>*     leftEntry,
+    BtreePage<Key, Data2>* leftPage,
+    BtreePage<Key, Data2>* rightPage)
+{
+  Entry<Key, Data2>* last = leftPage->end() - 1;
+
+  if (leftPage->header()->IsLeaf())
+  {
+    rightPage->insert(rightPage->begin(), *last);
+    leftEntry->key = last->key;
+  }
+  else
+  {
+    Entry<Key, Data2> moved = *leftPage->end();
+    moved.key = leftEntry->key;
+    rightPage->insert(rightPage->begin(), moved);
+    leftEntry->key = last->key;
+  }
 
-  parent->erase(rightPage);
+  --leftPage->header()->size;
 }
 
 }; // data_org_project_names
@@ -2,7 +2,10 @@
 //Btree.h
 #pragma once
 
+#include <algorithm>
 #include <functional>
+#include <initializer_list>
+#include <string>
 #include <vector>
 
 #include "btree.h"
@@ -32,9 +35,12 @@ template<
   typename Key,
   typename Data,
   typename HashFunction = UniHash<Key>,
-  typename LessThan = std::less<Key>
+  typename LessThan = std::less<Key>,
+  typename Storage = storage_model
   >
 class Btree : public HashInterface<Key, Data, HashFunction> {
+  static_assert(is_storage_model<Storage>::value,
+      "Btree: Storage must implement storage_model");
 
  public:
 
@@ -47,57 +53,71 @@ class Btree : public HashInterface<Key, Data, HashFunction> {
   using Header = BtreeHeader;
   using Pages = std::vector<Header*>;
 
-  using Table = Btree<Key, Data, HashFunction, LessThan>;
+  using Table = Btree<Key, Data, HashFunction, LessThan, Storage>;
+  using StorageType = Storage;
 
-  using iterator = TableIterator<Key, Data, Table, PageIterator>;
+  class PageIterator;
+  using iterator = TableIterator<Key, Data, Entry, PageIterator>;
 
   /*
    * Btree
    */
-  Btree(storage_model* model, size_t n = 0) : model_(model), size_(0) 
+  Btree(Storage* model, size_t n = 0) : model_(model), size_(0) 
+  {
+    PageInfo root = CreateNewPage(0);
+    model_->save_page(root.id, (char*)root.header);
+    rootId_ = root.id;
+  }
+  /*
+   * Btree - over the pages of an existing tree, e.g. one a writer built
+   * in shared memory; creates no page, so the storage may be read-only
+   * as long as only find and the iterators are used.
+   */
+  Btree(Storage* model, PageId rootId, size_t size) :
+    rootId_(rootId), model_(model), size_(size) {}
+  /*
+   * Btree - the tree whose SaveMeta returned metaPageId; like the one
+   * above it only loads and releases pages.
+   */
+  Btree(Storage* model, PageId metaPageId, OpenTable) :
+    rootId_(0), model_(model), size_(0)
   {
-    rootId_ = model_->create_page();
+    std::string bytes = LoadMetaPages(model_, metaPageId, metaPages_);
+    size_t offset = 0;
+    ReadMeta(bytes, offset, &rootId_);
+    ReadMeta(bytes, offset, &size_);
   }
   /*
    * BtreePath
    */
   Path
-  BtreePath(const Key& key)
+  BtreePath(const Key& key) const
   {
     return GetSearchPath(
         rootId_,
         key, 
-        [this](PageId pageId) { return this->model_->load_page(pageId); }
+        [this](PageId pageId) { return this->model_->load_page(pageId); },
+        LessThan()
     );
   }
   /*
    * GetNext (leaf)
    */
-  LeafEntry*
+  static LeafEntry*
   GetNext(LeafNode* leaf, const Key& key)
   {
-    LeafEntry dummyEntry {key, Data()};
-
     return std::lower_bound(
         leaf->begin(),
         leaf->end(),
-        dummyEntry,
-        [](const LeafNode& l, const LeafNode& r) { 
-          return LessThan(l.key, r.key); 
+        key,
+        [](const LeafEntry& l, const Key& key) { 
+          return LessThan()(l.key, key); 
         }
     );
   }
-  const LeafEntry*
-  GetNext(LeafNode* leaf, const Key& key) const
-  {
-    return const_cast<Btree*>(this)->GetNext(leaf, key);
-  }
   /*
    * IsMatch
    */
-  /*
-   * IsMatch const
-   */
   static bool
   IsMatch(
       const LeafNode*  leafNode,
@@ -109,16 +129,19 @@ class Btree : public HashInterface<Key, Data, HashFunction> {
   /*
    * Find
    */
-  iterator
+  std::pair<bool, Data>
   find(const Key& key) const override
   {
     Path searchPath = BtreePath(key);
     auto leafNode = (LeafNode*)searchPath.back().header;
 
     LeafEntry* leafMatch = GetNext(leafNode, key);
+    bool       isMatch   = IsMatch(leafNode, leafMatch, key);
+    Data       data      = isMatch ? leafMatch->data : Data();
 
-    if (IsMatch(leafNode, leafMatch, key)) return {true, leafMatch->data};
-    else return {false, Data()};
+    ReleasePath(searchPath);
+
+    return {isMatch, data};
   }
   /*
    * Page Info (struct)
@@ -129,17 +152,18 @@ class Btree : public HashInterface<Key, Data, HashFunction> {
   };
   /*
    * CreateNewPage
+   *
+   * The new page is initialized for its height and stays pinned once.
    */
   PageInfo
-  CreateNewPage() 
+  CreateNewPage(int nodeHeight) 
   {
-    PageId newPageId    = model_->create_page();
-    Header* header = load_page(newPageId);
-
-    InitializeHeader<LeafEntry>(*header, model_->get_page_size(), newPageId);
-    header->nodeHeight = 0;
+    auto newPage = nodeHeight == 0
+      ? CreateInitializedPage<Header, LeafEntry>(model_)
+      : CreateInitializedPage<Header, InteriorEntry>(model_);
+    newPage.second->nodeHeight = nodeHeight;
 
-    return {newPageId, header};
+    return {newPage.first, newPage.second};
   }
   /*
    * Split
@@ -149,14 +173,14 @@ class Btree : public HashInterface<Key, Data, HashFunction> {
       InteriorEntry* childEntry,
       Header*        childHeader) 
   {
-    PageInfo newPage = CreateNewPage();
+    PageInfo newPage = CreateNewPage(childHeader->nodeHeight);
 
     if (childHeader->IsLeaf())
     {
       SplitBtreeNode(
           parentNode,
           childEntry,
-          (LeafEntry*)childHeader,
+          (LeafNode*)childHeader,
           newPage.header
       );
 
@@ -165,10 +189,12 @@ class Btree : public HashInterface<Key, Data, HashFunction> {
       SplitBtreeNode(
           parentNode,
           childEntry,
-          (InteriorEntry*)childHeader,
+          (InteriorNode*)childHeader,
           newPage.header
       );
     }
+
+    model_->save_page(newPage.id, (char*)newPage.header);
   }
   /*
    * SplitRoot
@@ -176,9 +202,7 @@ class Btree : public HashInterface<Key, Data, HashFunction> {
   void SplitRoot() 
   {
     Header* rootHeader  = load_page(rootId_);
-    PageInfo     newRootPage = CreateNewPage();
-
-    newRootPage.header->nodeHeight = rootHeader->nodeHeight + 1;
+    PageInfo     newRootPage = CreateNewPage(rootHeader->nodeHeight + 1);
 
     auto newRoot = (InteriorNode*)newRootPage.header;
 
@@ -190,6 +214,9 @@ class Btree : public HashInterface<Key, Data, HashFunction> {
         rootHeader 
     );
 
+    model_->save_page(rootId_, (char*)rootHeader);
+    model_->save_page(newRootPage.id, (char*)newRootPage.header);
+
     rootId_ = newRootPage.id;
   }
   /*
@@ -201,7 +228,7 @@ class Btree : public HashInterface<Key, Data, HashFunction> {
   {
     auto leaf = (LeafNode*)path.back().header;
     
-    if (!leaf->IsFull()) return true;
+    if (!leaf->full()) return true;
 
     LeafEntry* iPoint = GetNext(leaf, key);
 
@@ -211,20 +238,53 @@ class Btree : public HashInterface<Key, Data, HashFunction> {
   }
   /*
    * MergeRoot
+   *
+   * The root has a single key left and its two children fit in one
+   * node: they are merged into the left one, which becomes the root.
    */
   void
-  MergeRoot()
+  MergeRoot(Path& path)
   {
-    auto root  = (InteriorNode*)load_page(rootId_);
-    auto left  = (InteriorNode*)load_page(root->begin()->data);
-    auto right = (InteriorNode*)load_page(root->end()->data);
+    auto root        = (InteriorNode*)load_page(rootId_);
+    Header* leftHeader  = load_page(root->begin()->data);
+    Header* rightHeader = load_page(root->end()->data);
+
+    if (leftHeader->IsLeaf())
+      MergeNode(root, root->begin(), (LeafNode*)leftHeader, (LeafNode*)rightHeader);
+    else
+      MergeNode(root, root->begin(), (InteriorNode*)leftHeader, (InteriorNode*)rightHeader);
 
-    MergeNode(root, root->begin(), left, right);
+    PageId oldRootId = rootId_;
+    PageId rightId   = rightHeader->pageId;
+
+    model_->save_page(rootId_, (char*)root);
+    model_->save_page(leftHeader->pageId, (char*)leftHeader);
+    model_->release_page(rightId);
     
-    rootId_ = left->header()->pageId;
+    rootId_ = leftHeader->pageId;
+
+    //the old root and the right node are empty now
+    FreePages(path, {oldRootId, rightId});
+  }
+  /*
+   * FreePages
+   *
+   * The pages may be on the path, which still pins them: the path is
+   * saved (and emptied) first.
+   */
+  void
+  FreePages(Path& path, std::initializer_list<PageId> pageIds)
+  {
+    SavePath(path);
+    path.clear();
+
+    for (auto pageId : pageIds) model_->free_page(pageId);
   }
   /*
    * PrepareInsertPath
+   *
+   * Splits the lowest node of the path which is full and has a parent
+   * with room (or the root), until the leaf has room for the key.
    */
   Path
   PrepareInsertPath(const Key& key)
@@ -236,7 +296,7 @@ class Btree : public HashInterface<Key, Data, HashFunction> {
       auto splitBegin = std::find_if(
           searchPath.rbegin(),
           searchPath.rend(),
-          [](const Header* header) { return !header->IsFull(); }
+          [](const PathVertex& v) { return !v.header->IsFull(); }
       );
 
       if (splitBegin == searchPath.rend()) SplitRoot();
@@ -244,9 +304,10 @@ class Btree : public HashInterface<Key, Data, HashFunction> {
       else Split(
               (InteriorNode*)splitBegin->header,
               (InteriorEntry*)splitBegin->childEntry,
-              --splitBegin->header
+              std::prev(splitBegin)->header
       );
 
+      SavePath(searchPath);
       searchPath = BtreePath(key);
     }
 
@@ -254,40 +315,82 @@ class Btree : public HashInterface<Key, Data, HashFunction> {
   }
   /*
    * Merge (SearchPath)
+   *
+   * mergeNode is at its minimum size and its parent can lose a key.  It
+   * is merged with a sibling when the two fit in one node, otherwise it
+   * takes an entry from the sibling.
    */
   void
   Merge(Path& path, Path::iterator mergeNode)
   {
     auto parentIt  = std::prev(mergeNode);
     auto parent    = (InteriorNode*)parentIt->header;
-    auto leftEntry = (InteriorEntry*)parent->childEntry;
+    auto leftEntry = (InteriorEntry*)parentIt->childEntry;
 
     if (leftEntry == parent->end()) --leftEntry;
 
-    Header* leftHeader = load_page(leftEntry->data);
+    bool    mergeLeft   = leftEntry == parentIt->childEntry;
+    PageId  leftId      = leftEntry->data;
+    PageId  rightId     = (leftEntry + 1)->data;
+    Header* leftHeader  = load_page(leftId);
+    Header* rightHeader = load_page(rightId);
 
-    if (leftHeader->IsLeaf())
+    size_t mergedSize = leftHeader->size + rightHeader->size + (leftHeader->IsLeaf() ? 0 : 1);
+
+    if (mergedSize > leftHeader->max_size)
     {
-      auto left = (LeafNode*)leftHeader;
-      auto right = std::next(left);
+      if (leftHeader->IsLeaf())
+      {
+        if (mergeLeft) ShiftLeft(leftEntry, (LeafNode*)leftHeader, (LeafNode*)rightHeader);
+        else ShiftRight(leftEntry, (LeafNode*)leftHeader, (LeafNode*)rightHeader);
+      }
+      else
+      {
+        if (mergeLeft) ShiftLeft(leftEntry, (InteriorNode*)leftHeader, (InteriorNode*)rightHeader);
+        else ShiftRight(leftEntry, (InteriorNode*)leftHeader, (InteriorNode*)rightHeader);
+      }
 
-      MergeNode(parent, leftEntry, left, right);
+      model_->save_page(leftId, (char*)leftHeader);
+      model_->save_page(rightId, (char*)rightHeader);
+      return;
+    }
 
-    } else {
+    if (parentIt->header->pageId == rootId_ && parent->size() == 1)
+    {
+      model_->release_page(leftId);
+      model_->release_page(rightId);
+      MergeRoot(path);
+      return;
+    }
+
+    if (leftHeader->IsLeaf())
+      MergeNode(parent, leftEntry, (LeafNode*)leftHeader, (LeafNode*)rightHeader);
+    else
+      MergeNode(parent, leftEntry, (InteriorNode*)leftHeader, (InteriorNode*)rightHeader);
 
-      auto left = (InteriorNode*)leftHeader;
-      auto right = std::next(left);
+    model_->save_page(leftHeader->pageId, (char*)leftHeader);
+    model_->release_page(rightId);
 
-      MergeNode(parent, leftEntry, left, right);
-    }
+    FreePages(path, {rightId});
+  }
+  /*
+   * CanLoseEntry
+   *
+   * (If the node stays at least half full without an entry, or it is the
+   * root and keeps a child)
+   */
+  bool CanLoseEntry(const Header* header) const
+  {
+    if (header->pageId == rootId_) return header->IsLeaf() || header->size > 1;
+    return header->size > header->max_size / 2;
   }
   /*
    * CanEraseKey
    */
   bool CanEraseKey(const Path& path, const Key& key)
   {
-    BtreeHeader* leaf = path.back().header;
-    if (leaf->IsHalf()) return true;
+    auto leaf = (LeafNode*)path.back().header;
+    if (CanLoseEntry(leaf->header())) return true;
 
     LeafEntry* ePoint = GetNext(leaf, key);
     if (!IsMatch(leaf,ePoint,key)) return true;
@@ -296,6 +399,9 @@ class Btree : public HashInterface<Key, Data, HashFunction> {
   }
   /*
    * PrepareErasePath
+   *
+   * Merges below the lowest node of the path which can lose a key (or
+   * the root), until the leaf can lose the key.
    */
   Path
   PrepareErasePath(const Key& key)
@@ -305,15 +411,17 @@ class Btree : public HashInterface<Key, Data, HashFunction> {
     while (!CanEraseKey(searchPath, key)) 
     {
       auto mergeBegin = std::find_if(
-          searchPath.rbegin(),
+          std::next(searchPath.rbegin()),
           searchPath.rend(),
-          [](const Header* header) { return !header->IsHalf(); }
+          [this](const PathVertex& v) { return CanLoseEntry(v.header); }
       );
 
-      if (mergeBegin == searchPath.rend() &&
-          mergeBegin->header->size == 1) MergeRoot();
-      else Merge(searchPath, mergeBegin);
+      if (mergeBegin == searchPath.rend()) mergeBegin = std::prev(searchPath.rend());
 
+      Merge(searchPath, mergeBegin.base());
+
+      //empty if the merge freed pages, which saves the path first
+      SavePath(searchPath);
       searchPath = BtreePath(key);
     }
     
@@ -331,9 +439,15 @@ class Btree : public HashInterface<Key, Data, HashFunction> {
 
     LeafEntry* ePoint = GetNext(leaf, key);
 
-    if (!IsMatch(leaf,ePoint,key)) return false;
+    if (!IsMatch(leaf,ePoint,key))
+    {
+      ReleasePath(searchPath);
+      return false;
+    }
 
     leaf->erase(ePoint);
+    --size_;
+    SavePath(searchPath);
     return true;
   }
   /*
@@ -346,17 +460,85 @@ class Btree : public HashInterface<Key, Data, HashFunction> {
 
     Path searchPath = PrepareInsertPath(key);
 
-    auto leaf = (LeafNode*)searchPath.back();
+    auto leaf = (LeafNode*)searchPath.back().header;
     
     LeafEntry* iPoint = GetNext(leaf, key);
 
     if (IsMatch(leaf,iPoint,key))
     {
       iPoint->data = data;
+      SavePath(searchPath);
       return;
     }
 
     leaf->insert(iPoint, iEntry);
+    ++size_;
+    SavePath(searchPath);
+  }
+  /*
+   * size
+   */
+  size_t size() const { return size_; }
+  /*
+   * RootId - with size, what a reader needs to open the tree
+   */
+  PageId RootId() const { return rootId_; }
+  /*
+   * SaveMeta
+   *
+   * Writes the root id and the size to a meta page, created by the
+   * first call, and returns its id; Btree(model, id, OpenTable()) opens
+   * the tree from there.  Splits and merges move the root, so the meta
+   * page describes the tree as of the last call.
+   */
+  PageId
+  SaveMeta()
+  {
+    std::string bytes;
+    AppendMeta(bytes, &rootId_);
+    AppendMeta(bytes, &size_);
+
+    SaveMetaPages(model_, bytes, metaPages_);
+    return metaPages_.front();
+  }
+  /*
+   * begin - the entries in key order
+   */
+  iterator
+  begin() const
+  {
+    PageIterator page(this);
+    return iterator(++page);
+  }
+  /*
+   * end
+   */
+  iterator
+  end() const
+  {
+    return iterator(PageIterator(this));
+  }
+  /*
+   * Compact
+   *
+   * Merges leave pages free; this lets the storage move the last pages
+   * into them and shrink.  A moved meta page is rewritten, SaveMeta
+   * then returns its new id.
+   */
+  size_t
+  Compact()
+  {
+    bool metaMoved = false;
+    size_t moved = model_->compact([this, &metaMoved](PageId from, PageId to) {
+        auto meta = std::find(metaPages_.begin(), metaPages_.end(), from);
+        if (meta == metaPages_.end()) return Relocate(from, to);
+
+        RelocatePage(model_, to);
+        *meta     = to;
+        metaMoved = true;
+    });
+    if (metaMoved) SaveMeta();
+    return moved;
   }
   /*
    * VerifyHeight
@@ -387,7 +569,7 @@ class Btree : public HashInterface<Key, Data, HashFunction> {
    * VerifyOrder
    */
   static bool
-  VerifyOrder(const Pages& pages, storage_model* model)
+  VerifyOrder(const Pages& pages)
   {
     if (pages.empty()) return true;
 
@@ -402,7 +584,7 @@ class Btree : public HashInterface<Key, Data, HashFunction> {
           if (!prev) {
             prev = new Key(entry.key);
           } else {
-            valid &= *prev < entry.key;
+            valid &= LessThan()(*prev, entry.key);
             *prev = entry.key;
           }
         }
@@ -415,18 +597,19 @@ class Btree : public HashInterface<Key, Data, HashFunction> {
           if (!prev) {
             prev = new Key(entry.key);
           } else {
-            valid &= *prev < entry.key;
+            valid &= LessThan()(*prev, entry.key);
             *prev = entry.key;
           }
         }
     }
 
     delete prev;
+    return valid;
   }
   /*
    * Verify
    */
-  bool
+  static bool
   Verify(const Pages& pages)
   {
     bool valid = true;
@@ -434,36 +617,48 @@ class Btree : public HashInterface<Key, Data, HashFunction> {
     if (pages.empty()) return valid;
 
     valid &= VerifyHeight(pages);
-    valid &= VerifyOrder(pages, model_);
+    valid &= VerifyOrder(pages);
 
     return valid;
   }
   /*
    * GetPages
+   *
+   * Loads a whole level with one request, so the storage can read the
+   * pages concurrently.
    */
-  static Pages 
-  GetPages(const std::vector<PageId>& level)
+  Pages 
+  GetPages(const std::vector<PageId>& level) const
   {
+    std::vector<char*> loaded(level.size());
+    model_->load_pages(level.data(), level.size(), loaded.data());
+
     Pages pages;
-    for (auto&& pid : level) pages.push_back(load_page(pid));
+    for (auto&& page : loaded) pages.push_back((Header*)page);
     return pages;
   }
   /*
    * GetNextLevel
+   *
+   * The children of interior nodes include the "past the end" entry.
+   * The next level is announced to the storage right away, so it is
+   * read ahead while the current level is verified.
    */
   std::vector<PageId>
-  GetNextLevel(const Pages& pages)
+  GetNextLevel(const Pages& pages) const
   {
     if (pages.empty() || pages.front()->IsLeaf()) return {};
 
     std::vector<PageId> nextLevel;
-    auto inserter = std::back_inserter(nextLevel);
     
     for (auto&& page : pages) {
-      auto node = *(InteriorNode*)page;
-      std::copy(node->begin(), node->end(), inserter);
+      auto node = (InteriorNode*)page;
+      for (auto&& entry : *node) nextLevel.push_back(entry.data);
+      nextLevel.push_back(node->end()->data);
     }
 
+    model_->prefetch_pages(nextLevel.data(), nextLevel.size());
+
     return nextLevel;
   }
   /*
@@ -480,14 +675,15 @@ class Btree : public HashInterface<Key, Data, HashFunction> {
       Pages pages = GetPages(level);
       valid &= Verify(pages);
       level = GetNextLevel(pages);
+      for (auto&& page : pages) model_->release_page(page->pageId);
     }
     return valid;
   }
   /*
    * IsEnd
    */
-  bool 
-  IsEnd(const void* entry, const Header* header) const
+  static bool 
+  IsEnd(const void* entry, const Header* header)
   {
     if (header->IsLeaf()) return ((LeafNode*)header)->end() == entry;
     else return ((InteriorNode*)header)->end() == entry;
@@ -495,206 +691,227 @@ class Btree : public HashInterface<Key, Data, HashFunction> {
   /*
    * IsBegin
    */
-  bool 
-  IsBegin(const void* entry, const Header* header) const
+  static bool 
+  IsBegin(const void* entry, const Header* header)
   {
     if (header->IsLeaf()) return ((LeafNode*)header)->begin() == entry;
     else return ((InteriorNode*)header)->begin() == entry;
   }
+  
+ private:
+
   /*
-   * Successor
+   * GetEdgeLeaf
+   *
+   * The first (or last) leaf of the subtree at pageId.  The leaves
+   * following it under the same parent are announced to the storage.
    */
-  iterator&
-  Successor(iterator& it)
+  PageId
+  GetEdgeLeaf(PageId pageId, bool first) const
   {
+    Header* header = load_page(pageId);
+
+    while (!header->IsLeaf()) {
+      auto node       = (InteriorNode*)header;
+      auto childEntry = first ? node->begin() : node->end();
+
+      if (header->nodeHeight == 1)
+      {
+        if (first) PrefetchPages(model_, childEntry + 1, node->end() + 1, GetChildId);
+        else PrefetchPages(
+            model_,
+            std::make_reverse_iterator(childEntry),
+            std::make_reverse_iterator(node->begin()),
+            GetChildId);
       }
-  /*
-   * Predecessor
-   */
-  iterator&
-  Predecessor(iterator& it)
-  {
-    Path searchPath = GetSearchPath(
-        rootId_,
-        it->entry_->key, 
-        [this](PageId pageId) { return this->model_->load_page(pageId); }
-    );
-
-    LeafNode* leaf = (LeafEntry*)searchPath.back().header;
 
-    if (searchPath.back().childEntry != leaf->begin()) 
-    {
-      --it->entry_;
-      return it;
+      PageId childId = childEntry->data;
+      model_->release_page(pageId);
+      pageId = childId;
+      header = load_page(pageId);
     }
 
-    auto branch = std::find_if(
-        searchPath.begin(),
-        searchPath.end(),
-        [](const PathVertex& v) { 
-          return !IsBegin(v.childEntry, v.header);
-        }
-    );
-
-    it->page_ = GetMinSubtree(*--branch);
-    it->entry_ = it->page_->begin();
-    return it;
+    model_->release_page(pageId);
+    return pageId;
   }
-  
- private:
 
+  static PageId GetChildId(const InteriorEntry& entry) { return entry.data; }
+ 
   /*
-   * GetMinSubtree
+   * load_page
+   */
+  Header*
+  load_page(PageId pageId) const 
+  { 
+    return (Header*)model_->load_page(pageId);
+  }
+  /*
+   * Relocate
+   *
+   * The parent of the moved node is found by searching for the first key
+   * of the node; the old page can not be loaded any more, so the search
+   * reads the new one in its place.
    */
-  LeafNode*
-  GetMinSubtree(PathVertex v) //TODO Better interface here..
+  void
+  Relocate(PageId from, PageId to)
   {
-    while (!v.header->IsLeaf()) {
-      PageId pageId = ((InteriorEntry*)v.childEntry)->data;
-      v.header = load_page(pageId);
-      v.childEntry = v.header + 1;
+    RelocatePage(model_, to);
+    if (from == rootId_)
+    {
+      rootId_ = to;
+      return;
     }
 
-    return (LeafNode*)v.header;
+    Header* moved = load_page(to);
+    int     height = moved->nodeHeight;
+    Key     key = moved->IsLeaf()
+                ? ((LeafNode*)moved)->begin()->key
+                : ((InteriorNode*)moved)->begin()->key;
+    model_->release_page(to);
+
+    Path searchPath = GetSearchPath(
+        rootId_,
+        key,
+        [this, from, to](PageId pageId) {
+          return this->model_->load_page(pageId == from ? to : pageId);
+        },
+        LessThan()
+    );
+
+    for (auto&& v : searchPath)
+    {
+      auto entry = (InteriorEntry*)v.childEntry;
+      if (v.header->nodeHeight == height + 1 && entry->data == from) entry->data = to;
+    }
+    SavePath(searchPath);
   }
   /*
-   * GetMaxAfter
+   * SavePath
+   *
+   * Every page of a search path was pinned by load_page.  After an
+   * operation which may have modified the path (insert, erase, split,
+   * merge) the pages are saved, which also unpins them.
    */
-  LeafNode*
-  GetMaxAfter(PathVertex v)
+  void
+  SavePath(const Path& path)
   {
-    while (!v.header->IsLeaf()) {
-      PageId pageId = ((InteriorEntry*)v.childEntry)->data;
-      v.header = load_page(pageId);
-      v.childEntry = v.header + 1;
-    }
-
-    return (LeafNode*)v.header;
+    for (auto&& v : path) model_->save_page(v.header->pageId, (char*)v.header);
   }
- 
   /*
-   * load_page
+   * ReleasePath
    */
-  Header*
-  load_page(PageId pageId) const 
-  { 
-    return (Header*)model_->load_page(pageId);
+  void
+  ReleasePath(const Path& path) const
+  {
+    for (auto&& v : path) model_->release_page(v.header->pageId);
   }
 
   PageId         rootId_;
-  storage_model* model_;
+  Storage* model_;
   size_t         size_;
+  std::vector<PageId> metaPages_;
 
  public:
 
-  class PageIterator : public PageIteratorBase<LeafNode, Table> {
+  /*
+   * PageIterator
+   *
+   * Walks the leaves in key order.  The next leaf is found again from
+   * the root by the first key of the current one: it is the first leaf
+   * after the deepest node on the path which does not end there.
+   */
+  class PageIterator : public PageIteratorBase<LeafNode, Storage> {
     public:
-      using PageIteratorBase<LeafNode, Table>::page_;
-      using PageIteratorBase<LeafNode, Table>::table_;
+      using PageIteratorBase<LeafNode, Storage>::page_;
 
-      PageIterator& operator++() override {
-        storage_model* model_  = table_->model_;
-        PageId         rootId_ = table_->rootId_;
+      PageIterator(const Table* table) :
+        PageIteratorBase<LeafNode, Storage>(table->model_),
+        table_(table) {}
 
+      PageIterator& operator++() {
         if (page_ == nullptr)
         {
-          page_ = model_->load_page(rootId_);
+          this->Load(table_->GetEdgeLeaf(table_->rootId_, true));
+          return *this;
         }
-        else
+        //only an empty root is an empty leaf
+        if (page_->empty())
         {
-          Path searchPath = GetSearchPath(
-              rootId_,
-              page_->begin()->key;
-              [table_](PageId pageId) { return table_->model_->load_page(pageId); }
-              );
-
-          auto branch = std::find_if(
-              searchPath.rbegin(),
-              searchPath.rend(),
-              [](const PathVertex& v) { return !IsEnd(v.childEntry, v.header); }
-              );
-
-          if (branch == searchPath.rend())
-          {
-            page_ =  nullptr;
-          }
-          else
-          {
-            NextChildEntry(branch);
-            while (!branch->header->IsLeaf())
-            {
-              PageId nextPage = ((InteriorEntry*)branch->childEntry)->data;
-              branch->header = table_->model_->load_page(nextPage);
-              branch->childEntry = ((InteriorPage*)branch->header)->begin();
-            }
-            page_ = branch->header;
-          }
+          this->Release();
+          return *this;
         }
-        return *this;
-      }
-      PageIterator& operator--() override {
-        storage_model* model_  = table_->model_;
-        PageId         rootId_ = table_->rootId_;
 
-        if (page_ == nullptr)
+        Path searchPath = table_->BtreePath(page_->begin()->key);
+
+        auto branch = std::find_if(
+            std::next(searchPath.rbegin()),
+            searchPath.rend(),
+            [](const PathVertex& v) { return !IsEnd(v.childEntry, v.header); }
+            );
+
+        if (branch == searchPath.rend())
         {
-          page_ = model_->load_page(rootId_);
+          this->Release();
         }
         else
         {
-          Path searchPath = GetSearchPath(
-              rootId_,
-              page_->begin()->key;
-              [table_](PageId pageId) { return table_->model_->load_page(pageId); }
-              );
-
-          auto branch = std::find_if(
-              searchPath.rbegin(),
-              searchPath.rend(),
-              [](const PathVertex& v) { return !IsBegin(v.childEntry, v.header); }
-              );
-
-          if (branch == searchPath.rend())
-          {
-            page_ =  nullptr;
-          }
-          else
-          {
-            PrevChildEntry(branch);
-            while (!branch->header->IsLeaf())
-            {
-              PageId nextPage = ((InteriorEntry*)branch->childEntry)->data;
-              branch->header = table_->model_->load_page(nextPage);
-              branch->childEntry = --((InteriorPage*)branch->header)->end();
-            }
-            page_ = branch->header;
-          }
+          auto childEntry = (InteriorEntry*)branch->childEntry + 1;
+          auto node       = (InteriorNode*)branch->header;
+          //the following leaves are visited next
+          if (branch->header->nodeHeight == 1) PrefetchPages(
+              table_->model_, childEntry + 1, node->end() + 1, GetChildId);
+
+          this->Load(table_->GetEdgeLeaf(childEntry->data, true));
         }
+
+        table_->ReleasePath(searchPath);
         return *this;
       }
-
-     private:
-
-      void AdvanceChildEntry(PathVertex& v) {
-        if (v.header->IsLeaf())
+      PageIterator& operator--() {
+        if (page_ == nullptr)
         {
-          ++((LeafEntry*)v.childEntry);
+          this->Load(table_->GetEdgeLeaf(table_->rootId_, false));
+          return *this;
         }
-        else
+        if (page_->empty())
         {
-          ++((InteriorEntry*)v.childEntry);
+          this->Release();
+          return *this;
         }
-      }
-      void PrevChildEntry(PathVertex& v) {
-        if (v.header->IsLeaf())
+
+        Path searchPath = table_->BtreePath(page_->begin()->key);
+
+        auto branch = std::find_if(
+            std::next(searchPath.rbegin()),
+            searchPath.rend(),
+            [](const PathVertex& v) { return !IsBegin(v.childEntry, v.header); }
+            );
+
+        if (branch == searchPath.rend())
         {
-          --((LeafEntry*)v.childEntry);
+          this->Release();
         }
         else
         {
-          --((InteriorEntry*)v.childEntry);
+          auto childEntry = (InteriorEntry*)branch->childEntry - 1;
+          auto node       = (InteriorNode*)branch->header;
+          //the preceding leaves are visited next
+          if (branch->header->nodeHeight == 1) PrefetchPages(
+              table_->model_,
+              std::make_reverse_iterator(childEntry),
+              std::make_reverse_iterator(node->begin()),
+              GetChildId);
+
+          this->Load(table_->GetEdgeLeaf(childEntry->data, false));
         }
+
+        table_->ReleasePath(searchPath);
+        return *this;
       }
+
+     private:
+
+      const Table* table_;
   };
 
 }; //struct Btree
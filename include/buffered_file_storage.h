@@ -0,0 +1,1040 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "page_io_engine.h"
+#include "storage_model.h"
+
+/**
+ * File-backed implementation of the memory model with a fixed budget
+ * of page frames held in the primary memory.
+ *
+ * Page with address A lives in the backing file at offset A * page_size.
+ * When a page is not resident it is read into a free frame; when there
+ * is no free frame a victim is chosen by the CLOCK algorithm and, if it
+ * is dirty, written back to the file first.
+ *
+ * Every call of create_page and load_page pins the frame of the page,
+ * every call of release_page and save_page unpins it. A pinned frame is
+ * never evicted, so the returned pointer stays valid until the matching
+ * release_page or save_page. If all frames are pinned a page can not be
+ * brought in and std::runtime_error is thrown.
+ *
+ * Changes made through the page pointer reach the file only after
+ * update_page or save_page was called for the page (or the page was
+ * created and has not been written yet). Both functions mark the frame
+ * dirty; the actual write happens on eviction or in flush.
+ *
+ * load_page_async and load_pages_async reserve and pin a frame for each
+ * missing page and read them through a page_io_engine (io_uring, or a
+ * thread pool when it is not available), so many reads can be in flight
+ * at once. A load_page of a page which is still being read waits for
+ * the read. load_pages uses the same path and waits for the whole batch.
+ * prefetch_pages does not take frames: it asks the kernel to read the
+ * missing pages into its page cache (posix_fadvise), so the following
+ * load_page is served without waiting for the device.
+ *
+ * Freed pages are listed in a free-space map, which create_page takes
+ * from before it extends the file. The map is kept in a file next to
+ * the backing file (path + ".fsm") and written by flush. A bit per page
+ * tells free pages apart, so freeing a free page throws instead of
+ * handing the page to two owners later. compact moves
+ * the last live pages into the lowest free pages and truncates the
+ * backing file.
+ *
+ * start_flusher starts a background thread which writes dirty frames
+ * ahead of their eviction, so that a foreground load rarely has to
+ * write a victim first. It wakes up every flush interval, or as soon as
+ * more than the background ratio of the frames is dirty, collects the
+ * dirty unpinned frames, sorts them by address and writes them in
+ * batches, one write per run of consecutive addresses. The frames are
+ * copied under the mutex and written without it; a frame is only marked
+ * clean if it was not changed again in the meantime. While the flusher
+ * runs, CLOCK passes over dirty frames once before it evicts one, and a
+ * save_page or update_page which finds more than the limit ratio of the
+ * frames dirty waits for the flusher (as long as it makes progress).
+ *
+ * All functions may be called from several threads.
+ */
+class buffered_file_storage final : public storage_model {
+
+public:
+
+	buffered_file_storage(const std::string& path, size_t page_size, size_t frame_count) {
+		this->path = path;
+		this->page_size = page_size;
+		this->clock_hand = 0;
+		this->free_map_dirty = false;
+		this->dirty_count = 0;
+		this->background_ratio = 0.1;
+		this->limit_ratio = 0.4;
+		this->flusher_batch = 0;
+		this->flusher_running = false;
+		this->flusher_stopping = false;
+		this->flush_requested = false;
+		this->flusher_pass = 0;
+		this->flusher_stalled = false;
+		this->background_write_count = 0;
+		this->arena = nullptr;
+		this->fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+		if (fd < 0) {
+			throw_io_error("open " + path);
+		}
+		// The destructor does not run for a storage which is not built.
+		try {
+			struct stat info;
+			if (::fstat(fd, &info) != 0) {
+				throw_io_error("stat " + path);
+			}
+			page_count = info.st_size / page_size;
+			frames.resize(frame_count);
+			arena = new char[frame_count * page_size];
+			page_table.reserve(frame_count);
+			free_flags.assign(page_count, false);
+			read_free_map();
+		} catch (...) {
+			delete[] arena;
+			::close(fd);
+			throw;
+		}
+	}
+
+	/**
+	 * Writes the dirty frames; an error is dropped here, call flush
+	 * first to see it.
+	 */
+	~buffered_file_storage() {
+		engine.reset();
+		stop_flusher();
+		try {
+			flush();
+		} catch (const std::exception&) {
+		}
+		::close(fd);
+		delete[] arena;
+	}
+
+	size_t get_page_size() const {
+		return page_size;
+	}
+
+	size_t create_page() {
+		std::lock_guard<std::mutex> lock(mutex);
+		size_t address;
+		if (free_pages.empty()) {
+			address = page_count++;
+			// Bits beyond the end may be left over from a compact.
+			free_flags.resize(page_count);
+		} else {
+			address = free_pages.back();
+			free_pages.pop_back();
+			free_map_dirty = true;
+		}
+		free_flags[address] = false;
+		size_t index = acquire_frame(address);
+		std::memset(frame_data(index), 0, page_size);
+		mark_dirty(index);
+		return address;
+	}
+
+	char* load_page(size_t address) {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			auto iter = page_table.find(address);
+			if (iter == page_table.end()) {
+				break;
+			}
+			size_t index = iter->second;
+			if (!frames[index].loading) {
+				pin(index);
+				return frame_data(index);
+			}
+			loaded.wait(lock);
+		}
+		check_address(address);
+		size_t index = acquire_frame(address);
+		try {
+			read_frame(index);
+		} catch (...) {
+			release_frame(index);
+			throw;
+		}
+		return frame_data(index);
+	}
+
+	void save_page(size_t address, char* page) {
+		std::unique_lock<std::mutex> lock(mutex);
+		size_t index = page_table.at(address);
+		mark_dirty(index);
+		unpin(frames[index]);
+		throttle(lock);
+	}
+
+	void update_page(size_t address, char* page) {
+		std::unique_lock<std::mutex> lock(mutex);
+		mark_dirty(page_table.at(address));
+		throttle(lock);
+	}
+
+	void release_page(size_t address) {
+		std::lock_guard<std::mutex> lock(mutex);
+		unpin(frames[page_table.at(address)]);
+	}
+
+	void free_page(size_t address) {
+		std::lock_guard<std::mutex> lock(mutex);
+		check_address(address);
+		if (free_flags[address]) {
+			throw std::runtime_error("buffered_file_storage: page " + std::to_string(address) + " is already free");
+		}
+		auto iter = page_table.find(address);
+		if (iter != page_table.end()) {
+			frame& resident = frames[iter->second];
+			if (resident.pin_count > 0) {
+				throw std::runtime_error("buffered_file_storage: page " + std::to_string(address) + " is pinned");
+			}
+			mark_clean(resident);
+			resident.used = false;
+			page_table.erase(iter);
+		}
+		free_pages.push_back(address);
+		free_flags[address] = true;
+		free_map_dirty = true;
+	}
+
+	/**
+	 * A moved page is read from its frame or the file and written to its
+	 * new place directly, without taking a frame. The mutex is not held
+	 * while relocate runs, so it may load pages.
+	 *
+	 * The free pages to fill are taken off the free list first, so a
+	 * create_page or free_page while relocate runs does not touch them;
+	 * the ones left over go back to the list at the end, also when a
+	 * move fails. Every page to move is checked for pins before the
+	 * first one is moved.
+	 */
+	size_t compact(relocate_callback relocate) {
+		std::vector<char> buffer(page_size);
+		std::unique_lock<std::mutex> lock(mutex);
+		std::vector<size_t> slots;
+		slots.swap(free_pages);
+		std::sort(slots.begin(), slots.end());
+		size_t first = 0;
+		size_t moved = 0;
+		try {
+			check_movable(slots);
+			while (first < slots.size()) {
+				size_t top = page_count - 1;
+				if (slots.back() == top) {
+					slots.pop_back();
+					--page_count;
+					continue;
+				}
+				// The top page is live and every remaining slot is below it.
+				size_t to = slots[first];
+				move_page(top, to, buffer.data());
+				free_flags[to] = false;
+				++first;
+				--page_count;
+				lock.unlock();
+				relocate(top, to);
+				lock.lock();
+				++moved;
+			}
+		} catch (...) {
+			if (!lock.owns_lock()) {
+				lock.lock();
+			}
+			return_slots(slots, first);
+			throw;
+		}
+		return_slots(slots, first);
+		{
+			// A write of the flusher still in progress may be beyond the end.
+			std::lock_guard<std::mutex> io_lock(write_mutex);
+			if (::ftruncate(fd, (off_t)(page_count * page_size)) != 0) {
+				throw_io_error("truncate " + path);
+			}
+		}
+		write_free_map();
+		return moved;
+	}
+
+	void prefetch_pages(const size_t* addresses, size_t count) {
+		std::vector<size_t> missing;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (size_t i = 0; i < count; ++i) {
+				if (addresses[i] < page_count && page_table.count(addresses[i]) == 0) {
+					missing.push_back(addresses[i]);
+				}
+			}
+		}
+		// One advice per run of consecutive pages.
+		std::sort(missing.begin(), missing.end());
+		for (size_t first = 0; first < missing.size(); ) {
+			size_t last = first + 1;
+			while (last < missing.size() && missing[last] <= missing[last - 1] + 1) {
+				++last;
+			}
+			off_t offset = (off_t)(missing[first] * page_size);
+			off_t length = (off_t)((missing[last - 1] - missing[first] + 1) * page_size);
+			::posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+			first = last;
+		}
+	}
+
+	void load_pages(const size_t* addresses, size_t count, char** pages) {
+		std::mutex batch_mutex;
+		std::condition_variable batch_done;
+		size_t remaining = count;
+		bool failed = false;
+		std::unordered_map<size_t, char*> loaded_pages;
+
+		load_pages_async(addresses, count, [&](size_t address, char* page) {
+			std::lock_guard<std::mutex> lock(batch_mutex);
+			loaded_pages[address] = page;
+			failed |= page == nullptr;
+			if (--remaining == 0) {
+				batch_done.notify_one();
+			}
+		});
+
+		std::unique_lock<std::mutex> lock(batch_mutex);
+		batch_done.wait(lock, [&remaining]() { return remaining == 0; });
+		if (failed) {
+			for (size_t i = 0; i < count; ++i) {
+				if (loaded_pages[addresses[i]]) {
+					release_page(addresses[i]);
+				}
+			}
+			throw std::runtime_error("buffered_file_storage: can not load all pages of the batch");
+		}
+		for (size_t i = 0; i < count; ++i) {
+			pages[i] = loaded_pages[addresses[i]];
+		}
+	}
+
+	void load_page_async(size_t address, page_callback callback) {
+		load_pages_async(&address, 1, std::move(callback));
+	}
+
+	/**
+	 * Resident pages are handed to the callback right away, on the
+	 * calling thread. The reads of the others are submitted as one batch;
+	 * their callbacks run on a thread of the page_io_engine. Pages which
+	 * get no frame, because all frames are pinned, are handed over as
+	 * nullptr.
+	 */
+	void load_pages_async(const size_t* addresses, size_t count, page_callback callback) {
+		std::vector<std::pair<size_t, char*>> resident;
+		std::vector<size_t> joined;
+		std::vector<size_t> reads;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			if (!engine) {
+				engine = page_io_engine::create();
+			}
+			for (size_t i = 0; i < count; ++i) {
+				check_address(addresses[i]);
+			}
+			try {
+				for (size_t i = 0; i < count; ++i) {
+					size_t address = addresses[i];
+					auto iter = page_table.find(address);
+					if (iter != page_table.end()) {
+						size_t index = iter->second;
+						pin(index);
+						if (frames[index].loading) {
+							frames[index].waiters.push_back(callback);
+							joined.push_back(index);
+						} else {
+							resident.push_back(std::make_pair(address, frame_data(index)));
+						}
+						continue;
+					}
+					if (!has_victim()) {
+						resident.push_back(std::make_pair(address, nullptr));
+						continue;
+					}
+					size_t index = acquire_frame(address);
+					frames[index].loading = true;
+					frames[index].waiters.push_back(callback);
+					reads.push_back(index);
+				}
+			} catch (...) {
+				abandon_batch(resident, joined, reads);
+				lock.unlock();
+				loaded.notify_all();
+				throw;
+			}
+		}
+		// The engine may block until earlier reads complete, and their
+		// completions take the mutex, so submit without holding it.
+		for (size_t index : reads) {
+			off_t offset = (off_t)(frames[index].address * page_size);
+			engine->submit_read(fd, frame_data(index), page_size, offset,
+				[this, index](ssize_t result) { finish_read(index, result); });
+		}
+		if (!reads.empty()) {
+			engine->submit();
+		}
+		for (auto& page : resident) {
+			callback(page.first, page.second);
+		}
+	}
+
+public:
+
+	/**
+	 * Use the given engine for asynchronous loads instead of the one
+	 * page_io_engine::create picks. Must not be called while asynchronous
+	 * loads are in flight.
+	 */
+	void set_io_engine(std::unique_ptr<page_io_engine> engine) {
+		this->engine = std::move(engine);
+	}
+
+	/**
+	 * Write all dirty frames to the backing file. Frames stay resident.
+	 */
+	void flush() {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (flusher_error) {
+			std::exception_ptr error = flusher_error;
+			flusher_error = nullptr;
+			std::rethrow_exception(error);
+		}
+		for (size_t index = 0; index < frames.size(); ++index) {
+			if (frames[index].used && frames[index].dirty) {
+				write_frame(index);
+			}
+		}
+		if (free_map_dirty) {
+			write_free_map();
+		}
+	}
+
+	/**
+	 * Start the background flusher, which writes at most batch_pages
+	 * pages per write and wakes up at least every interval.
+	 */
+	void start_flusher(size_t batch_pages = 64, std::chrono::milliseconds interval = std::chrono::milliseconds(100)) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (flusher_running) {
+			return;
+		}
+		flusher_batch = std::max(batch_pages, (size_t)1);
+		flusher_interval = interval;
+		flusher_stopping = false;
+		flusher_running = true;
+		flusher = std::thread(&buffered_file_storage::run_flusher, this);
+	}
+
+	/**
+	 * Stop the background flusher; dirty frames stay dirty.
+	 */
+	void stop_flusher() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!flusher_running) {
+				return;
+			}
+			flusher_stopping = true;
+		}
+		flusher_wakeup.notify_one();
+		flusher.join();
+		std::lock_guard<std::mutex> lock(mutex);
+		flusher_running = false;
+		flusher_stopping = false;
+		cleaned.notify_all();
+	}
+
+	/**
+	 * The flusher starts writing when more than background of the frames
+	 * are dirty; writers wait for it when more than limit are dirty.
+	 */
+	void set_dirty_limits(double background, double limit) {
+		std::lock_guard<std::mutex> lock(mutex);
+		background_ratio = background;
+		limit_ratio = std::max(limit, background);
+	}
+
+	size_t get_dirty_page_count() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return dirty_count;
+	}
+
+	/**
+	 * Number of pages written by the background flusher.
+	 */
+	size_t get_background_write_count() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return background_write_count;
+	}
+
+	size_t get_page_count() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return page_count;
+	}
+
+	size_t get_frame_count() const {
+		return frames.size();
+	}
+
+	size_t get_free_page_count() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return free_pages.size();
+	}
+
+private:
+
+	struct frame {
+		size_t address = 0;
+		size_t pin_count = 0;
+		bool used = false;
+		bool dirty = false;
+		// Counts the changes, so the flusher sees changes made while it wrote.
+		uint64_t version = 0;
+		bool referenced = false;
+		bool loading = false;
+		std::vector<page_callback> waiters;
+	};
+
+	char* frame_data(size_t index) const {
+		return arena + index * page_size;
+	}
+
+	void pin(size_t index) {
+		++frames[index].pin_count;
+		frames[index].referenced = true;
+	}
+
+	static void unpin(frame& resident) {
+		if (resident.pin_count > 0) {
+			--resident.pin_count;
+		}
+	}
+
+	void mark_dirty(size_t index) {
+		frame& resident = frames[index];
+		if (!resident.dirty) {
+			resident.dirty = true;
+			++dirty_count;
+		}
+		++resident.version;
+	}
+
+	void mark_clean(frame& resident) {
+		if (resident.dirty) {
+			resident.dirty = false;
+			--dirty_count;
+		}
+	}
+
+	void check_address(size_t address) const {
+		if (address >= page_count) {
+			throw std::out_of_range("buffered_file_storage: no page " + std::to_string(address));
+		}
+	}
+
+	/**
+	 * Completion of an asynchronous read. A failed read gives the frame
+	 * up again, so a later load_page retries it.
+	 */
+	void finish_read(size_t index, ssize_t result) {
+		std::vector<page_callback> waiters;
+		size_t address;
+		char* page = frame_data(index);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			frame& resident = frames[index];
+			address = resident.address;
+			waiters.swap(resident.waiters);
+			resident.loading = false;
+			if (result < 0) {
+				release_frame(index);
+				page = nullptr;
+			} else if ((size_t)result < page_size) {
+				// Created page which was never written; the rest is zeros.
+				std::memset(page + result, 0, page_size - result);
+			}
+		}
+		loaded.notify_all();
+		for (auto& waiter : waiters) {
+			waiter(address, page);
+		}
+	}
+
+	/**
+	 * Undoes a load_pages_async whose frames could not all be taken:
+	 * the pins and callbacks it added go away, and the frames it
+	 * reserved are given up and no longer loading, so a load_page
+	 * waiting for them goes on. Called under the mutex, in which all of
+	 * the batch was set up, so its callbacks are the last ones added.
+	 */
+	void abandon_batch(const std::vector<std::pair<size_t, char*>>& resident,
+			const std::vector<size_t>& joined, const std::vector<size_t>& reads) {
+		for (const auto& page : resident) {
+			if (page.second != nullptr) {
+				unpin(frames[page_table.at(page.first)]);
+			}
+		}
+		for (auto index = joined.rbegin(); index != joined.rend(); ++index) {
+			frames[*index].waiters.pop_back();
+			unpin(frames[*index]);
+		}
+		for (size_t index : reads) {
+			frames[index].loading = false;
+			frames[index].waiters.clear();
+			release_frame(index);
+		}
+	}
+
+	/**
+	 * Find a frame for the page at the given address, evicting an unpinned
+	 * page if necessary. The returned frame is pinned and mapped to the
+	 * address, its content is undefined.
+	 */
+	size_t acquire_frame(size_t address) {
+		size_t index = find_victim();
+		frame& victim = frames[index];
+		if (victim.used) {
+			if (victim.dirty) {
+				write_frame(index);
+			}
+			page_table.erase(victim.address);
+		}
+		victim.address = address;
+		victim.pin_count = 1;
+		victim.used = true;
+		victim.referenced = true;
+		page_table[address] = index;
+		return index;
+	}
+
+	/**
+	 * Gives up a frame taken by acquire_frame whose page could not be read.
+	 */
+	void release_frame(size_t index) {
+		frame& resident = frames[index];
+		page_table.erase(resident.address);
+		resident.used = false;
+		resident.pin_count = 0;
+	}
+
+	/**
+	 * Throws if one of the pages compact would move into the sorted
+	 * slots is pinned.
+	 */
+	void check_movable(const std::vector<size_t>& slots) const {
+		size_t count = page_count;
+		size_t first = 0;
+		size_t last = slots.size();
+		while (first < last) {
+			size_t top = --count;
+			if (slots[last - 1] == top) {
+				--last;
+				continue;
+			}
+			auto iter = page_table.find(top);
+			if (iter != page_table.end() && frames[iter->second].pin_count > 0) {
+				throw std::runtime_error("buffered_file_storage: page " + std::to_string(top) + " is pinned");
+			}
+			++first;
+		}
+	}
+
+	/**
+	 * Copies the live page at from to the free page at to, taking the
+	 * page out of its frame if it is resident.
+	 */
+	void move_page(size_t from, size_t to, char* buffer) {
+		auto iter = page_table.find(from);
+		if (iter != page_table.end()) {
+			frame& resident = frames[iter->second];
+			if (resident.pin_count > 0) {
+				throw std::runtime_error("buffered_file_storage: page " + std::to_string(from) + " is pinned");
+			}
+			std::memcpy(buffer, frame_data(iter->second), page_size);
+			write_page(to, buffer);
+			mark_clean(resident);
+			resident.used = false;
+			page_table.erase(iter);
+		} else {
+			read_page(from, buffer);
+			write_page(to, buffer);
+		}
+	}
+
+	/**
+	 * Puts the slots compact did not fill back on the free list, and
+	 * drops free pages freed meanwhile beyond the end of the file.
+	 */
+	void return_slots(const std::vector<size_t>& slots, size_t first) {
+		free_pages.insert(free_pages.end(), slots.begin() + first, slots.end());
+		free_pages.erase(std::remove_if(free_pages.begin(), free_pages.end(),
+			[this](size_t address) { return address >= page_count; }), free_pages.end());
+		free_flags.assign(page_count, false);
+		for (size_t address : free_pages) {
+			free_flags[address] = true;
+		}
+		free_map_dirty = true;
+	}
+
+	bool has_victim() const {
+		for (const frame& candidate : frames) {
+			if (!candidate.used || candidate.pin_count == 0) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * CLOCK sweep: skip pinned frames, give referenced frames a second
+	 * chance. Two full turns without a victim mean every frame is pinned.
+	 * While the flusher runs, dirty frames get a second chance too, and
+	 * a third turn takes them.
+	 */
+	size_t find_victim() {
+		size_t turns = flusher_running ? 3 : 2;
+		for (size_t step = 0; step < turns * frames.size(); ++step) {
+			size_t index = clock_hand;
+			clock_hand = (clock_hand + 1) % frames.size();
+			frame& candidate = frames[index];
+			if (!candidate.used) {
+				return index;
+			}
+			if (candidate.pin_count > 0) {
+				continue;
+			}
+			if (candidate.referenced) {
+				candidate.referenced = false;
+				continue;
+			}
+			if (candidate.dirty && step < 2 * frames.size() && flusher_running) {
+				flusher_wakeup.notify_one();
+				continue;
+			}
+			return index;
+		}
+		throw std::runtime_error("buffered_file_storage: all frames are pinned");
+	}
+
+	void read_frame(size_t index) {
+		read_page(frames[index].address, frame_data(index));
+	}
+
+	void write_frame(size_t index) {
+		write_page(frames[index].address, frame_data(index));
+		mark_clean(frames[index]);
+	}
+
+	void read_page(size_t address, char* data) {
+		off_t offset = (off_t)(address * page_size);
+		size_t done = 0;
+		while (done < page_size) {
+			ssize_t count = ::pread(fd, data + done, page_size - done, offset + done);
+			if (count < 0 && errno == EINTR) {
+				continue;
+			}
+			if (count < 0) {
+				throw_io_error("read page " + std::to_string(address));
+			}
+			if (count == 0) {
+				// Created page which was never written; the rest is zeros.
+				std::memset(data + done, 0, page_size - done);
+				break;
+			}
+			done += count;
+		}
+	}
+
+	/**
+	 * Waits for a write of the flusher in progress, which may hold an
+	 * older copy of the same page.
+	 */
+	void write_page(size_t address, const char* data) {
+		std::lock_guard<std::mutex> io_lock(write_mutex);
+		write_pages(address, data, 1);
+	}
+
+	void write_pages(size_t address, const char* data, size_t count) {
+		size_t size = count * page_size;
+		off_t offset = (off_t)(address * page_size);
+		size_t done = 0;
+		while (done < size) {
+			ssize_t count = ::pwrite(fd, data + done, size - done, offset + done);
+			if (count < 0 && errno == EINTR) {
+				continue;
+			}
+			if (count < 0) {
+				throw_io_error("write page " + std::to_string(address));
+			}
+			done += count;
+		}
+	}
+
+	size_t dirty_threshold(double ratio) const {
+		return (size_t)(ratio * frames.size());
+	}
+
+	/**
+	 * Makes a writer wait while too many frames are dirty, until the
+	 * flusher brought them below the limit or found nothing to write.
+	 */
+	void throttle(std::unique_lock<std::mutex>& lock) {
+		if (!flusher_running || dirty_count <= dirty_threshold(limit_ratio)) {
+			return;
+		}
+		flush_requested = true;
+		flusher_wakeup.notify_one();
+		uint64_t pass = flusher_pass;
+		cleaned.wait(lock, [this, pass]() {
+			return dirty_count <= dirty_threshold(limit_ratio) || flusher_stopping || !flusher_running ||
+				(flusher_pass != pass && flusher_stalled);
+		});
+	}
+
+	struct flush_entry {
+		size_t address;
+		size_t index;
+		uint64_t version;
+	};
+
+	void run_flusher() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (!flusher_stopping) {
+			bool signalled = flusher_wakeup.wait_for(lock, flusher_interval, [this]() {
+				return flusher_stopping || flush_requested || dirty_count > dirty_threshold(background_ratio);
+			});
+			if (flusher_stopping) {
+				break;
+			}
+			flush_requested = false;
+			// A timed wake-up writes everything, a signalled one down to the background ratio.
+			size_t target = signalled ? dirty_threshold(background_ratio) : 0;
+			flusher_stalled = false;
+			try {
+				while (dirty_count > target && !flusher_stopping) {
+					if (write_back_batch(lock) == 0) {
+						flusher_stalled = true;
+						break;
+					}
+				}
+			} catch (...) {
+				flusher_error = std::current_exception();
+				flusher_stalled = true;
+			}
+			++flusher_pass;
+			cleaned.notify_all();
+		}
+	}
+
+	/**
+	 * Writes the dirty unpinned frames with the lowest addresses, at
+	 * most flusher_batch of them. Called and returns with the mutex held.
+	 */
+	size_t write_back_batch(std::unique_lock<std::mutex>& lock) {
+		std::vector<flush_entry> batch;
+		for (size_t index = 0; index < frames.size(); ++index) {
+			const frame& candidate = frames[index];
+			if (candidate.used && candidate.dirty && candidate.pin_count == 0 && !candidate.loading) {
+				batch.push_back({candidate.address, index, candidate.version});
+			}
+		}
+		std::sort(batch.begin(), batch.end(), [](const flush_entry& left, const flush_entry& right) {
+			return left.address < right.address;
+		});
+		if (batch.size() > flusher_batch) {
+			batch.resize(flusher_batch);
+		}
+		if (batch.empty()) {
+			return 0;
+		}
+		flush_buffer.resize(batch.size() * page_size);
+		for (size_t entry = 0; entry < batch.size(); ++entry) {
+			std::memcpy(&flush_buffer[entry * page_size], frame_data(batch[entry].index), page_size);
+		}
+		// Take the write lock before the mutex is released, so a foreground
+		// write of a newer copy of one of the pages waits for this one.
+		std::unique_lock<std::mutex> io_lock(write_mutex);
+		lock.unlock();
+		std::exception_ptr error;
+		try {
+			for (size_t first = 0; first < batch.size(); ) {
+				size_t last = first + 1;
+				while (last < batch.size() && batch[last].address == batch[last - 1].address + 1) {
+					++last;
+				}
+				write_pages(batch[first].address, &flush_buffer[first * page_size], last - first);
+				first = last;
+			}
+		} catch (...) {
+			error = std::current_exception();
+		}
+		io_lock.unlock();
+		lock.lock();
+		if (error) {
+			std::rethrow_exception(error);
+		}
+		for (const flush_entry& entry : batch) {
+			frame& written = frames[entry.index];
+			if (written.used && written.address == entry.address && written.version == entry.version) {
+				mark_clean(written);
+			}
+		}
+		background_write_count += batch.size();
+		return batch.size();
+	}
+
+	/**
+	 * The free-space map file: a header, then the 64-bit addresses of
+	 * the free pages. It is replaced as a whole, through a temporary file.
+	 */
+	struct free_map_header {
+		char magic[8];
+		uint64_t free_count;
+		uint64_t checksum;
+	};
+
+	static const char* free_map_magic() {
+		return "DOPFSM";
+	}
+
+	std::string free_map_path() const {
+		return path + ".fsm";
+	}
+
+	void read_free_map() {
+		std::ifstream stream(free_map_path(), std::ios::in | std::ios::binary);
+		free_map_header header;
+		if (!stream.read((char*)&header, sizeof(header))) {
+			return;
+		}
+		if (std::memcmp(header.magic, free_map_magic(), sizeof(header.magic)) != 0 ||
+				header.free_count > page_count) {
+			throw std::runtime_error("buffered_file_storage: " + free_map_path() + " is not a free-space map");
+		}
+		std::vector<uint64_t> addresses(header.free_count);
+		if (!stream.read((char*)addresses.data(), addresses.size() * sizeof(uint64_t)) ||
+				page_checksum(page_checksum_seed, (const char*)addresses.data(),
+					addresses.size() * sizeof(uint64_t)) != header.checksum) {
+			throw std::runtime_error("buffered_file_storage: " + free_map_path() + " is corrupted");
+		}
+		for (uint64_t address : addresses) {
+			if (address < page_count && !free_flags[address]) {
+				free_pages.push_back(address);
+				free_flags[address] = true;
+			}
+		}
+	}
+
+	void write_free_map() {
+		std::vector<uint64_t> addresses(free_pages.begin(), free_pages.end());
+		free_map_header header;
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, free_map_magic(), sizeof(header.magic));
+		header.free_count = addresses.size();
+		header.checksum = page_checksum(page_checksum_seed, (const char*)addresses.data(),
+			addresses.size() * sizeof(uint64_t));
+		std::string temporary_path = free_map_path() + ".tmp";
+		std::ofstream stream(temporary_path, std::ios::out | std::ios::binary | std::ios::trunc);
+		stream.write((const char*)&header, sizeof(header));
+		stream.write((const char*)addresses.data(), addresses.size() * sizeof(uint64_t));
+		stream.close();
+		if (!stream || std::rename(temporary_path.c_str(), free_map_path().c_str()) != 0) {
+			throw_io_error("write " + free_map_path());
+		}
+		free_map_dirty = false;
+	}
+
+	static void throw_io_error(const std::string& what) {
+		throw std::runtime_error("buffered_file_storage: " + what + ": " + std::strerror(errno));
+	}
+
+private:
+
+	std::string path;
+
+	size_t page_size;
+
+	size_t page_count;
+
+	std::vector<size_t> free_pages;
+
+	// One bit per page, set while the page is on free_pages.
+	std::vector<bool> free_flags;
+
+	bool free_map_dirty;
+
+	int fd;
+
+	char* arena;
+
+	std::vector<frame> frames;
+
+	size_t clock_hand;
+
+	std::unordered_map<size_t, size_t> page_table;
+
+	mutable std::mutex mutex;
+
+	std::condition_variable loaded;
+
+	std::unique_ptr<page_io_engine> engine;
+
+	size_t dirty_count;
+
+	double background_ratio;
+
+	double limit_ratio;
+
+	std::thread flusher;
+
+	bool flusher_running;
+
+	size_t flusher_batch;
+
+	std::chrono::milliseconds flusher_interval;
+
+	bool flusher_stopping;
+
+	bool flush_requested;
+
+	uint64_t flusher_pass;
+
+	bool flusher_stalled;
+
+	std::exception_ptr flusher_error;
+
+	std::condition_variable flusher_wakeup;
+
+	std::condition_variable cleaned;
+
+	std::vector<char> flush_buffer;
+
+	// Serializes the writes of the flusher with the other writes.
+	std::mutex write_mutex;
+
+	size_t background_write_count;
+
+};
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "crc32c.h"
+#include "storage_model.h"
+
+/**
+ * Thrown when a page does not match its checksum.
+ */
+class page_corruption_error : public std::runtime_error {
+
+public:
+
+	page_corruption_error(size_t address) :
+		std::runtime_error("checksummed_storage: page " + std::to_string(address) + " is corrupted") {
+		this->address = address;
+	}
+
+	size_t get_address() const {
+		return address;
+	}
+
+private:
+
+	size_t address;
+
+};
+
+/**
+ * Integrity layer over any storage model.
+ *
+ * The last trailer_size bytes of every page of the wrapped storage hold
+ * the CRC32C of the rest of the page. get_page_size reports the page
+ * size without the trailer, so tables lay out their pages (max_size of
+ * header_array.h) within the checked bytes and never touch the trailer.
+ *
+ * The checksum is stamped by create_page, update_page and save_page,
+ * and verified when a page is loaded and not pinned already: a pinned
+ * page may have been changed in place and not be saved yet. A page which
+ * does not match is released again and page_corruption_error is thrown;
+ * asynchronous loads hand it to the callback as nullptr.
+ *
+ * The pins are counted in atomic words indexed by address, so loads of
+ * different pages never wait on each other here. Next to the count each
+ * word holds the state of the page: unverified, verifying or verified.
+ * The load which finds the page unverified verifies it; loads of the
+ * same page meanwhile wait until it is verified (and then use it) or
+ * found corrupted (and then check it themselves, and fail too). The
+ * page is unverified again when its last pin is given back. The words
+ * come in chunks of chunk_size pages, allocated when a page of the
+ * chunk is first pinned, for at most chunk_count chunks.
+ */
+class checksummed_storage : public storage_decorator {
+
+public:
+
+	static const size_t trailer_size = sizeof(uint32_t);
+
+	checksummed_storage(storage_model* inner) : storage_decorator(inner) {
+		if (inner->get_page_size() <= trailer_size) {
+			throw std::runtime_error("checksummed_storage: pages are too small for a checksum");
+		}
+		this->page_size = inner->get_page_size() - trailer_size;
+		this->chunks.reset(new std::atomic<std::atomic<uint32_t>*>[chunk_count]());
+		this->verified_count = 0;
+	}
+
+	~checksummed_storage() {
+		for (size_t slot = 0; slot < chunk_count; ++slot) {
+			delete[] chunks[slot].load();
+		}
+	}
+
+	size_t get_page_size() const {
+		return page_size;
+	}
+
+	size_t create_page() {
+		size_t address = inner->create_page();
+		char* page = inner->load_page(address);
+		stamp(page);
+		inner->update_page(address, page);
+		inner->release_page(address);
+		pin_created(address);
+		return address;
+	}
+
+	char* load_page(size_t address) {
+		char* page = inner->load_page(address);
+		if (pin(address)) {
+			check(address, page);
+			set_verified(address);
+		}
+		return page;
+	}
+
+	void save_page(size_t address, char* page) {
+		stamp(page);
+		unpin(address);
+		inner->save_page(address, page);
+	}
+
+	void update_page(size_t address, char* page) {
+		stamp(page);
+		inner->update_page(address, page);
+	}
+
+	void release_page(size_t address) {
+		unpin(address);
+		inner->release_page(address);
+	}
+
+	void load_pages(const size_t* addresses, size_t count, char** pages) {
+		inner->load_pages(addresses, count, pages);
+		size_t index = 0;
+		try {
+			for (; index < count; ++index) {
+				if (pin(addresses[index])) {
+					check(addresses[index], pages[index]);
+					set_verified(addresses[index]);
+				}
+			}
+		} catch (const page_corruption_error&) {
+			// check released the failed page already.
+			for (size_t other = 0; other < count; ++other) {
+				if (other < index) {
+					release_page(addresses[other]);
+				} else if (other > index) {
+					inner->release_page(addresses[other]);
+				}
+			}
+			throw;
+		}
+	}
+
+	void load_page_async(size_t address, page_callback callback) {
+		inner->load_page_async(address, verified(std::move(callback)));
+	}
+
+	void load_pages_async(const size_t* addresses, size_t count, page_callback callback) {
+		inner->load_pages_async(addresses, count, verified(std::move(callback)));
+	}
+
+public:
+
+	/**
+	 * Number of page loads which were checked.
+	 */
+	size_t get_verified_count() const {
+		return verified_count;
+	}
+
+private:
+
+	uint32_t checksum(const char* page) const {
+		return crc32c(page, page_size);
+	}
+
+	void stamp(char* page) const {
+		uint32_t value = checksum(page);
+		std::memcpy(page + page_size, &value, sizeof(value));
+	}
+
+	/**
+	 * Unpins and releases the page if it does not match.
+	 */
+	void check(size_t address, const char* page) {
+		uint32_t stored;
+		std::memcpy(&stored, page + page_size, sizeof(stored));
+		if (stored != checksum(page)) {
+			release_page(address);
+			throw page_corruption_error(address);
+		}
+	}
+
+	page_callback verified(page_callback callback) {
+		return [this, callback](size_t address, char* page) {
+			if (page && pin(address)) {
+				try {
+					check(address, page);
+					set_verified(address);
+				} catch (const page_corruption_error&) {
+					page = nullptr;
+				}
+			}
+			callback(address, page);
+		};
+	}
+
+	/**
+	 * Adds a pin, waiting while another load verifies the page.
+	 * @return Whether the page is unverified, so the caller has to check
+	 * it and then call set_verified.
+	 */
+	bool pin(size_t address) {
+		std::atomic<uint32_t>& word = pin_count(address);
+		uint32_t value = word.load(std::memory_order_acquire);
+		while (true) {
+			uint32_t state = value & state_mask;
+			if (state == state_verifying) {
+				std::this_thread::yield();
+				value = word.load(std::memory_order_acquire);
+			} else if (state == state_verified) {
+				if (word.compare_exchange_weak(value, value + 1, std::memory_order_acq_rel)) {
+					return false;
+				}
+			} else if (word.compare_exchange_weak(value, state_verifying | ((value & count_mask) + 1),
+					std::memory_order_acq_rel)) {
+				++verified_count;
+				return true;
+			}
+		}
+	}
+
+	/**
+	 * A created page was just stamped, so it needs no check.
+	 */
+	void pin_created(size_t address) {
+		std::atomic<uint32_t>& word = pin_count(address);
+		uint32_t value = word.load(std::memory_order_acquire);
+		while (!word.compare_exchange_weak(value, state_verified | ((value & count_mask) + 1),
+				std::memory_order_acq_rel)) {
+		}
+	}
+
+	void set_verified(size_t address) {
+		std::atomic<uint32_t>& word = pin_count(address);
+		uint32_t value = word.load(std::memory_order_acquire);
+		while (!word.compare_exchange_weak(value, state_verified | (value & count_mask),
+				std::memory_order_acq_rel)) {
+		}
+	}
+
+	/**
+	 * A page which is not pinned stays at zero; the last unpin makes
+	 * the page unverified again, which also ends a failed verification.
+	 */
+	void unpin(size_t address) {
+		std::atomic<uint32_t>& word = pin_count(address);
+		uint32_t value = word.load(std::memory_order_acquire);
+		while ((value & count_mask) > 0) {
+			uint32_t count = (value & count_mask) - 1;
+			uint32_t next = count == 0 ? state_unverified : (value & state_mask) | count;
+			if (word.compare_exchange_weak(value, next, std::memory_order_acq_rel)) {
+				break;
+			}
+		}
+	}
+
+	std::atomic<uint32_t>& pin_count(size_t address) {
+		size_t slot = address / chunk_size;
+		if (slot >= chunk_count) {
+			throw std::out_of_range("checksummed_storage: no pin count for page " + std::to_string(address));
+		}
+		std::atomic<uint32_t>* chunk = chunks[slot].load(std::memory_order_acquire);
+		if (chunk == nullptr) {
+			std::atomic<uint32_t>* fresh = new std::atomic<uint32_t>[chunk_size]();
+			if (chunks[slot].compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel)) {
+				chunk = fresh;
+			} else {
+				delete[] fresh;
+			}
+		}
+		return chunk[address % chunk_size];
+	}
+
+private:
+
+	static const uint32_t state_unverified = 0;
+
+	static const uint32_t state_verifying = (uint32_t)1 << 30;
+
+	static const uint32_t state_verified = (uint32_t)2 << 30;
+
+	static const uint32_t state_mask = (uint32_t)3 << 30;
+
+	static const uint32_t count_mask = ~state_mask;
+
+	static const size_t chunk_size = 1 << 16;
+
+	static const size_t chunk_count = 1 << 16;
+
+	size_t page_size;
+
+	std::unique_ptr<std::atomic<std::atomic<uint32_t>*>[]> chunks;
+
+	std::atomic<size_t> verified_count;
+
+};
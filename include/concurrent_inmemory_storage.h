@@ -0,0 +1,205 @@
+#pragma once
+
+#include <stdlib.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "storage_model.h"
+
+/**
+ * In-memory implementation of the memory model which may be called from
+ * any number of threads at once.
+ *
+ * Addresses are handed out by an atomic counter. Pages live in segments
+ * of 2^segment_shift pages (about segment_target_size bytes, each page
+ * on its own cache lines), and the page table is a fixed array of
+ * max_segments atomic segment pointers. The thread which first creates
+ * a page of a segment allocates it and installs it with a compare and
+ * swap; a thread which loses the race frees its segment and uses the
+ * winner's. So load_page is a bounds check, an atomic load and an index,
+ * without any lock, and create_page takes no lock either unless there
+ * are freed pages to reuse. Freeing a page which is already free throws.
+ *
+ * The storage synchronizes its own state only. Threads which share a
+ * page have to synchronize the access to its content themselves, and
+ * an address handed from one thread to another has to be published
+ * with the usual happens-before ordering (the tables do that through
+ * their own locks).
+ */
+class concurrent_inmemory_storage final : public storage_model {
+
+public:
+
+	concurrent_inmemory_storage(size_t page_size) :
+		segments(new std::atomic<char*>[max_segments]) {
+		this->page_size = page_size;
+		this->page_stride = (page_size + cache_line_size - 1) / cache_line_size * cache_line_size;
+		this->segment_shift = 0;
+		while ((page_stride << (segment_shift + 1)) <= segment_target_size) {
+			++segment_shift;
+		}
+		for (size_t index = 0; index < max_segments; ++index) {
+			segments[index].store(nullptr, std::memory_order_relaxed);
+		}
+		this->page_count.store(0, std::memory_order_relaxed);
+		this->free_count.store(0, std::memory_order_relaxed);
+	}
+
+	~concurrent_inmemory_storage() {
+		for (size_t index = 0; index < max_segments; ++index) {
+			::free(segments[index].load(std::memory_order_relaxed));
+		}
+	}
+
+	size_t get_page_size() const {
+		return page_size;
+	}
+
+	size_t create_page() {
+		if (free_count.load(std::memory_order_acquire) > 0) {
+			std::lock_guard<std::mutex> lock(free_mutex);
+			if (!free_pages.empty()) {
+				size_t address = free_pages.back();
+				free_pages.pop_back();
+				free_flags[address] = false;
+				free_count.fetch_sub(1, std::memory_order_release);
+				std::memset(load_page(address), 0, page_size);
+				return address;
+			}
+		}
+		size_t address = page_count.fetch_add(1, std::memory_order_acq_rel);
+		if ((address >> segment_shift) >= max_segments) {
+			page_count.fetch_sub(1, std::memory_order_acq_rel);
+			throw std::bad_alloc();
+		}
+		install_segment(address >> segment_shift);
+		return address;
+	}
+
+	char* load_page(size_t address) {
+		char* segment = nullptr;
+		if (address < page_count.load(std::memory_order_acquire)) {
+			segment = segments[address >> segment_shift].load(std::memory_order_acquire);
+		}
+		if (segment == nullptr) {
+			throw std::out_of_range("concurrent_inmemory_storage: no page " + std::to_string(address));
+		}
+		return segment + (address & (segment_pages() - 1)) * page_stride;
+	}
+
+	void save_page(size_t address, char* page) {
+		// No operation here.
+	}
+
+	void update_page(size_t address, char* page) {
+		// No operation here.
+	}
+
+	void release_page(size_t address) {
+		// No operation here.
+	}
+
+	void free_page(size_t address) {
+		load_page(address);
+		std::lock_guard<std::mutex> lock(free_mutex);
+		if (address >= free_flags.size()) {
+			free_flags.resize(address + 1);
+		}
+		if (free_flags[address]) {
+			throw std::runtime_error("concurrent_inmemory_storage: page " + std::to_string(address) + " is already free");
+		}
+		free_pages.push_back(address);
+		free_flags[address] = true;
+		free_count.fetch_add(1, std::memory_order_release);
+	}
+
+	void prefetch_pages(const size_t* addresses, size_t count) {
+		size_t limit = page_count.load(std::memory_order_acquire);
+		for (size_t index = 0; index < count; ++index) {
+			if (addresses[index] >= limit) {
+				continue;
+			}
+			char* segment = segments[addresses[index] >> segment_shift].load(std::memory_order_acquire);
+			if (segment != nullptr) {
+				__builtin_prefetch(segment + (addresses[index] & (segment_pages() - 1)) * page_stride);
+			}
+		}
+	}
+
+public:
+
+	/**
+	 * Number of created pages, freed pages included.
+	 */
+	size_t get_page_count() const {
+		return page_count.load(std::memory_order_acquire);
+	}
+
+	size_t get_free_page_count() const {
+		return free_count.load(std::memory_order_acquire);
+	}
+
+private:
+
+	static const size_t cache_line_size = 64;
+
+	static const size_t segment_alignment = 4096;
+
+	static const size_t segment_target_size = 1 << 20;
+
+	static const size_t max_segments = 1 << 16;
+
+	size_t segment_pages() const {
+		return (size_t)1 << segment_shift;
+	}
+
+	/**
+	 * Makes sure the segment exists; every creator of a page in it calls
+	 * this, so the page is usable when create_page returns.
+	 */
+	void install_segment(size_t index) {
+		if (segments[index].load(std::memory_order_acquire) != nullptr) {
+			return;
+		}
+		void* block = nullptr;
+		if (::posix_memalign(&block, segment_alignment, page_stride << segment_shift) != 0) {
+			throw std::bad_alloc();
+		}
+		char* expected = nullptr;
+		if (!segments[index].compare_exchange_strong(expected, (char*)block,
+				std::memory_order_acq_rel, std::memory_order_acquire)) {
+			::free(block);
+		}
+	}
+
+private:
+
+	size_t page_size;
+
+	size_t page_stride;
+
+	size_t segment_shift;
+
+	std::unique_ptr<std::atomic<char*>[]> segments;
+
+	std::atomic<size_t> page_count;
+
+	std::mutex free_mutex;
+
+	std::vector<size_t> free_pages;
+
+	// One bit per page, set while the page is on free_pages; grown by
+	// free_page, since pages are created without the lock.
+	std::vector<bool> free_flags;
+
+	std::atomic<size_t> free_count;
+
+};
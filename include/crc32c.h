@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+/**
+ * CRC32C (Castagnoli) checksums.
+ *
+ * crc32c uses the crc32 instruction of SSE4.2 when the processor has
+ * it and falls back to slicing-by-8 otherwise; both give the same
+ * result. Like zlib's crc32, the value of a previous call can be passed
+ * in to continue a checksum over several pieces, starting with 0.
+ */
+namespace crc32c_detail {
+
+const uint32_t polynomial = 0x82f63b78;
+
+/**
+ * table[0] is the classic byte-wise table, table[k] advances a byte by
+ * k more zero bytes, so eight bytes are folded in with eight lookups.
+ */
+struct slicing_table {
+	uint32_t table[8][256];
+
+	slicing_table() {
+		for (uint32_t byte = 0; byte < 256; ++byte) {
+			uint32_t crc = byte;
+			for (int bit = 0; bit < 8; ++bit) {
+				crc = (crc >> 1) ^ (polynomial & (0 - (crc & 1)));
+			}
+			table[0][byte] = crc;
+		}
+		for (uint32_t byte = 0; byte < 256; ++byte) {
+			for (int slice = 1; slice < 8; ++slice) {
+				uint32_t previous = table[slice - 1][byte];
+				table[slice][byte] = (previous >> 8) ^ table[0][previous & 0xff];
+			}
+		}
+	}
+};
+
+inline const slicing_table& get_slicing_table() {
+	static const slicing_table instance;
+	return instance;
+}
+
+}
+
+inline uint32_t crc32c_software(const char* data, size_t size, uint32_t crc = 0) {
+	const auto& table = crc32c_detail::get_slicing_table().table;
+	crc = ~crc;
+	for (; size >= 8; data += 8, size -= 8) {
+		uint64_t word;
+		std::memcpy(&word, data, sizeof(word));
+		word ^= crc;
+		crc = table[7][word & 0xff] ^
+			table[6][(word >> 8) & 0xff] ^
+			table[5][(word >> 16) & 0xff] ^
+			table[4][(word >> 24) & 0xff] ^
+			table[3][(word >> 32) & 0xff] ^
+			table[2][(word >> 40) & 0xff] ^
+			table[1][(word >> 48) & 0xff] ^
+			table[0][word >> 56];
+	}
+	for (; size > 0; ++data, --size) {
+		crc = (crc >> 8) ^ table[0][(crc ^ (unsigned char)*data) & 0xff];
+	}
+	return ~crc;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+inline uint32_t crc32c_hardware(const char* data, size_t size, uint32_t crc = 0) {
+	uint64_t crc64 = ~crc;
+	for (; size >= 8; data += 8, size -= 8) {
+		uint64_t word;
+		std::memcpy(&word, data, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	uint32_t crc32 = (uint32_t)crc64;
+	for (; size > 0; ++data, --size) {
+		crc32 = _mm_crc32_u8(crc32, (unsigned char)*data);
+	}
+	return ~crc32;
+}
+
+inline bool crc32c_has_hardware() {
+	static const bool supported = __builtin_cpu_supports("sse4.2");
+	return supported;
+}
+
+#else
+
+inline uint32_t crc32c_hardware(const char* data, size_t size, uint32_t crc = 0) {
+	return crc32c_software(data, size, crc);
+}
+
+inline bool crc32c_has_hardware() {
+	return false;
+}
+
+#endif
+
+inline uint32_t crc32c(const char* data, size_t size, uint32_t crc = 0) {
+	return crc32c_has_hardware() ? crc32c_hardware(data, size, crc) : crc32c_software(data, size, crc);
+}
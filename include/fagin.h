@@ -1,10 +1,18 @@
 #pragma once
 /*
  * Fagin's extendible hashing
+ *
+ * The directory has 2^globalDepth entries and a key goes to the page of
+ * entry hash(key) mod 2^globalDepth.  A page with localDepth d is shared
+ * by the entries which agree with it in the lowest d bits.  A full page
+ * is split on bit d; when d equals the global depth the directory is
+ * doubled first.
  */
 
+#include <algorithm>
 #include <array>
 #include <cassert>
+#include <cmath>
 #include <cstring>
 #include <iterator>
 #include <set>
@@ -31,7 +39,7 @@ struct FaginHeader : HeaderBase {
 };
 
 template<typename Key, typename Data>
-using FaginPage = HeaderArray<FaginHeader, Entry<const Key,Data>>;
+using FaginPage = HeaderArray<FaginHeader, Entry<Key,Data>>;
 
 
 template<
@@ -41,6 +49,9 @@ template<
 class FaginDirectory {
  public:
   using Directory = std::vector<PageId>;
+  using const_iterator = Directory::const_iterator;
+  using const_reverse_iterator = Directory::const_reverse_iterator;
+
   FaginDirectory() : directory_(0) {}
 
 	/*
@@ -73,6 +84,16 @@ class FaginDirectory {
   GlobalDepth() const
   {
     return llrint(log2(directory_.size()));
+  }
+	/*
+	 * Relocate
+	 *
+	 * Several directory entries may point to the moved page.
+	 */
+  void
+  Relocate(PageId from, PageId to)
+  {
+    std::replace(directory_.begin(), directory_.end(), from, to);
   }
 	/*
 	 * GetPageId
@@ -81,6 +102,18 @@ class FaginDirectory {
   GetPageId(const Key& key) const
   {
     return directory_[hash_(key) % directory_.size()];
+  }
+	/*
+	 * GetPageIds
+	 *
+	 * out[i] = GetPageId(keys[i]), the keys hashed 4 or 8 at once (see
+	 * UniHash::hash_batch).
+	 */
+  void
+  GetPageIds(const Key* keys, size_t n, PageId* out) const
+  {
+    hash_.hash_batch(keys, n, out);
+    for (size_t i = 0; i < n; ++i) out[i] = directory_[out[i] % directory_.size()];
   }
 	/*
 	 * Initialize
@@ -92,6 +125,9 @@ class FaginDirectory {
   }
 	/*
 	 * SetNewPage
+	 *
+	 * Of the entries sharing key's page, which has localDepth (before the
+	 * split), the ones with bit localDepth set get pageId.
 	 */
   void
   SetNewPage(
@@ -99,20 +135,21 @@ class FaginDirectory {
       size_t localDepth,
       size_t pageId)
   {
-    size_t i = hash_(key) % localDepth + localDepth;
+    size_t stride = (size_t)1 << localDepth;
+    size_t i = hash_(key) % stride + stride;
     while (i < directory_.size())
     {
       directory_[i] = pageId;
-      i += localDepth;
+      i += 2 * stride;
     }
   }
   /*
    * DirBegin
    */
-  Directory::iterator DirBegin()  { return directory_.begin(); }
-  Directory::iterator DirRBegin() { return directory_.rbegin(); }
-  Directory::iterator DirEnd()    { return directory_.end(); }
-  Directory::iterator DirREnd()   { return directory_.rend(); }
+  const_iterator         DirBegin()  const { return directory_.cbegin(); }
+  const_reverse_iterator DirRBegin() const { return directory_.crbegin(); }
+  const_iterator         DirEnd()    const { return directory_.cend(); }
+  const_reverse_iterator DirREnd()   const { return directory_.crend(); }
 
  private:
 
@@ -123,34 +160,28 @@ class FaginDirectory {
 template<
   typename Key,
   typename Data,
-  typename Hash = UniHash<Key>
+  typename Hash = UniHash<Key>,
+  typename Storage = storage_model
   >
 class FaginTable : public HashInterface<Key,Data,Hash> {
+  static_assert(is_storage_model<Storage>::value,
+      "FaginTable: Storage must implement storage_model");
  public:
   using Page      = FaginPage<Key, Data>;
-  using PageEntry = Entry<const Key, Data>;
+  using PageEntry = Entry<Key, Data>;
   using Header    = FaginHeader;
-  using Table     = FaginTable<Key, Hash, Data>;
+  using Table     = FaginTable<Key, Data, Hash, Storage>;
+  using StorageType = Storage;
 
   class PageIterator;
-  using iterator  = TableIterator<Key, Data, Table, PageIterator>;
+  using iterator  = TableIterator<Key, Data, Entry, PageIterator>;
 
   /*
-   * FaginTable
+   * FaginTable - starts with one page, of local depth 0
    */
-  FaginTable(storage_model* model, size_t n = 0) : model_(model)
+  FaginTable(Storage* model, size_t n = 0) : model_(model), size_(0)
   {
-    PageId initId = model_->create_page();
-    auto initPage = (FaginHeader*)model_->load_page(initId);
-
-    InitializeHeader<FaginHeader, Entry<const Key,Data> >(
-        initPage,
-        model_->get_page_size(),
-        initId
-    );
-
-    model_->release_page(initId);
-    directory_.Initialize(initId, n);
+    directory_.Initialize(CreatePage(0), 1);
   }
   /*
    * erase
@@ -165,17 +196,22 @@ class FaginTable : public HashInterface<Key,Data,Hash> {
         [key](const PageEntry& entry) { return key == entry.key; }
     );
 
-    if (ePoint == page->end()) return false;
+    if (ePoint == page->end())
+    {
+      model_->release_page(pageId);
+      return false;
+    }
 
     --size_;
     page->erase(ePoint);
 
+    model_->save_page(pageId, (char*)page);
     return true;
   }
   /*
    * find
    */
-  iterator
+  std::pair<bool, Data>
   find(const Key& key) const override
   {
     PageId pageId = directory_.GetPageId(key);
@@ -185,7 +221,11 @@ class FaginTable : public HashInterface<Key,Data,Hash> {
         [key](const PageEntry& entry) { return key == entry.key; }
     );
 
-    return {keyLocation, page, this};
+    std::pair<bool, Data> result = {false, Data()};
+    if (keyLocation != page->end()) result = {true, keyLocation->data};
+
+    model_->release_page(pageId);
+    return result;
   }
   /*
    * insert
@@ -196,182 +236,212 @@ class FaginTable : public HashInterface<Key,Data,Hash> {
     PageId pageId = directory_.GetPageId(key);
     auto page = (Page*)model_->load_page(pageId);
 
+    auto iPoint = page->find(
+        [key] (const PageEntry& entry) { 
+        return entry.key == key;
+    });
+
+    if (iPoint != page->end())
+    {
+      iPoint->data = data;
+      model_->save_page(pageId, (char*)page);
+      return;
+    }
+
     while (page->full()) 
     {
-      SplitPage(page, pageId, key);
+      SplitPage(page, key);
+      model_->save_page(pageId, (char*)page);
       pageId = directory_.GetPageId(key);
       page = (Page*)model_->load_page(pageId);
     }
 
-    auto iPoint = page->find(
-        [key] (const Entry<const Key, Data>& entry) { 
-        return entry.key == key;
-    });
-
-    page->insert(iPoint, {key, data});
+    page->push_back({key, data});
     ++size_;
+
+    model_->save_page(pageId, (char*)page);
   }
   /*
-   * begin
+   * begin - every page once, in the order of its first directory entry
    */
   iterator 
-  begin()
+  begin() const
   {
-    Page* page = model_->load_page(*directory_->DirBegin());
-    return {page->begin(), page, this};
+    PageIterator page(this);
+    return iterator(++page);
   }
   /*
    * end
    */
   iterator
-  end()
+  end() const
   {
-    Page* page = model_->load_page(*--directory_->DirEnd());
-    return {page, page->end(), this};
+    return iterator(PageIterator(this));
   }
 
+  inline size_t size() const { return size_; }
 
   /*
-   * Successor
+   * Compact
+   *
+   * Lets the storage move pages into freed ones, when it is shared with
+   * structures which free pages.
    */
-  iterator&
-  Predecessor(iterator& it)
+  size_t
+  Compact()
   {
-    if (it.entry_ != it.page_->begin())
-    {
-      --it.entry_;
-    }
-    else
-    {
-      auto dirIt = NextUnique(
-          directory_->DirRBegin(),
-          directory_->DirREnd(),
-          it.page_->header()->pageId
-      );
-
-      if (dirIt == directory_->DirREnd())
-      {
-        it.page_ = nullptr;
-        it.entry_ = nullptr;
-      }
-      else
-      {
-        it.page_ = (Page*)model_->load_page(*dirIt);
-        it.entry_ = it.page_->begin();
-      }
-    }
-
-    return *this;
+    return model_->compact([this](PageId from, PageId to) {
+        RelocatePage(model_, to);
+        directory_.Relocate(from, to);
+    });
   }
 
-  friend class iterator;
-
  private:
 
   /*
-   * SplitPage
+   * CreatePage
+   */
+  PageId
+  CreatePage(size_t localDepth)
+  {
+    auto newPage = CreateInitializedPage<FaginHeader, PageEntry>(model_);
+    newPage.second->localDepth = localDepth;
+
+    model_->save_page(newPage.first, (char*)newPage.second);
+    return newPage.first;
+  }
+  /*
+   * SplitPage - key's page, which is full
    */
-  void SplitPage(Page* page, PageId pageId, const Key& key)
+  void SplitPage(Page* page, const Key& key)
   {
-    if (++page->header()->localDepth == directory_.GlobalDepth()) {
+    size_t localDepth = page->header()->localDepth;
+
+    if (localDepth == directory_.GlobalDepth()) {
       directory_.Expand(key);
     }
 
-    directory_.SetNewPage(key, page->header()->localDepth, pageId);
+    PageId newId = CreatePage(localDepth + 1);
+    directory_.SetNewPage(key, localDepth, newId);
+    page->header()->localDepth = localDepth + 1;
 
-    ReinsertAllEntries(page);
+    ReinsertAllEntries(page, newId);
   }
   /*
-   * ReinsertAllEntries
+   * ReinsertAllEntries - the entries which belong to the new page now
+   * move there
    */
-  void ReinsertAllEntries(Page* page) 
+  void ReinsertAllEntries(Page* page, PageId newId) 
   {
-    std::vector<PageEntry> entries;
+    auto newPage = (Page*)model_->load_page(newId);
 
-    while (!page->empty())
+    for (auto entry = page->begin(); entry != page->end(); )
     {
-      entries.push_back(*page->begin());
-      page->erase(page->begin());
+      if (directory_.GetPageId(entry->key) == newId)
+      {
+        newPage->push_back(*entry);
+        page->erase(entry);
+      }
+      else
+      {
+        ++entry;
+      }
     }
 
-    while (!entries.empty())
-    {
-      insert(entries.back().key, entries.back().data);
-      entries.pop_back();
-    }
+    model_->save_page(newId, (char*)newPage);
   }
 
 
-  class PageIterator : Public PageIteratorBase<Page, Table> {
+ public:
+
+  class PageIterator : public PageIteratorBase<Page, Storage> {
     public:
-      using PageIteratorBase<LeafNode, Table>::page_;
-      using PageIteratorBase<LeafNode, Table>::table_;
+      using PageIteratorBase<Page, Storage>::page_;
 
-      PageIterator& operator++() override {
-        storage_model* model_  = table_->model_;
-        FaginDirectory* directory_ = table_->directory_;
+      PageIterator(const Table* table) :
+        PageIteratorBase<Page, Storage>(table->model_),
+        table_(table) {}
 
-        if (directory_->DirBegin() == directory_.DirEnd()) {
-          page_ = nullptr;
-        }
-        else if (page_ == nullptr)
+      PageIterator& operator++() {
+        const FaginDirectory<Key, Hash>& directory_ = table_->directory_;
+
+        if (page_ == nullptr)
         {
-          page_ = model_->load_page(*directory_.DirBegin());
+          Prefetch(std::next(directory_.DirBegin()), directory_.DirEnd());
+          this->Load(*directory_.DirBegin());
         }
         else
         {
           auto dirIt = NextUnique(
-              directory_->DirBegin(),
-              directory_->DirEnd(),
+              directory_.DirBegin(),
+              directory_.DirEnd(),
               page_->header()->pageId
               );
 
-          if (dirIt == directory_->DirEnd())
+          if (dirIt == directory_.DirEnd())
           {
-            page_ = nullptr;
+            this->Release();
           }
           else
           {
-            page_ = (Page*)model_->load_page(*dirIt);
+            Prefetch(std::next(dirIt), directory_.DirEnd());
+            this->Load(*dirIt);
           }
         }
         return *this;
       }
-      PageIterator& operator--() override {
-        storage_model* model_  = table_->model_;
-        FaginDirectory* directory_ = table_->directory_;
-
-        if (directory_->DirRBegin() == directory_.DirREnd()) {
-          page_ = nullptr;
+      /*
+       * operator-- - to the page whose first entry is the last one before
+       * the first entry of this page
+       */
+      PageIterator& operator--() {
+        const FaginDirectory<Key, Hash>& directory_ = table_->directory_;
+
+        auto first = page_ == nullptr
+                   ? directory_.DirEnd()
+                   : std::find(directory_.DirBegin(), directory_.DirEnd(), page_->header()->pageId);
+
+        auto dirIt = directory_.DirEnd();
+        for (auto it = directory_.DirBegin(); it != first; ++it)
+        {
+          if (std::find(directory_.DirBegin(), it, *it) == it) dirIt = it;
         }
-        else if (page_ == nullptr)
+
+        if (dirIt == directory_.DirEnd())
         {
-          page_ = model_->load_page(*directory_.DirRBegin());
+          this->Release();
         }
         else
         {
-          auto dirIt = NextUnique(
-              directory_->DirRBegin(),
-              directory_->DirREnd(),
-              page_->header()->pageId
-              );
-
-          if (dirIt == directory_->DirREnd())
-          {
-            page_ = nullptr;
-          }
-          else
-          {
-            page_ = (Page*)model_->load_page(*dirIt);
-          }
+          this->Load(*dirIt);
         }
         return *this;
       }
- 
+
+    private:
+      /*
+       * Prefetch
+       *
+       * The directory lists a page once per slot pointing to it, so a
+       * window may announce a page more than once; that is harmless.
+       */
+      template<typename DirIt>
+      void Prefetch(DirIt first, DirIt last)
+      {
+        PrefetchPages(
+            table_->model_,
+            first,
+            last,
+            [](PageId pageId) { return pageId; }
+        );
+      }
+
+      const Table* table_;
   };
 
+ private:
 
-  storage_model*            model_;
+  Storage*                  model_;
   FaginDirectory<Key, Hash> directory_;
   size_t                    size_;
 };
@@ -0,0 +1,293 @@
+#pragma once
+
+/*
+ * Universal hash families to use in place of UniHash, through the Hash
+ * template parameter of LkTable, FaginTable and Btree.  They have the
+ * same interface: operator()(key), Refresh(), ToString() and
+ * hash_batch(keys, n, out).
+ *
+ * UniHash needs two 64-bit divisions per 16-bit lane.  The families
+ * here have no division at all:
+ *
+ *  MultiplyShiftHash - Dietzfelbinger's multiply-shift on vectors of
+ *                      32-bit words, two multiplications per word.
+ *  MersenneHash      - (b + sum a_i x_i) mod 2^61-1, one 64x64->128
+ *                      multiplication per word and a shift-add
+ *                      reduction at the end.
+ *  TabHash           - simple tabulation, a lookup in a random table per
+ *                      byte of the key and XORs; TwistedTabHash is the
+ *                      twisted variant.
+ *
+ * The first two are strongly universal (pairwise independent), as
+ * UniHash is; simple tabulation is 3-independent.  MersenneHash only
+ * gives values below 2^61-1.
+ *
+ * Measured with src/hash_bench (g++ -O2, one call of operator() per key,
+ * 2^20 keys).  Times are in ns per key.  chi^2 is taken over 1021
+ * buckets, so about 1020 +- 45 is expected from random keys.  On the
+ * sequential keys 0..2^20-1 the arithmetic families, being (nearly)
+ * linear, spread the keys more evenly than chance:
+ *
+ *                      uint64_t   16-byte key   chi^2   chi^2 seq
+ *  UniHash               3.4         6.8         1066       74
+ *  MultiplyShiftHash     1.4         3.1         1008       77
+ *  MersenneHash          1.8         4.0         1035        7
+ *  TabHash               3.2        11.9         1072     1052
+ *  TwistedTabHash        3.8        10.2         1067     1010
+ *
+ * Tabulation is no faster than UniHash on uint64_t keys and slower on
+ * longer keys: a 16-byte key makes 16 lookups across 32 KiB of tables.
+ * Unlike the linear families, it spreads the sequential keys as a
+ * random function would.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "universal_hash.h"
+
+namespace data_org_project_names {
+
+inline uint64_t Rand64() { return (uint64_t)Rand32() << 32 | Rand32(); }
+
+/*
+ * MultiplyShiftHash
+ *
+ * Each half of the hash is ((b + sum a_i x_i) mod 2^64) >> 32 over the
+ * 32-bit words x_i of the key, with random 64-bit a_i and b, which is
+ * strongly universal into 32 bits.  The two halves use independent
+ * parameters.
+ */
+template<typename Key>
+class MultiplyShiftHash {
+ public:
+  static_assert(sizeof(Key) >= 4 && sizeof(Key) % 4 == 0,
+                "MultiplyShiftHash: keys must be made of whole 32-bit words");
+
+  static constexpr size_t kWords = sizeof(Key) / 4;
+
+  MultiplyShiftHash() {
+    Refresh();
+  }
+  /*
+   * Refresh
+   */
+  void
+  Refresh()
+  {
+    for (auto& half : multipliers_) for (auto& a : half) a = Rand64();
+    for (auto& b : adders_) b = Rand64();
+  }
+  /*
+   * operator() - the key is read through KeyWords, as in UniHash
+   */
+  uint64_t
+  operator()(const Key& key) const
+  {
+    KeyWords<Key> copy = {};
+    copy.key = key;
+    const uint32_t* words = copy.words;
+
+    uint64_t low  = adders_[0];
+    uint64_t high = adders_[1];
+    for (size_t i = 0; i < kWords; ++i)
+    {
+      low  += multipliers_[0][i] * words[i];
+      high += multipliers_[1][i] * words[i];
+    }
+    return (high & 0xffffffff00000000) | low >> 32;
+  }
+  /*
+   * hash_batch
+   */
+  void
+  hash_batch(const Key* keys, size_t n, uint64_t* out) const
+  {
+    for (size_t i = 0; i < n; ++i) out[i] = (*this)(keys[i]);
+  }
+  /*
+   * ToString
+   */
+  std::string
+  ToString() const
+  {
+    std::string str = "{MultiplyShiftHash";
+    for (size_t h = 0; h < 2; ++h)
+    {
+      str += "\n\t{adder: " + std::to_string(adders_[h]) + ", multipliers:";
+      for (auto a : multipliers_[h]) str += " " + std::to_string(a);
+      str += "}";
+    }
+    return str + "}";
+  }
+
+ private:
+  uint64_t multipliers_[2][kWords];
+  uint64_t adders_[2];
+};
+
+const uint64_t kMersenne61 = ((uint64_t)1 << 61) - 1;
+
+/*
+ * ModMersenne61
+ *
+ * x mod 2^61-1 for x < 2^124: since 2^61 = 1 (mod 2^61-1), the bits
+ * above 61 are added to the bits below.
+ */
+inline uint64_t
+ModMersenne61(unsigned __int128 x)
+{
+  uint64_t r = ((uint64_t)x & kMersenne61) + (uint64_t)(x >> 61);
+  r = (r & kMersenne61) + (r >> 61);
+  return r >= kMersenne61 ? r - kMersenne61 : r;
+}
+
+/*
+ * MersenneHash
+ *
+ * (b + sum a_i x_i) mod 2^61-1 over the 32-bit words x_i of the key, with
+ * a_i and b random below 2^61-1.  The sum is kept in 128 bits and reduced
+ * once.
+ */
+template<typename Key>
+class MersenneHash {
+ public:
+  static_assert(sizeof(Key) >= 4 && sizeof(Key) % 4 == 0,
+                "MersenneHash: keys must be made of whole 32-bit words");
+
+  static constexpr size_t kWords = sizeof(Key) / 4;
+
+  MersenneHash() {
+    Refresh();
+  }
+  /*
+   * Refresh
+   */
+  void
+  Refresh()
+  {
+    for (auto& a : multipliers_) a = Rand64() % kMersenne61;
+    adder_ = Rand64() % kMersenne61;
+  }
+  /*
+   * operator() - the key is read through KeyWords, as in UniHash
+   */
+  uint64_t
+  operator()(const Key& key) const
+  {
+    KeyWords<Key> copy = {};
+    copy.key = key;
+    const uint32_t* words = copy.words;
+
+    unsigned __int128 sum = adder_;
+    for (size_t i = 0; i < kWords; ++i) sum += (unsigned __int128)multipliers_[i] * words[i];
+    return ModMersenne61(sum);
+  }
+  /*
+   * hash_batch
+   */
+  void
+  hash_batch(const Key* keys, size_t n, uint64_t* out) const
+  {
+    for (size_t i = 0; i < n; ++i) out[i] = (*this)(keys[i]);
+  }
+  /*
+   * ToString
+   */
+  std::string
+  ToString() const
+  {
+    std::string str = "{MersenneHash adder: " + std::to_string(adder_) + ", multipliers:";
+    for (auto a : multipliers_) str += " " + std::to_string(a);
+    return str + "}";
+  }
+
+ private:
+  uint64_t multipliers_[kWords];
+  uint64_t adder_;
+};
+
+/*
+ * TabHash
+ *
+ * Tabulation hashing: the key is split into its bytes x_0..x_{c-1} and
+ * hashed to T_0[x_0] ^ .. ^ T_{c-1}[x_{c-1}], with a table of 256 random
+ * words per byte.  The tables take 2 KiB per byte of the key (16 KiB for
+ * a uint64_t key), so they stay in the L1/L2 cache while a table is
+ * searched.
+ *
+ * With kTwisted the first c-1 bytes also look up a random twist byte,
+ * and x_{c-1} is XORed with the combined twist before the last lookup
+ * (Patrascu and Thorup, "Twisted tabulation hashing"), which gives
+ * stronger guarantees than simple tabulation for 256 more bytes of table
+ * per byte of the key.
+ */
+template<typename Key, bool kTwisted = false>
+class TabHash {
+ public:
+  static constexpr size_t kChars = sizeof(Key);
+
+  TabHash() : hashes_(kChars * 256), twists_(kTwisted ? (kChars - 1) * 256 : 0) {
+    Refresh();
+  }
+  /*
+   * Refresh
+   */
+  void
+  Refresh()
+  {
+    for (auto& hash : hashes_) hash = Rand64();
+    for (auto& twist : twists_) twist = (uint8_t)Rand32();
+  }
+  /*
+   * operator() - the key is copied to zeroed bytes, as in UniHash
+   */
+  uint64_t
+  operator()(const Key& key) const
+  {
+    union { unsigned char bytes[kChars]; Key key; } copy = {};
+    copy.key = key;
+
+    const uint64_t* hashes = hashes_.data();
+    const uint8_t*  twists = twists_.data();
+
+    uint64_t hash  = 0;
+    uint8_t  twist = 0;
+    for (size_t c = 0; c + 1 < kChars; ++c)
+    {
+      hash ^= hashes[c * 256 + copy.bytes[c]];
+      if (kTwisted) twist ^= twists[c * 256 + copy.bytes[c]];
+    }
+    return hash ^ hashes[(kChars - 1) * 256 + (copy.bytes[kChars - 1] ^ twist)];
+  }
+  /*
+   * hash_batch
+   */
+  void
+  hash_batch(const Key* keys, size_t n, uint64_t* out) const
+  {
+    for (size_t i = 0; i < n; ++i) out[i] = (*this)(keys[i]);
+  }
+  /*
+   * ToString - the first entry of every table
+   */
+  std::string
+  ToString() const
+  {
+    std::string str = kTwisted ? "{TwistedTabHash" : "{TabHash";
+    for (size_t c = 0; c < kChars; ++c) str += " " + std::to_string(hashes_[c * 256]);
+    return str + "}";
+  }
+
+ private:
+  std::vector<uint64_t> hashes_;
+  std::vector<uint8_t>  twists_;
+};
+
+template<typename Key>
+using TwistedTabHash = TabHash<Key, true>;
+
+
+}; //data_org_project_names
@@ -1,9 +1,19 @@
 #pragma once
 
-#include <memory>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
 #include <cstring>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
+#include "header_array.h"
+#include "storage_model.h"
 #include "universal_hash.h"
 
 /*
@@ -17,9 +27,204 @@ namespace data_org_project_names {
 typedef size_t PageId;
 
 /*
- * The following base class shall be suitable for iterators of the
- * tables in this library.  Note that the only thing left to do for
- * the derived iterators is to implement operator++ and operator--.
+ * Number of pages a sequential walk over a table (ToString, iterators,
+ * verification) announces to the storage ahead of the page it is on.
+ */
+const size_t kPrefetchWindow = 8;
+
+/*
+ * PrefetchPages
+ *
+ * Hands the page ids of up to kPrefetchWindow elements of [first, last)
+ * to the storage as one prefetch request.  getPageId extracts the page
+ * id from an element (directory entry, interior btree entry, ...).
+ */
+template<typename Storage, typename InputIt, typename GetPageId>
+void
+PrefetchPages(
+    Storage*       model,
+    InputIt        first,
+    InputIt        last,
+    GetPageId      getPageId)
+{
+  PageId pageIds[kPrefetchWindow];
+  size_t count = 0;
+
+  for (; first != last && count < kPrefetchWindow; ++first)
+  {
+    pageIds[count++] = getPageId(*first);
+  }
+
+  model->prefetch_pages(pageIds, count);
+}
+
+/*
+ * RelocatePage
+ *
+ * Called for every page moved by storage_model::compact: the header of
+ * the moved page has to carry its new id.  The owner of the page then
+ * rewrites its own references to it (directory or parent entries).
+ */
+template<typename Storage>
+void
+RelocatePage(Storage* model, PageId to)
+{
+  auto header = (HeaderBase*)model->load_page(to);
+  header->pageId = to;
+  model->save_page(to, (char*)header);
+}
+
+/*
+ * CreateInitializedPage
+ *
+ * Creates a page and initializes its header for entries of type Entry.
+ * create_page pins the new page, and the load_page which gives us its
+ * address pins it a second time; one of the two pins is given back
+ * here.  So the page is returned pinned once, and the caller unpins it
+ * with save_page when it has filled in the rest of the header.
+ */
+template<typename Header, typename Entry, typename Storage>
+std::pair<PageId, Header*>
+CreateInitializedPage(Storage* model)
+{
+  PageId pageId = model->create_page();
+  auto header = (Header*)model->load_page(pageId);
+  model->release_page(pageId);
+
+  InitializeHeader<Header, Entry>(header, model->get_page_size(), pageId);
+  return {pageId, header};
+}
+
+/*
+ * OpenTable - tag of the table constructors which open a table from
+ * the meta pages its SaveMeta wrote, instead of creating a new one.
+ */
+struct OpenTable {};
+
+/*
+ * MetaHeader
+ *
+ * Header of the pages a table saves the state it keeps in memory to
+ * (directory, hash functions, root id, size).  size counts the bytes
+ * after the header, next is the page they continue on, kNoMetaPage
+ * on the last page.
+ */
+struct MetaHeader : HeaderBase {
+  PageId next;
+};
+
+const PageId kNoMetaPage = SIZE_MAX;
+
+/*
+ * SaveMetaPages
+ *
+ * Writes bytes over the chain of pages, creating the pages the chain
+ * is short of.  Pages left over from a longer earlier save stay in the
+ * chain holding no bytes, so the first page id never changes and is
+ * the one to publish (root word, log).
+ */
+template<typename Storage>
+void
+SaveMetaPages(
+    Storage*             model,
+    const std::string&   bytes,
+    std::vector<PageId>& pages)
+{
+  size_t perPage = model->get_page_size() - sizeof(MetaHeader);
+  size_t needed  = std::max<size_t>(1, (bytes.size() + perPage - 1) / perPage);
+
+  while (pages.size() < needed)
+  {
+    pages.push_back(model->create_page());
+    model->release_page(pages.back());
+  }
+
+  size_t offset = 0;
+  for (size_t i = 0; i < pages.size(); ++i)
+  {
+    auto   header = (MetaHeader*)model->load_page(pages[i]);
+    size_t count  = std::min(perPage, bytes.size() - offset);
+
+    header->pageId   = pages[i];
+    header->pageSize = model->get_page_size();
+    header->size     = count;
+    header->max_size = perPage;
+    header->next     = i + 1 < pages.size() ? pages[i + 1] : kNoMetaPage;
+    std::memcpy(header + 1, bytes.data() + offset, count);
+    offset += count;
+
+    model->save_page(pages[i], (char*)header);
+  }
+}
+
+/*
+ * LoadMetaPages
+ *
+ * The bytes saved by SaveMetaPages in the chain starting at first;
+ * pages gets the ids of the chain.  Pages are only loaded and
+ * released, so a reader process may call it.
+ */
+template<typename Storage>
+std::string
+LoadMetaPages(
+    Storage*             model,
+    PageId               first,
+    std::vector<PageId>& pages)
+{
+  std::string bytes;
+  pages.clear();
+
+  for (PageId pageId = first; pageId != kNoMetaPage; )
+  {
+    auto header = (const MetaHeader*)model->load_page(pageId);
+    if (header->pageId != pageId || header->size > header->max_size)
+    {
+      model->release_page(pageId);
+      throw std::runtime_error("LoadMetaPages: not a meta page");
+    }
+    bytes.append((const char*)(header + 1), header->size);
+    pages.push_back(pageId);
+
+    PageId next = header->next;
+    model->release_page(pageId);
+    pageId = next;
+  }
+  return bytes;
+}
+
+/*
+ * AppendMeta, ReadMeta - the trivially copyable values of a table's
+ * meta bytes, in the order the table writes them.
+ */
+template<typename T>
+void
+AppendMeta(std::string& bytes, const T* values, size_t n = 1)
+{
+  static_assert(std::is_trivially_copyable<T>::value,
+      "AppendMeta: only trivially copyable values are saved as bytes");
+  bytes.append((const char*)values, n * sizeof(T));
+}
+
+template<typename T>
+void
+ReadMeta(const std::string& bytes, size_t& offset, T* values, size_t n = 1)
+{
+  static_assert(std::is_trivially_copyable<T>::value,
+      "ReadMeta: only trivially copyable values are read from bytes");
+  if (bytes.size() - offset < n * sizeof(T))
+    throw std::runtime_error("ReadMeta: meta pages end too early");
+  std::memcpy((void*)values, bytes.data() + offset, n * sizeof(T));
+  offset += n * sizeof(T);
+}
+
+/*
+ * The following class shall be suitable for iterators of the tables in
+ * this library.  It walks the entries of the pages handed out by the
+ * table's PageIterator, skipping pages without entries; the end of the
+ * table is the PageIterator which holds no page.  So the only thing
+ * left to do for a table is to implement the PageIterator's operator++
+ * and operator--, which step to the next and previous page (the first
+ * and last page when coming from the end).
  *
  * TODO This can be made even more general purpose by enforcing/
  * implementing a predecessor/ successor function for every table.
@@ -36,45 +241,36 @@ class TableIterator {
 
  public:
 
-  using value_type      = Entry<const Key, Data>;
+  using value_type      = Entry<Key, Data>;
   using pointer         = value_type*;
   using reference       = value_type&;
-  using const_pointer   = const pointer;
-  using const_reference = const reference;
   using difference_type = std::ptrdiff_t;
   using iterator_category = std::bidirectional_iterator_tag;
-  using Table           = typename PageIterator::TableType;
-  using iterator        = TableIterator<Key, Data, Entry, Table>;
+  using iterator        = TableIterator<Key, Data, Entry, PageIterator>;
 
-  using Page  = HeaderArray<typename Table::Header, value_type>;
+  TableIterator(PageIterator page) : entry_(nullptr), page_(page) {
+    FirstEntry();
+  }
 
-  reference       operator*()        { return *entry_; }
-  const_reference operator*()  const { return *entry_; }
-  pointer         operator->()       { return entry_; }
-  const_pointer   operator->() const { return entry_; }
+  reference       operator*()  const { return *entry_; }
+  pointer         operator->() const { return entry_; }
   iterator&       operator++() {
-    if (entry_ != page_->end())
-    {
-      ++entry_;
-    }
-    else
+    if (++entry_ == page_->end())
     {
       ++page_;
-      if (page_->get() != nullptr) entry_ = page_->begin();
-      else entry_ = nullptr;
+      FirstEntry();
     }
     return *this;
   }      
   iterator&       operator--() {
-    if (entry_ != page_->begin())
+    if (page_.get() == nullptr || entry_ == page_->begin())
     {
-      --entry_;
+      --page_;
+      LastEntry();
     }
     else
     {
-      --page_;
-      if (page_->get() != nullptr) entry_ = --page_->end();
-      else entry_ = nullptr;
+      --entry_;
     }
     return *this;
   }
@@ -88,55 +284,84 @@ class TableIterator {
     operator--();
     return prev;
   }
-  bool operator==(const TableIteratorBase& it) {
+  bool operator==(const TableIterator& it) const {
     return entry_ == it.entry_ && page_ == it.page_;
   }
-  bool operator!=(const TableIteratorBase& it) {
+  bool operator!=(const TableIterator& it) const {
     return !(it == *this);
   }
 
-  friend Table;
-  friend PageIterator;
-
  protected:
 
+  /*
+   * FirstEntry - of the page, or of the next page with entries
+   */
+  void FirstEntry() {
+    while (page_.get() != nullptr && page_->empty()) ++page_;
+    entry_ = page_.get() != nullptr ? page_->begin() : nullptr;
+  }
+  /*
+   * LastEntry - of the page, or of the previous page with entries
+   */
+  void LastEntry() {
+    while (page_.get() != nullptr && page_->empty()) --page_;
+    entry_ = page_.get() != nullptr ? page_->end() - 1 : nullptr;
+  }
+
   pointer      entry_;
   PageIterator page_;
 };
 
 /*
  * Boilerplate for Table's PageIterators
+ *
+ * The page an iterator is on stays pinned until it moves on: a copy
+ * takes a pin of its own, so every pin is given back once.
  */
-template<typename Page, typename Table>
+template<typename Page, typename Storage>
 class PageIteratorBase {
   public:
-    Page&       operator*()        { return *page_; }
-    Page*       operator->()       { return page_; }
-    const Page& operator*()  const { return *page_; }
-    const Page* operator->() const { return page_; }
-    bool operator==(const PageIteratorBase& l) { 
-      return l.page_ == page_ && l.table_ == btree; 
+    PageIteratorBase(Storage* model) : page_(nullptr), model_(model) {}
+
+    PageIteratorBase(const PageIteratorBase& other) :
+        page_(nullptr), model_(other.model_) {
+      if (other.page_ != nullptr) Load(other.page_->header()->pageId);
     }
-    bool operator!=(const PageIteratorBase& l) { 
-      return !(*this == l); 
+    PageIteratorBase& operator=(const PageIteratorBase& other) {
+      model_ = other.model_;
+      if (other.page_ != nullptr) Load(other.page_->header()->pageId);
+      else Release();
+      return *this;
     }
-    PageIteratorBase operator++(int) {
-      auto tmp = *this;
-      this->operator++();
-      return tmp;
+    ~PageIteratorBase() { Release(); }
+
+    Page*       get()        const { return page_; }
+    Page&       operator*()  const { return *page_; }
+    Page*       operator->() const { return page_; }
+    bool operator==(const PageIteratorBase& l) const { 
+      return l.page_ == page_ && l.model_ == model_; 
     }
-    PageIteratorBase operator--(int) {
-      auto tmp = *this;
-      this->operator--();
-      return tmp;
+    bool operator!=(const PageIteratorBase& l) const { 
+      return !(*this == l); 
     }
 
-    virtual PageIteratorBase& operator++() = 0;
-    virtual PageIteratorBase& operator--() = 0;
+   protected:
+    /*
+     * Load - moves to the page, the new pin is taken first
+     */
+    void Load(PageId pageId) {
+      auto page = (Page*)model_->load_page(pageId);
+      Release();
+      page_ = page;
+    }
+    void Release() {
+      if (page_ == nullptr) return;
+      model_->release_page(page_->header()->pageId);
+      page_ = nullptr;
+    }
 
-   private:
-    Page* page_;
-    Table* table_;
+    Page*    page_;
+    Storage* model_;
 };
 
 /*
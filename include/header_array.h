@@ -24,9 +24,9 @@ std::string ContainerToString(const C& c)
   std::string containerString;
 
   std::for_each(
-      c->begin(),
-      c->end(),
-      [&containerString](typename C::const_reference x) {
+      c.begin(),
+      c.end(),
+      [&containerString](const typename C::value_type& x) {
         containerString += "\t" + x.ToString() + "\n";
       }
   );
@@ -161,8 +161,8 @@ class HeaderArray {
   find_last(std::function<bool(const T&)> predicate)
   {
     auto t = end();
-    while (t != begin()) if (!predicate(*--t)) break;
-    return ++t;
+    while (t != begin() && predicate(*(t - 1))) --t;
+    return t;
   }
   /*
    * find_last const
@@ -170,9 +170,9 @@ class HeaderArray {
   const T*
   find_last(std::function<bool(const T&)> unaryPredicate) const
   {
-    const auto t = end();
-    while (t != begin()) if (!predicate(*--t)) break;
-    return ++t;
+    auto t = end();
+    while (t != begin() && unaryPredicate(*(t - 1))) --t;
+    return t;
   }
 
   /*
@@ -206,7 +206,7 @@ class HeaderArray {
   void
   push_back(const T& what)
   {
-    RangeCheck(end() + 1);
+    RangeCheck(end());
     *end() = what;
     ++header()->size;
   }
@@ -240,10 +240,10 @@ struct Entry {
   Key key;
   Data data;
 
-  std::string ToString(const Entry<Key,Data>& e) 
+  std::string ToString() const
   {
-    return "{key:" + std::to_string(e.key) + 
-            ", data:" + std::to_string(e.data) + "}";
+    return "{key:" + std::to_string(key) + 
+            ", data:" + std::to_string(data) + "}";
   }
 };
 
@@ -260,7 +260,7 @@ SpliceLastN(
 {
   //steal the last n
   T* whereFrom = fromArray->end() - n;
-  std::move(whereFrom, fromArray->end() + 1, toArray.end());
+  std::move(whereFrom, fromArray->end() + 1, toArray->end());
 
   //adjust sizes
   fromArray->header()->size -= n;
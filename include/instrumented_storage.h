@@ -0,0 +1,348 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+
+#include "storage_model.h"
+
+/**
+ * Log-linear histogram of nanosecond latencies, as plain numbers.
+ *
+ * Every power of two is split into 2^sub_bucket_bits linear buckets, so
+ * a recorded value is known within 1/2^sub_bucket_bits of itself while
+ * the whole 64-bit range fits into a few hundred buckets. Values below
+ * 2^(sub_bucket_bits + 1) have a bucket of their own.
+ */
+struct histogram_snapshot {
+
+	static const unsigned sub_bucket_bits = 3;
+
+	static const size_t bucket_count = (64 - sub_bucket_bits + 1) << sub_bucket_bits;
+
+	std::array<uint64_t, bucket_count> buckets{};
+
+	uint64_t count = 0;
+
+	uint64_t sum = 0;
+
+	uint64_t max = 0;
+
+	static size_t bucket_of(uint64_t value) {
+		if (value < (1u << sub_bucket_bits)) {
+			return value;
+		}
+		unsigned shift = 63 - __builtin_clzll(value) - sub_bucket_bits;
+		return ((size_t)(shift + 1) << sub_bucket_bits) + ((value >> shift) & ((1u << sub_bucket_bits) - 1));
+	}
+
+	/**
+	 * Largest value which falls into the bucket.
+	 */
+	static uint64_t bucket_limit(size_t bucket) {
+		size_t group = bucket >> sub_bucket_bits;
+		if (group == 0) {
+			return bucket;
+		}
+		unsigned shift = group - 1;
+		uint64_t lower = (uint64_t)((1u << sub_bucket_bits) + (bucket & ((1u << sub_bucket_bits) - 1))) << shift;
+		return lower + ((uint64_t)1 << shift) - 1;
+	}
+
+	double mean() const {
+		return count == 0 ? 0.0 : (double)sum / count;
+	}
+
+	/**
+	 * Smallest bucket limit which at least the given fraction of the
+	 * values do not exceed.
+	 */
+	uint64_t percentile(double fraction) const {
+		uint64_t rank = (uint64_t)(fraction * count + 0.5);
+		uint64_t seen = 0;
+		for (size_t bucket = 0; bucket < bucket_count; ++bucket) {
+			seen += buckets[bucket];
+			if (seen >= rank && seen > 0) {
+				return std::min(bucket_limit(bucket), max);
+			}
+		}
+		return max;
+	}
+
+	/**
+	 * Values recorded since the earlier snapshot was taken; the maximum
+	 * is the one of the later snapshot.
+	 */
+	histogram_snapshot operator-(const histogram_snapshot& earlier) const {
+		histogram_snapshot difference = *this;
+		for (size_t bucket = 0; bucket < bucket_count; ++bucket) {
+			difference.buckets[bucket] -= earlier.buckets[bucket];
+		}
+		difference.count -= earlier.count;
+		difference.sum -= earlier.sum;
+		return difference;
+	}
+
+};
+
+/**
+ * The histogram being recorded into; record may be called from several
+ * threads at once.
+ */
+class latency_histogram {
+
+public:
+
+	latency_histogram() {
+		reset();
+	}
+
+	void record(uint64_t value) {
+		buckets[histogram_snapshot::bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+		count.fetch_add(1, std::memory_order_relaxed);
+		sum.fetch_add(value, std::memory_order_relaxed);
+		uint64_t seen = max.load(std::memory_order_relaxed);
+		while (value > seen && !max.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+		}
+	}
+
+	histogram_snapshot snapshot() const {
+		histogram_snapshot copy;
+		for (size_t bucket = 0; bucket < histogram_snapshot::bucket_count; ++bucket) {
+			copy.buckets[bucket] = buckets[bucket].load(std::memory_order_relaxed);
+		}
+		copy.count = count.load(std::memory_order_relaxed);
+		copy.sum = sum.load(std::memory_order_relaxed);
+		copy.max = max.load(std::memory_order_relaxed);
+		return copy;
+	}
+
+	void reset() {
+		for (auto& bucket : buckets) {
+			bucket.store(0, std::memory_order_relaxed);
+		}
+		count.store(0, std::memory_order_relaxed);
+		sum.store(0, std::memory_order_relaxed);
+		max.store(0, std::memory_order_relaxed);
+	}
+
+private:
+
+	std::atomic<uint64_t> buckets[histogram_snapshot::bucket_count];
+
+	std::atomic<uint64_t> count;
+
+	std::atomic<uint64_t> sum;
+
+	std::atomic<uint64_t> max;
+
+};
+
+/**
+ * Storage model which counts the calls passed on to another storage.
+ *
+ * For every kind of call it counts the calls and the bytes of the pages
+ * concerned, and records the latency of each call in a log-linear
+ * histogram. A batched call (load_pages, prefetch_pages) counts one call
+ * per page and records its latency once per page, divided among them.
+ * Asynchronous loads are timed from the request to the callback.
+ *
+ * snapshot copies all counters; the difference of two snapshots gives
+ * the cost of what ran in between, e.g. the page accesses of a single
+ * table operation. reset zeroes the counters and dump prints a table.
+ */
+class instrumented_storage : public storage_decorator {
+
+public:
+
+	enum operation {
+		op_create,
+		op_load,
+		op_save,
+		op_update,
+		op_release,
+		op_free,
+		op_prefetch,
+		operation_count
+	};
+
+	static const char* get_operation_name(operation kind) {
+		static const char* const names[operation_count] = {
+			"create", "load", "save", "update", "release", "free", "prefetch"
+		};
+		return names[kind];
+	}
+
+	struct operation_stats {
+		uint64_t calls = 0;
+		uint64_t bytes = 0;
+		histogram_snapshot latency;
+	};
+
+	struct storage_stats {
+		std::array<operation_stats, operation_count> operations;
+
+		const operation_stats& operator[](operation kind) const {
+			return operations[kind];
+		}
+
+		storage_stats operator-(const storage_stats& earlier) const {
+			storage_stats difference = *this;
+			for (size_t kind = 0; kind < operation_count; ++kind) {
+				difference.operations[kind].calls -= earlier.operations[kind].calls;
+				difference.operations[kind].bytes -= earlier.operations[kind].bytes;
+				difference.operations[kind].latency = operations[kind].latency - earlier.operations[kind].latency;
+			}
+			return difference;
+		}
+	};
+
+	instrumented_storage(storage_model* inner) : storage_decorator(inner) {
+		this->page_size = inner->get_page_size();
+		reset();
+	}
+
+	size_t create_page() {
+		clock::time_point start = clock::now();
+		size_t address = inner->create_page();
+		record(op_create, 1, page_size, start);
+		return address;
+	}
+
+	char* load_page(size_t address) {
+		clock::time_point start = clock::now();
+		char* page = inner->load_page(address);
+		record(op_load, 1, page_size, start);
+		return page;
+	}
+
+	void save_page(size_t address, char* page) {
+		clock::time_point start = clock::now();
+		inner->save_page(address, page);
+		record(op_save, 1, page_size, start);
+	}
+
+	void update_page(size_t address, char* page) {
+		clock::time_point start = clock::now();
+		inner->update_page(address, page);
+		record(op_update, 1, page_size, start);
+	}
+
+	void release_page(size_t address) {
+		clock::time_point start = clock::now();
+		inner->release_page(address);
+		record(op_release, 1, 0, start);
+	}
+
+	void free_page(size_t address) {
+		clock::time_point start = clock::now();
+		inner->free_page(address);
+		record(op_free, 1, 0, start);
+	}
+
+	void prefetch_pages(const size_t* addresses, size_t count) {
+		clock::time_point start = clock::now();
+		inner->prefetch_pages(addresses, count);
+		record(op_prefetch, count, count * page_size, start);
+	}
+
+	void load_pages(const size_t* addresses, size_t count, char** pages) {
+		clock::time_point start = clock::now();
+		inner->load_pages(addresses, count, pages);
+		record(op_load, count, count * page_size, start);
+	}
+
+	void load_page_async(size_t address, page_callback callback) {
+		inner->load_page_async(address, timed(std::move(callback)));
+	}
+
+	void load_pages_async(const size_t* addresses, size_t count, page_callback callback) {
+		inner->load_pages_async(addresses, count, timed(std::move(callback)));
+	}
+
+public:
+
+	storage_stats snapshot() const {
+		storage_stats stats;
+		for (size_t kind = 0; kind < operation_count; ++kind) {
+			stats.operations[kind].calls = counters[kind].calls.load(std::memory_order_relaxed);
+			stats.operations[kind].bytes = counters[kind].bytes.load(std::memory_order_relaxed);
+			stats.operations[kind].latency = counters[kind].latency.snapshot();
+		}
+		return stats;
+	}
+
+	void reset() {
+		for (auto& counter : counters) {
+			counter.calls.store(0, std::memory_order_relaxed);
+			counter.bytes.store(0, std::memory_order_relaxed);
+			counter.latency.reset();
+		}
+	}
+
+	void dump(std::ostream& stream) const {
+		dump(snapshot(), stream);
+	}
+
+	/**
+	 * Prints one line per kind of call which was made: calls, bytes, and
+	 * mean, median, 99th percentile and maximum latency in nanoseconds.
+	 */
+	static void dump(const storage_stats& stats, std::ostream& stream) {
+		stream << std::left << std::setw(10) << "call" << std::right
+			<< std::setw(12) << "calls" << std::setw(14) << "bytes"
+			<< std::setw(10) << "mean" << std::setw(10) << "p50"
+			<< std::setw(10) << "p99" << std::setw(12) << "max" << std::endl;
+		for (size_t kind = 0; kind < operation_count; ++kind) {
+			const operation_stats& current = stats.operations[kind];
+			if (current.calls == 0) {
+				continue;
+			}
+			stream << std::left << std::setw(10) << get_operation_name((operation)kind) << std::right
+				<< std::setw(12) << current.calls << std::setw(14) << current.bytes
+				<< std::setw(10) << (uint64_t)current.latency.mean()
+				<< std::setw(10) << current.latency.percentile(0.5)
+				<< std::setw(10) << current.latency.percentile(0.99)
+				<< std::setw(12) << current.latency.max << std::endl;
+		}
+	}
+
+private:
+
+	using clock = std::chrono::steady_clock;
+
+	struct operation_counters {
+		std::atomic<uint64_t> calls;
+		std::atomic<uint64_t> bytes;
+		latency_histogram latency;
+	};
+
+	void record(operation kind, size_t calls, size_t bytes, clock::time_point start) {
+		uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+		operation_counters& counter = counters[kind];
+		counter.calls.fetch_add(calls, std::memory_order_relaxed);
+		counter.bytes.fetch_add(bytes, std::memory_order_relaxed);
+		for (size_t call = 0; call < calls; ++call) {
+			counter.latency.record(elapsed / calls);
+		}
+	}
+
+	page_callback timed(page_callback callback) {
+		clock::time_point start = clock::now();
+		return [this, callback, start](size_t address, char* page) {
+			record(op_load, 1, page ? page_size : 0, start);
+			callback(address, page);
+		};
+	}
+
+private:
+
+	size_t page_size;
+
+	operation_counters counters[operation_count];
+
+};
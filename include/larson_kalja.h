@@ -1,12 +1,17 @@
 //larson_kalja.h
 #pragma once
 
+#include <cassert>
 #include <cmath>
 #include <cstdint>
+#include <cstdio>
 #include <list>
 #include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
+#include "hash_interface.h"
 #include "header_array.h"
 #include "storage_model.h"
 #include "universal_hash.h"
@@ -14,7 +19,7 @@
 
 namespace data_org_project_names {
 
-void HashError()
+inline void HashError()
 {
     printf("unrealistic hash conditions, aborting\n");
     assert(false);
@@ -41,6 +46,10 @@ struct LkPageEntry {
   Key    key;
   Data   data;
 
+  LkPageEntry() = default;
+  LkPageEntry(const Key& key, const Data& data) : 
+    key(key), data(data), hashIx_(0) {}
+
   void   AdvanceHashIx() { ++hashIx_; }
   size_t hashIx() const { return hashIx_; }
 
@@ -67,7 +76,7 @@ using Directory = std::vector<LkDirEntry>;
 /*
  * ToString(Directory)
  */
-std::string
+inline std::string
 ToString(const Directory& directory)
 {
   std::string dir = "{Directory:\n";
@@ -88,6 +97,8 @@ ToString(const Directory& directory)
  * size_t Advance(overflowEntry, directory)
  * 
  * std::pair<bool,LkDirEntry> Search(key, dir) const
+ * void HashBatch(keys, n, dirIxs, signatures) const
+ * void SearchBatch(keys, n, dir, results) const
  *
  * private:
  * void Expand()
@@ -117,6 +128,14 @@ class LkHash {
    */
 
   LkHash(size_t maxDir) : lkHx_(1), maxDir_(maxDir) {}
+  /*
+   * LkHash(maxDir, lkHx) - the sequence an LkTable saved (Sequence())
+   */
+  LkHash(size_t maxDir, std::vector<LkHx> lkHx) :
+      lkHx_(std::move(lkHx)), maxDir_(maxDir) {}
+
+  const std::vector<LkHx>& Sequence() const { return lkHx_; }
+  size_t                   MaxDir()   const { return maxDir_; }
 
   /*
    * Signature
@@ -149,6 +168,50 @@ class LkHash {
       if (hx.Sig(key) < dir[dirIx].separator) return {true, dir[dirIx]}; } 
     return {false,{0,0}};
   }
+  /*
+   * HashBatch
+   *
+   * Directory indices and signatures of n keys under the first hash pair,
+   * with DirHash::hash_batch and SigHash::hash_batch (4 or 8 keys at once,
+   * see UniHash).  Most keys are resolved by the first pair.
+   */
+  void
+  HashBatch(
+      const Key* keys,
+      size_t     n,
+      uint64_t*  dirIxs,
+      uint64_t*  signatures) const
+  {
+    lkHx_[0].DirIx.hash_batch(keys, n, dirIxs);
+    lkHx_[0].Sig.hash_batch(keys, n, signatures);
+    for (size_t i = 0; i < n; ++i) dirIxs[i] %= maxDir_;
+  }
+  /*
+   * SearchBatch
+   *
+   * results[i] = Search(keys[i], dir), the first hash pair computed for all
+   * keys at once and the rest of the sequence only for keys it doesn't
+   * resolve.
+   */
+  void
+  SearchBatch(
+      const Key*                  keys,
+      size_t                      n,
+      const Directory&            dir,
+      std::pair<bool,LkDirEntry>* results) const
+  {
+    std::vector<uint64_t> dirIxs(n);
+    std::vector<uint64_t> signatures(n);
+    HashBatch(keys, n, dirIxs.data(), signatures.data());
+
+    for (size_t i = 0; i < n; ++i)
+    {
+      if (signatures[i] < dir[dirIxs[i]].separator)
+        results[i] = {true, dir[dirIxs[i]]};
+      else
+        results[i] = Search(keys[i], dir);
+    }
+  }
   /*
    * Advance
    *
@@ -160,10 +223,10 @@ class LkHash {
       PageEntry& overflowEntry,
       const Directory& directory)
   {
-    size_t hashIx = overflowEntry.hashIx();
-
     while (true) 
     {
+      size_t hashIx = overflowEntry.hashIx();
+
       //expand the number of available hash functions if necessary
       if (hashIx == lkHx_.size()) Expand();
 
@@ -197,27 +260,32 @@ class LkHash {
 
 /**
  * LkTable is an honest to goodness hash table that works with a
- * LkDirectory and a storage_model to get pages.
+ * LkDirectory and a storage_model (or any Storage implementing it) to get
+ * pages.
  *
  * public:
  *  void                         insert(const Key& key, Data data)
  *  bool                         erase(const Key& key)
- *  std::pair<bool, LkPageEntry> find(const Key& key) const
+ *  std::pair<bool, Data>        find(const Key& key) const
+ *  iterator                     begin()              const
+ *  iterator                     end()                const
  *  std::string                  ToString()           const
  *  inline size_t                size()               const
  *  inline size_t                capacity()           const
  *  inline double                LoadFactor()         const
+ *  PageId                       SaveMeta()
  *
  *  friend class LkTableIterator
  *
  * private:
  *  void CreatePages();
  *
- *  storage_model* model_;
+ *  Storage*       model_;
  *  LkHash         lkHash_;
  *  Directory      directory_;
  *  size_t         size_;
  *  size_t         capacity_;
+ *  std::vector<PageId> metaPages_;
  *
 */
 
@@ -231,37 +299,105 @@ class LkTableIterator;
 template<
   typename Key,
   typename Data,
-  typename Hash = UniHash<Key>
+  typename Hash = UniHash<Key>,
+  typename Storage = storage_model
   >
 class LkTable : public HashInterface<Key, Data, Hash> {
+  static_assert(is_storage_model<Storage>::value,
+      "LkTable: Storage must implement storage_model");
  public:
   using PageEntry    = LkPageEntry<Key, Data>;
   using Page         = LkPage<Key, Data>;
-  using Hash         = LkHash<Key, Data>;
+  using LkHashType   = LkHash<Key, Data, Hash, Hash>;
   using OverflowList = std::list<PageEntry>;
   using Header       = LkHeader;
-  using Table        = LkTable<Key, Data, Hash>;
+  using Table        = LkTable<Key, Data, Hash, Storage>;
+  using StorageType  = Storage;
 
   class PageIterator;
   using iterator     = TableIterator<Key, Data, LkPageEntry, PageIterator>;
 
 
-  LkTable(storage_model* model,
+  LkTable(Storage* model,
           size_t numPages) : 
       model_(model),
       lkHash_(numPages),
-      directory_(numPages)
+      directory_(numPages),
+      size_(0),
+      capacity_(0)
   {
     CreatePages();
+  }
+  /*
+   * LkTable(model, metaPageId, OpenTable())
+   *
+   * Opens the table whose SaveMeta returned metaPageId.  The pages are
+   * only loaded and released, so a process which can't write to the
+   * storage may open the table and find keys in it.
+   */
+  LkTable(Storage* model,
+          PageId   metaPageId,
+          OpenTable) :
+      model_(model),
+      lkHash_(0),
+      size_(0),
+      capacity_(0)
+  {
+    std::string bytes = LoadMetaPages(model_, metaPageId, metaPages_);
+    size_t offset = 0;
+    size_t maxDir = 0;
+    size_t numHx = 0;
+
+    ReadMeta(bytes, offset, &size_);
+    ReadMeta(bytes, offset, &capacity_);
+    ReadMeta(bytes, offset, &maxDir);
+    ReadMeta(bytes, offset, &numHx);
+
+    directory_.resize(maxDir);
+    ReadMeta(bytes, offset, directory_.data(), maxDir);
+
+    std::vector<typename LkHashType::LkHx> lkHx(numHx);
+    ReadMeta(bytes, offset, lkHx.data(), numHx);
+    lkHash_ = LkHashType(maxDir, std::move(lkHx));
+  }
+  /*
+   * SaveMeta
+   *
+   * Writes the directory, the hash sequence, size and capacity, which
+   * the table keeps in memory, to meta pages in the storage and returns
+   * the id of the first one; LkTable(model, id, OpenTable()) opens the
+   * table from there.  The pages are created by the first call and
+   * rewritten by the next ones, so the id stays the same as long as
+   * Compact doesn't move the page.  Inserts change the directory and
+   * may lengthen the hash sequence, so the meta pages describe the
+   * table as of the last call.
+   */
+  PageId
+  SaveMeta()
+  {
+    const auto& lkHx = lkHash_.Sequence();
+    size_t maxDir = lkHash_.MaxDir();
+    size_t numHx = lkHx.size();
+
+    std::string bytes;
+    AppendMeta(bytes, &size_);
+    AppendMeta(bytes, &capacity_);
+    AppendMeta(bytes, &maxDir);
+    AppendMeta(bytes, &numHx);
+    AppendMeta(bytes, directory_.data(), directory_.size());
+    AppendMeta(bytes, lkHx.data(), numHx);
+
+    SaveMetaPages(model_, bytes, metaPages_);
+    return metaPages_.front();
   }
     /*
      * find
      */
-  iterator
-  find(const Key& key) const
+  std::pair<bool, Data>
+  find(const Key& key) const override
   {
     auto searchResult = lkHash_.Search(key, directory_);
-    if (!searchResult.first) return {false, {0,0}};
+    if (!searchResult.first) return {false, Data()};
 
     size_t pageId = searchResult.second.pageId;
     auto   page   = (Page*)model_->load_page(pageId);
@@ -271,30 +407,36 @@ class LkTable : public HashInterface<Key, Data, Hash> {
         [key](const PageEntry& e) { return e.key == key; }
     );
 
-    return {keyMatch, page, this};
+    std::pair<bool, Data> result = {false, Data()};
+    if (keyMatch != page->end()) result = {true, keyMatch->data};
+
+    model_->release_page(pageId);
+    return result;
   }
     /*
      * insert
      */
   void
-  insert(const Key& key, const Data& data) 
+  insert(const Key& key, const Data& data) override
   {
     OverflowList Q;
     OverflowList pageOverflow;
     bool firstLoop = true;
 
-    Q.push_back({key, data, 0});
+    Q.push_back({key, data});
 
     while (!Q.empty()) {
 
       PageEntry iEntry = Q.front();
       Q.pop_front();
 
-      size_t dirIx = lkHash_.Advance(iEntry, directory_);
-      auto   page  = (Page*)model_->load_page(dirIx);
+      size_t dirIx  = lkHash_.Advance(iEntry, directory_);
+      PageId pageId = directory_[dirIx].pageId;
+      auto   page   = (Page*)model_->load_page(pageId);
 
       /*
-       * First Loop: check to see if our size must increase
+       * First Loop: the key may be in the table already, else our size
+       * must increase
        */
       if (firstLoop) 
       {
@@ -302,10 +444,18 @@ class LkTable : public HashInterface<Key, Data, Hash> {
             [key](const PageEntry& e) { return e.key == key; }
         );
 
-        if (match == page->end()) ++size_; //inserting new key
+        if (match != page->end()) 
+        {
+          match->data = data;
+          model_->save_page(pageId, (char*)page);
+          return;
+        }
+
+        ++size_; //inserting new key
         firstLoop = false;
+      }
 
-      } else if (page->full()) {
+      if (page->full()) {
 
         pageOverflow = PageOverflow(page, iEntry, lkHash_);
 
@@ -318,29 +468,36 @@ class LkTable : public HashInterface<Key, Data, Hash> {
 
         PageInsertNonFull(page, iEntry);
       }
+
+      model_->save_page(pageId, (char*)page);
     }
   }
   /*
    * erase
    */
   bool
-  erase(const Key& key)
+  erase(const Key& key) override
   {
     auto directorySearch = lkHash_.Search(key, directory_);
     if (!directorySearch.first) return false;
 
-    size_t dirIx = directorySearch.second.pageId;
-    auto   page  = (Page*)model_->load_page(directory_[dirIx].pageId);
+    PageId pageId = directorySearch.second.pageId;
+    auto   page   = (Page*)model_->load_page(pageId);
 
     PageEntry* eraseEntry = page->find(
         [key](const PageEntry& e) { return e.key == key; }
     );
 
-    if (eraseEntry == page->end()) return false; //don't have it
+    if (eraseEntry == page->end()) //don't have it
+    {
+      model_->release_page(pageId);
+      return false;
+    }
 
     page->erase(eraseEntry);
     --size_;
 
+    model_->save_page(pageId, (char*)page);
     return true;
   }
   /*
@@ -352,76 +509,63 @@ class LkTable : public HashInterface<Key, Data, Hash> {
     std::string str;
     str += "\nPages:\n";
 
-    for (auto dirEntry : directory_) 
+    for (auto dirIt = directory_.begin(); dirIt != directory_.end(); ++dirIt) 
     {
-      auto page = (Page*) model_->load_page(dirEntry.pageId);
+      size_t dirIx = dirIt - directory_.begin();
+      if (dirIx % kPrefetchWindow == 0) PrefetchDirectory(dirIt + 1);
+
+      auto page = (Page*) model_->load_page(dirIt->pageId);
       str += page->ToString() + "\n";
+      model_->release_page(dirIt->pageId);
     }
     return str + "\n";
   }
   /*
-   * Successor
+   * begin - the entries in directory order
    */
-  iterator& Successor(iterator& it)
+  iterator
+  begin() const
   {
-    if (it.entry_ != it.page_->end()) 
-    {
-      ++it.entry_;
-      return it;
-    } 
-
-    auto dirIt = std::find_if(
-        directory_.begin(),
-        directory_.end(),
-        [it](PageId pageId) { return pageId == it.pageId; }
-    );
-    
-    if (dirIt != directory_.end()) 
-    {
-      ++dirIt;
-      it.page_ = (Page*)model_->load_page(*dirIt);
-      it.entry_ = it.page_->begin();
-    }
-    else
-    {
-      it.entry_ = nullptr;
-      it.page_  = nullptr;
-    }
-
-    return it;
+    PageIterator page(this);
+    return iterator(++page);
   }
   /*
-   * Predecessor
+   * end
    */
-  iterator& Predecessor(iterator& it)
+  iterator
+  end() const
   {
-    if (it.entry_ != it.page_->begin()) 
-    {
-      --it.entry_;
-      return it;
-    } 
-
-    auto dirIt = std::find_if(
-        directory_.rbegin(),
-        directory_.rend(),
-        [it](PageId pageId) { return pageId == it.pageId; }
-    );
-    
-    if (dirIt != directory_.begin()) 
-    {
-      --dirIt;
-      it.page_ = (Page*)model_->load_page(*dirIt);
-      it.entry_ = --it.page_->end();
-    }
-    else
-    {
-      it.entry_ = nullptr;
-      it.page_  = nullptr;
-    }
-
-    return it;
+    return iterator(PageIterator(this));
   }
 
+  /*
+   * Compact
+   *
+   * The table never frees pages itself, but it may share the storage
+   * with structures which do.  Pages moved by the storage get their new
+   * id in the directory.  Moved meta pages are rewritten, since they
+   * link to each other; SaveMeta then returns the new first id.
+   */
+  size_t
+  Compact()
+  {
+    bool metaMoved = false;
+    size_t moved = model_->compact([this, &metaMoved](PageId from, PageId to) {
+        RelocatePage(model_, to);
+        for (auto& dirEntry : directory_)
+        {
+          if (dirEntry.pageId == from) dirEntry.pageId = to;
+        }
+        for (auto& metaPage : metaPages_)
+        {
+          if (metaPage != from) continue;
+          metaPage  = to;
+          metaMoved = true;
+        }
+    });
+    if (metaMoved) SaveMeta();
+    return moved;
+  }
 
   inline size_t size()       const { return size_; }
   inline size_t capacity()   const { return capacity_; }
@@ -430,36 +574,43 @@ class LkTable : public HashInterface<Key, Data, Hash> {
   friend class LkTableIterator<Key, Data, Hash>;
 
  private:
+  /*
+   * PrefetchDirectory
+   *
+   * Announces the pages of the next kPrefetchWindow directory entries
+   * starting at from.
+   */
+  void
+  PrefetchDirectory(Directory::const_iterator from) const
+  {
+    if (from >= directory_.end()) return;
+
+    PrefetchPages(
+        model_,
+        from,
+        directory_.end(),
+        [](const LkDirEntry& dirEntry) { return dirEntry.pageId; }
+    );
+  }
   /*
    * CreatePages
    *
    * Asks the storage model to create pages to fill up the directory.
-   * After loading the page, its header is initialized and the page is
-   * released.
+   * Every page is saved with its header initialized.
    */
   void
   CreatePages() 
   {
-    size_t pageSize = model_->get_page_size();
-
     for (auto& dirEntry : directory_) 
     {
-      PageId newPageId = model_->create_page();
+      auto newPage = CreateInitializedPage<LkHeader, PageEntry>(model_);
 
-      dirEntry.pageId  = newPageId;
+      dirEntry.pageId  = newPage.first;
       dirEntry.separator = SIZE_MAX;
 
-      auto pageHeader = (LkHeader*)model_->load_page(newPageId);
-
-      InitializeHeader<LkHeader, PageEntry>(
-          pageHeader,
-          pageSize,
-          newPageId
-          );
-
-      capacity_ += pageHeader->max_size;
+      capacity_ += newPage.second->max_size;
 
-      model_->release_page(newPageId);
+      model_->save_page(newPage.first, (char*)newPage.second);
     }
   }
   /*
@@ -495,107 +646,91 @@ class LkTable : public HashInterface<Key, Data, Hash> {
   OverflowList
   PageOverflow(Page*    page, 
          const PageEntry& iEntry,
-         const Hash&    lkHash)
+         const LkHashType& lkHash)
   {
     OverflowList pageOverflow;
     auto endSignature = lkHash.Signature(page->back());
     auto keySignature = lkHash.Signature(iEntry);
 
+    //the entries with the largest signature leave the page...
     PageEntry* overflowBegin = page->find_last(
-      [endSignature, lkHash](const PageEntry& e) {
+      [endSignature, &lkHash](const PageEntry& e) {
         return endSignature == lkHash.Signature(e);
       });
 
-    PageEntry* insertionPoint = page->find(
-      [keySignature, lkHash](const PageEntry& e) {
-        return keySignature <= lkHash.Signature(e);
-      });
-
-    bool iEntryOverflow = (overflowBegin == page->end() ||
-           lkHash.Signature(*insertionPoint) == endSignature);
-
     while (overflowBegin != page->end()) 
     {
       pageOverflow.push_back(*overflowBegin);
       page->erase(overflowBegin);
     }
 
-    if (iEntryOverflow) pageOverflow.push_back(iEntry);
-    if (!iEntryOverflow) page->insert(insertionPoint, iEntry);
+    //...and so does iEntry, unless its signature is smaller
+    if (keySignature >= endSignature) pageOverflow.push_back(iEntry);
+    else PageInsertNonFull(page, iEntry);
 
     return pageOverflow;
   }
 
 
-  class PageIterator : Public PageIteratorBase<Page, Table> {
+ public:
+
+  class PageIterator : public PageIteratorBase<Page, Storage> {
     public:
-      using PageIteratorBase<LeafNode, Table>::page_;
-      using PageIteratorBase<LeafNode, Table>::table_;
+      using PageIteratorBase<Page, Storage>::page_;
+
+      PageIterator(const Table* table) :
+        PageIteratorBase<Page, Storage>(table->model_),
+        table_(table),
+        dirIx_(0) {}
 
-      PageIterator& operator++() override {
-        storage_model* model_  = table_->model_;
+      PageIterator& operator++() {
         const Directory& directory_ = table_->directory_;
 
-        if (directory_.size() == 0) {
-          dirIt = directory_.cend();
-          page_ = nullptr;
-        }
-        else if (page_ == nullptr)
+        dirIx_ = page_ == nullptr ? 0 : dirIx_ + 1;
+
+        if (dirIx_ >= directory_.size())
         {
-          dirIt = directory_.cbegin();
-          page_ = model_->load_page(dirIt->pageId);
+          this->Release();
         }
         else
         {
-          if (dirIt == directory_->cend())
-          {
-            page_ = nullptr;
-          }
-          else
-          {
-            page_ = (Page*)model_->load_page(*++dirIt);
-          }
+          if (dirIx_ % kPrefetchWindow == 0) 
+            table_->PrefetchDirectory(directory_.cbegin() + dirIx_ + 1);
+          this->Load(directory_[dirIx_].pageId);
         }
         return *this;
       }
-      PageIterator& operator--() override {
-        storage_model* model_  = table_->model_;
+      PageIterator& operator--() {
         const Directory& directory_ = table_->directory_;
 
-        if (directory_.size() == 0) {
-          dirIt = directory_.cbegin();
-          page_ = nullptr;
-        }
-        else if (page_ == nullptr)
+        if (page_ == nullptr) dirIx_ = directory_.size();
+
+        if (dirIx_ == 0)
         {
-          dirIt = --directory_.cend();
-          page_ = model_->load_page(dirIt->pageId);
+          this->Release();
         }
         else
         {
-          if (dirIt == directory_->cbegin())
-          {
-            page_ = nullptr;
-          }
-          else
-          {
-            page_ = (Page*)model_->load_page(*--dirIt);
-          }
+          this->Load(directory_[--dirIx_].pageId);
         }
         return *this;
       }
 
     private:
 
-      Directory::const_iterator dirIt;
+      const Table* table_;
+      size_t       dirIx_;
   };
 
 
-  storage_model* model_;
-  Hash           lkHash_;
-  Directory      directory_;
-  size_t         size_;
-  size_t         capacity_;
+ private:
+
+  Storage*            model_;
+  LkHashType          lkHash_;
+  Directory           directory_;
+  size_t              size_;
+  size_t              capacity_;
+  std::vector<PageId> metaPages_;
 };
 
 
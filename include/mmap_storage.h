@@ -0,0 +1,353 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "storage_model.h"
+
+/**
+ * Memory-mapped implementation of the memory model.
+ *
+ * The whole backing file is mapped into the address space and load_page
+ * returns a pointer straight into the mapping, so there is no copy and
+ * no allocation per page; caching and write-back are left to the
+ * operating system. save_page, update_page and release_page are no-ops,
+ * use sync to force the pages to the disk.
+ *
+ * The file starts with a header (one OS page, so the data pages stay
+ * aligned) holding the page size and the number of created pages.
+ * The constructor reserves reserve_size bytes of address space
+ * (PROT_NONE, so no memory is committed) and maps the file at its
+ * start. When create_page runs out of mapped space the file is extended
+ * by extent_size bytes with ftruncate and the new extent is mapped with
+ * MAP_FIXED right after the old ones, so the mapping never moves and
+ * the pointers returned by load_page stay valid while the file grows.
+ * The file cannot outgrow the reservation.
+ *
+ * Freed pages form a list threaded through the pages themselves: the
+ * first eight bytes of a free page hold the address of the next one,
+ * and the header holds the first. So the free list is persistent
+ * without any extra write. A bit per page, built from the list when the
+ * file is opened, tells free pages apart so a page cannot be freed
+ * twice. compact moves the last live pages into the lowest free pages
+ * and shrinks the file (and the mapping) to whole extents.
+ */
+class mmap_storage final : public storage_model {
+
+public:
+
+	mmap_storage(const std::string& path, size_t page_size, size_t extent_size = 64 << 20,
+			size_t reserve_size = (size_t)1 << 40) {
+		this->page_size = page_size;
+		this->header_size = (size_t)::sysconf(_SC_PAGESIZE);
+		this->extent_size = round_up(std::max(extent_size, page_size), page_size);
+		this->mapping = nullptr;
+		this->fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+		if (fd < 0) {
+			throw_io_error("open " + path);
+		}
+		// The destructor does not run for a storage which is not built.
+		try {
+			struct stat info;
+			if (::fstat(fd, &info) != 0) {
+				throw_io_error("stat " + path);
+			}
+			bool existing = (size_t)info.st_size >= header_size;
+			mapped_size = existing ? info.st_size : header_size + this->extent_size;
+			if (!existing && ::ftruncate(fd, mapped_size) != 0) {
+				throw_io_error("truncate " + path);
+			}
+			this->reserved_size = round_up(std::max(reserve_size, mapped_size), header_size);
+			reserve();
+			map_file();
+			if (existing) {
+				check_header(path);
+				read_free_list(path);
+			} else {
+				std::memcpy(header()->magic, magic(), sizeof(header()->magic));
+				header()->page_size = page_size;
+				header()->page_count = 0;
+				header()->free_head = 0;
+			}
+		} catch (...) {
+			if (mapping != nullptr) {
+				::munmap(mapping, reserved_size);
+			}
+			::close(fd);
+			throw;
+		}
+	}
+
+	~mmap_storage() {
+		::munmap(mapping, reserved_size);
+		::close(fd);
+	}
+
+	size_t get_page_size() const {
+		return page_size;
+	}
+
+	size_t create_page() {
+		if (header()->free_head != 0) {
+			size_t address = header()->free_head - 1;
+			std::memcpy(&header()->free_head, page_at(address), sizeof(uint64_t));
+			std::memset(page_at(address), 0, page_size);
+			free_flags[address] = false;
+			return address;
+		}
+		size_t address = header()->page_count;
+		if (header_size + (address + 1) * page_size > mapped_size) {
+			grow();
+		}
+		++header()->page_count;
+		free_flags.push_back(false);
+		return address;
+	}
+
+	char* load_page(size_t address) {
+		if (address >= header()->page_count) {
+			throw std::out_of_range("mmap_storage: no page " + std::to_string(address));
+		}
+		return page_at(address);
+	}
+
+	void save_page(size_t address, char* page) {
+		// No operation here, the page is the file.
+	}
+
+	void update_page(size_t address, char* page) {
+		// No operation here, the page is the file.
+	}
+
+	void release_page(size_t address) {
+		// No operation here.
+	}
+
+	void free_page(size_t address) {
+		if (page_size < sizeof(uint64_t)) {
+			throw std::runtime_error("mmap_storage: pages are too small to be freed");
+		}
+		char* page = load_page(address);
+		if (free_flags[address]) {
+			throw std::runtime_error("mmap_storage: page " + std::to_string(address) + " is already free");
+		}
+		std::memcpy(page, &header()->free_head, sizeof(uint64_t));
+		header()->free_head = address + 1;
+		free_flags[address] = true;
+	}
+
+	size_t compact(relocate_callback relocate) {
+		std::vector<size_t> free_pages;
+		for (size_t address = 0; address < free_flags.size(); ++address) {
+			if (free_flags[address]) {
+				free_pages.push_back(address);
+			}
+		}
+		size_t moved = 0;
+		size_t first = 0;
+		size_t last = free_pages.size();
+		while (first < last) {
+			size_t top = --header()->page_count;
+			if (free_pages[last - 1] == top) {
+				--last;
+				continue;
+			}
+			// The top page is live and every remaining free page is below it.
+			size_t to = free_pages[first++];
+			std::memcpy(page_at(to), page_at(top), page_size);
+			relocate(top, to);
+			++moved;
+		}
+		header()->free_head = 0;
+		free_flags.assign(header()->page_count, false);
+		shrink();
+		return moved;
+	}
+
+	/**
+	 * Asks the kernel to read the pages into the page cache.
+	 */
+	void prefetch_pages(const size_t* addresses, size_t count) {
+		for (size_t index = 0; index < count; ++index) {
+			if (addresses[index] >= header()->page_count) {
+				continue;
+			}
+			size_t begin = header_size + addresses[index] * page_size;
+			size_t aligned = begin / header_size * header_size;
+			::madvise(mapping + aligned, begin + page_size - aligned, MADV_WILLNEED);
+		}
+	}
+
+public:
+
+	/**
+	 * Write all modified pages of the mapping to the disk.
+	 */
+	void sync() {
+		if (::msync(mapping, mapped_size, MS_SYNC) != 0) {
+			throw_io_error("msync");
+		}
+	}
+
+	size_t get_page_count() const {
+		return header()->page_count;
+	}
+
+	size_t get_free_page_count() const {
+		return std::count(free_flags.begin(), free_flags.end(), true);
+	}
+
+private:
+
+	struct file_header {
+		char magic[8];
+		uint64_t page_size;
+		uint64_t page_count;
+		// Address of the first free page plus one, 0 if there is none.
+		uint64_t free_head;
+	};
+
+	static const char* magic() {
+		return "DOPMMAP";
+	}
+
+	file_header* header() const {
+		return (file_header*)mapping;
+	}
+
+	char* page_at(size_t address) const {
+		return mapping + header_size + address * page_size;
+	}
+
+	static size_t round_up(size_t value, size_t unit) {
+		return (value + unit - 1) / unit * unit;
+	}
+
+	void reserve() {
+		void* address = ::mmap(nullptr, reserved_size, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (address == MAP_FAILED) {
+			throw_io_error("reserve address space");
+		}
+		mapping = (char*)address;
+	}
+
+	/**
+	 * Map the file from offset begin (rounded down to an OS page) to
+	 * mapped_size over the reservation.
+	 */
+	void map_file(size_t begin = 0) {
+		size_t aligned = begin / header_size * header_size;
+		void* address = ::mmap(mapping + aligned, mapped_size - aligned, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED, fd, aligned);
+		if (address == MAP_FAILED) {
+			throw_io_error("mmap");
+		}
+	}
+
+	void check_header(const std::string& path) {
+		if (std::memcmp(header()->magic, magic(), sizeof(header()->magic)) != 0) {
+			throw std::runtime_error("mmap_storage: " + path + " is not a page file");
+		}
+		if (header()->page_size != page_size) {
+			throw std::runtime_error("mmap_storage: " + path + " has page size " +
+				std::to_string(header()->page_size));
+		}
+		// Pages past the end of a truncated file would raise SIGBUS when touched.
+		if (header()->page_count > (mapped_size - header_size) / page_size) {
+			throw std::runtime_error("mmap_storage: " + path + " is truncated");
+		}
+	}
+
+	/**
+	 * A free list with a cycle or a page out of range would make
+	 * create_page and compact go wrong, so it is checked here.
+	 */
+	void read_free_list(const std::string& path) {
+		free_flags.assign(header()->page_count, false);
+		for (uint64_t next = header()->free_head; next != 0; ) {
+			if (next > header()->page_count || free_flags[next - 1]) {
+				throw std::runtime_error("mmap_storage: " + path + " has a corrupted free list");
+			}
+			free_flags[next - 1] = true;
+			std::memcpy(&next, page_at(next - 1), sizeof(next));
+		}
+	}
+
+	void grow() {
+		size_t new_size = mapped_size + extent_size;
+		if (new_size > reserved_size) {
+			throw std::runtime_error("mmap_storage: the file would outgrow the reserved " +
+				std::to_string(reserved_size) + " bytes");
+		}
+		if (::ftruncate(fd, new_size) != 0) {
+			throw_io_error("truncate");
+		}
+		size_t old_size = mapped_size;
+		mapped_size = new_size;
+		try {
+			map_file(old_size);
+		} catch (...) {
+			mapped_size = old_size;
+			throw;
+		}
+	}
+
+	/**
+	 * Cut the file down to the whole extents holding the pages, at
+	 * least one.
+	 */
+	void shrink() {
+		size_t used = std::max(header()->page_count * page_size, (size_t)1);
+		size_t new_size = header_size + round_up(used, extent_size);
+		if (new_size >= mapped_size) {
+			return;
+		}
+		// The OS pages past the file go back to the reservation.
+		size_t aligned = round_up(new_size, header_size);
+		if (aligned < mapped_size) {
+			void* address = ::mmap(mapping + aligned, mapped_size - aligned, PROT_NONE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+			if (address == MAP_FAILED) {
+				throw_io_error("mmap");
+			}
+		}
+		mapped_size = new_size;
+		if (::ftruncate(fd, new_size) != 0) {
+			throw_io_error("truncate");
+		}
+	}
+
+	static void throw_io_error(const std::string& what) {
+		throw std::runtime_error("mmap_storage: " + what + ": " + std::strerror(errno));
+	}
+
+private:
+
+	size_t page_size;
+
+	size_t header_size;
+
+	size_t extent_size;
+
+	size_t mapped_size;
+
+	size_t reserved_size;
+
+	int fd;
+
+	char* mapping;
+
+	std::vector<bool> free_flags;
+
+};
@@ -0,0 +1,449 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Engine for asynchronous reads and writes of whole pages.
+ *
+ * submit_read and submit_write queue a request, submit hands all queued
+ * requests to the operating system at once, so a batch of pages costs
+ * a single system call. When a request finishes its completion is
+ * called with the number of transferred bytes, or -errno on failure.
+ * Completions are called from a thread of the engine.
+ *
+ * The destructor waits until every submitted request has completed.
+ *
+ * Use create to get the best engine available: io_uring on Linux, or a
+ * pool of threads doing pread/pwrite when io_uring can not be set up or
+ * does not support plain reads and writes (kernels before 5.6).
+ */
+class page_io_engine {
+
+public:
+
+	using completion = std::function<void(ssize_t result)>;
+
+	virtual ~page_io_engine() {}
+
+	virtual void submit_read(int fd, char* buffer, size_t size, off_t offset, completion done) = 0;
+
+	virtual void submit_write(int fd, const char* buffer, size_t size, off_t offset, completion done) = 0;
+
+	virtual void submit() = 0;
+
+	virtual const char* get_name() const = 0;
+
+	static std::unique_ptr<page_io_engine> create(unsigned queue_depth = 64);
+
+};
+
+/**
+ * Fallback engine: worker threads take requests from a queue and do a
+ * blocking pread/pwrite for each.
+ */
+class thread_pool_io_engine : public page_io_engine {
+
+public:
+
+	thread_pool_io_engine(unsigned thread_count = 4) {
+		this->stopping = false;
+		for (unsigned i = 0; i < thread_count; ++i) {
+			workers.emplace_back([this]() { work(); });
+		}
+	}
+
+	~thread_pool_io_engine() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		ready.notify_all();
+		for (auto& worker : workers) {
+			worker.join();
+		}
+	}
+
+	void submit_read(int fd, char* buffer, size_t size, off_t offset, completion done) {
+		queue_request({fd, buffer, size, offset, false, std::move(done)});
+	}
+
+	void submit_write(int fd, const char* buffer, size_t size, off_t offset, completion done) {
+		queue_request({fd, (char*)buffer, size, offset, true, std::move(done)});
+	}
+
+	void submit() {
+		// Requests are picked up as soon as they are queued.
+	}
+
+	const char* get_name() const {
+		return "thread pool";
+	}
+
+private:
+
+	struct request {
+		int fd;
+		char* buffer;
+		size_t size;
+		off_t offset;
+		bool write;
+		completion done;
+	};
+
+	void queue_request(request&& next) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			requests.push_back(std::move(next));
+		}
+		ready.notify_one();
+	}
+
+	void work() {
+		while (true) {
+			request next;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				ready.wait(lock, [this]() { return stopping || !requests.empty(); });
+				if (requests.empty()) {
+					return;
+				}
+				next = std::move(requests.front());
+				requests.pop_front();
+			}
+			next.done(transfer(next));
+		}
+	}
+
+	static ssize_t transfer(const request& next) {
+		size_t done = 0;
+		while (done < next.size) {
+			ssize_t count = next.write
+				? ::pwrite(next.fd, next.buffer + done, next.size - done, next.offset + done)
+				: ::pread(next.fd, next.buffer + done, next.size - done, next.offset + done);
+			if (count < 0 && errno == EINTR) {
+				continue;
+			}
+			if (count < 0) {
+				return -errno;
+			}
+			if (count == 0) {
+				break;
+			}
+			done += count;
+		}
+		return done;
+	}
+
+private:
+
+	std::mutex mutex;
+
+	std::condition_variable ready;
+
+	std::deque<request> requests;
+
+	std::vector<std::thread> workers;
+
+	bool stopping;
+
+};
+
+/**
+ * io_uring engine, driven by raw system calls so there is no dependency
+ * on liburing. Requests are written to the submission ring by the
+ * submitting threads; a reaper thread waits for completions and calls
+ * them. At most queue_depth requests are in flight, further submitters
+ * block until a slot is free.
+ */
+class uring_io_engine : public page_io_engine {
+
+public:
+
+	/**
+	 * Throws std::runtime_error if io_uring is not available, or the
+	 * kernel sets up a ring but does not know IORING_OP_READ and
+	 * IORING_OP_WRITE, which would fail every request with EINVAL.
+	 */
+	uring_io_engine(unsigned queue_depth) {
+		io_uring_params params;
+		std::memset(&params, 0, sizeof(params));
+		ring_fd = (int)::syscall(__NR_io_uring_setup, queue_depth, &params);
+		if (ring_fd < 0) {
+			throw std::runtime_error(std::string("uring_io_engine: io_uring_setup: ") + std::strerror(errno));
+		}
+		this->sq_ring = nullptr;
+		this->cq_ring = nullptr;
+		this->sqes = nullptr;
+		this->capacity = params.sq_entries;
+		this->in_flight = 0;
+		this->queued = 0;
+		// A failed engine is replaced by the thread pool, so nothing may leak.
+		try {
+			check_opcodes();
+			map_rings(params);
+			reaper = std::thread([this]() { reap(); });
+		} catch (...) {
+			unmap_rings();
+			::close(ring_fd);
+			throw;
+		}
+	}
+
+	~uring_io_engine() {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			// A NOP without a request tells the reaper to stop, after
+			// all other requests have completed.
+			space.wait(lock, [this]() { return in_flight < capacity; });
+			io_uring_sqe* sqe = next_sqe();
+			sqe->opcode = IORING_OP_NOP;
+			sqe->user_data = 0;
+			publish_sqe();
+			submit_locked();
+		}
+		reaper.join();
+		unmap_rings();
+		::close(ring_fd);
+	}
+
+	void submit_read(int fd, char* buffer, size_t size, off_t offset, completion done) {
+		queue_request(IORING_OP_READ, fd, buffer, size, offset, std::move(done));
+	}
+
+	void submit_write(int fd, const char* buffer, size_t size, off_t offset, completion done) {
+		queue_request(IORING_OP_WRITE, fd, (char*)buffer, size, offset, std::move(done));
+	}
+
+	void submit() {
+		std::lock_guard<std::mutex> lock(mutex);
+		submit_locked();
+	}
+
+	const char* get_name() const {
+		return "io_uring";
+	}
+
+private:
+
+	struct request {
+		completion done;
+	};
+
+	/**
+	 * The probe itself came with the opcodes (5.6), so a kernel which
+	 * rejects it does not have them either.
+	 */
+	void check_opcodes() {
+		const unsigned op_count = 256;
+		std::vector<char> buffer(sizeof(io_uring_probe) + op_count * sizeof(io_uring_probe_op), 0);
+		io_uring_probe* probe = (io_uring_probe*)buffer.data();
+		if (::syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, op_count) < 0) {
+			throw std::runtime_error(std::string("uring_io_engine: probe: ") + std::strerror(errno));
+		}
+		for (unsigned opcode : {(unsigned)IORING_OP_READ, (unsigned)IORING_OP_WRITE}) {
+			if (opcode > probe->last_op || !(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED)) {
+				throw std::runtime_error("uring_io_engine: the kernel does not support reads and writes");
+			}
+		}
+	}
+
+	void map_rings(const io_uring_params& params) {
+		sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+		if (single_mmap) {
+			sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+		}
+		sq_ring = map_ring(sq_ring_size, IORING_OFF_SQ_RING);
+		cq_ring = single_mmap ? sq_ring : map_ring(cq_ring_size, IORING_OFF_CQ_RING);
+		sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+		sqes = (io_uring_sqe*)map_ring(sqes_size, IORING_OFF_SQES);
+
+		sq_tail = (unsigned*)(sq_ring + params.sq_off.tail);
+		sq_mask = *(unsigned*)(sq_ring + params.sq_off.ring_mask);
+		sq_array = (unsigned*)(sq_ring + params.sq_off.array);
+		cq_head = (unsigned*)(cq_ring + params.cq_off.head);
+		cq_tail = (unsigned*)(cq_ring + params.cq_off.tail);
+		cq_mask = *(unsigned*)(cq_ring + params.cq_off.ring_mask);
+		cqes = (io_uring_cqe*)(cq_ring + params.cq_off.cqes);
+	}
+
+	/**
+	 * Unmaps the rings mapped so far.
+	 */
+	void unmap_rings() {
+		if (cq_ring != nullptr && cq_ring != sq_ring) {
+			::munmap(cq_ring, cq_ring_size);
+		}
+		if (sq_ring != nullptr) {
+			::munmap(sq_ring, sq_ring_size);
+		}
+		if (sqes != nullptr) {
+			::munmap(sqes, sqes_size);
+		}
+	}
+
+	char* map_ring(size_t size, off_t offset) {
+		void* address = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+		if (address == MAP_FAILED) {
+			throw std::runtime_error(std::string("uring_io_engine: mmap: ") + std::strerror(errno));
+		}
+		return (char*)address;
+	}
+
+	void queue_request(unsigned char opcode, int fd, char* buffer, size_t size, off_t offset, completion done) {
+		std::unique_lock<std::mutex> lock(mutex);
+		if (in_flight == capacity) {
+			submit_locked();
+			space.wait(lock, [this]() { return in_flight < capacity; });
+		}
+		io_uring_sqe* sqe = next_sqe();
+		sqe->opcode = opcode;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)buffer;
+		sqe->len = (unsigned)size;
+		sqe->off = (uint64_t)offset;
+		sqe->user_data = (uint64_t)new request{std::move(done)};
+		publish_sqe();
+	}
+
+	/**
+	 * Next free submission entry, cleared; called under the mutex.
+	 */
+	io_uring_sqe* next_sqe() {
+		unsigned index = *sq_tail & sq_mask;
+		io_uring_sqe* sqe = &sqes[index];
+		std::memset(sqe, 0, sizeof(*sqe));
+		sq_array[index] = index;
+		return sqe;
+	}
+
+	/**
+	 * Make the entry filled in after next_sqe visible to the kernel; it
+	 * is picked up by the next submit.
+	 */
+	void publish_sqe() {
+		__atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+		++queued;
+		++in_flight;
+	}
+
+	void submit_locked() {
+		while (queued > 0) {
+			int count = (int)::syscall(__NR_io_uring_enter, ring_fd, queued, 0, 0, nullptr, 0);
+			if (count < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+				continue;
+			}
+			if (count < 0) {
+				throw std::runtime_error(std::string("uring_io_engine: io_uring_enter: ") + std::strerror(errno));
+			}
+			queued -= count;
+		}
+	}
+
+	/**
+	 * Completions of reads and writes may arrive in any order, so the
+	 * reaper stops only when it has seen the stop NOP and nothing else
+	 * is in flight.
+	 */
+	void reap() {
+		bool stopping = false;
+		while (true) {
+			unsigned head = *cq_head;
+			unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+			if (head == tail) {
+				::syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+				continue;
+			}
+			unsigned completed = tail - head;
+			for (; head != tail; ++head) {
+				io_uring_cqe* cqe = &cqes[head & cq_mask];
+				if (cqe->user_data == 0) {
+					stopping = true;
+					continue;
+				}
+				std::unique_ptr<request> done((request*)cqe->user_data);
+				done->done(cqe->res);
+			}
+			__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+			bool idle;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				in_flight -= completed;
+				idle = in_flight == 0;
+			}
+			space.notify_all();
+			if (stopping && idle) {
+				return;
+			}
+		}
+	}
+
+private:
+
+	int ring_fd;
+
+	char* sq_ring;
+
+	char* cq_ring;
+
+	size_t sq_ring_size;
+
+	size_t cq_ring_size;
+
+	io_uring_sqe* sqes;
+
+	size_t sqes_size;
+
+	unsigned* sq_tail;
+
+	unsigned sq_mask;
+
+	unsigned* sq_array;
+
+	unsigned* cq_head;
+
+	unsigned* cq_tail;
+
+	unsigned cq_mask;
+
+	io_uring_cqe* cqes;
+
+	std::mutex mutex;
+
+	std::condition_variable space;
+
+	unsigned capacity;
+
+	unsigned in_flight;
+
+	unsigned queued;
+
+	std::thread reaper;
+
+};
+
+inline std::unique_ptr<page_io_engine> page_io_engine::create(unsigned queue_depth) {
+	try {
+		return std::unique_ptr<page_io_engine>(new uring_io_engine(queue_depth));
+	} catch (const std::runtime_error&) {
+		return std::unique_ptr<page_io_engine>(new thread_pool_io_engine());
+	}
+}
@@ -0,0 +1,399 @@
+#pragma once
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#include "storage_model.h"
+
+/**
+ * Memory model in a POSIX shared memory object, so that several
+ * processes use the same pages without copying them.
+ *
+ * One process builds the pages through the writer constructor, which
+ * creates the object (or attaches to it if it exists); any number of
+ * processes attach with the reader constructor and get a read-only
+ * mapping of the same memory. load_page returns a pointer straight into
+ * the mapping in every process. A reader must not change its pages (the
+ * mapping is read-only) and cannot create or free pages.
+ *
+ * The object is sized for max_pages pages up front, so the mapping never
+ * moves in any process; the memory is only committed when a page is
+ * first written. The header at the start of the object holds the page
+ * size, the capacity and the atomic number of created pages, which a
+ * reader checks its addresses against, and a process-shared mutex for
+ * the free list. Freed pages form a list threaded through the pages, as
+ * in mmap_storage. A bit per page after the header, also changed under
+ * the mutex, marks the free pages, so freeing a free page throws instead
+ * of making a cycle in the list every process shares.
+ *
+ * Pages created by the writer are visible to the readers as soon as
+ * create_page returns; publishing the content consistently (e.g. a
+ * table's header page last) is up to the writer. The object outlives
+ * the processes until remove is called.
+ *
+ * The header also holds a few root words for the writer to publish
+ * where its tables start. A Btree is opened in a reader from its root
+ * id and size (Btree(model, root_id, size)) and answers find without
+ * writing to a page. An LkTable writes its directory and hash functions
+ * to meta pages with SaveMeta, whose first page id the writer publishes;
+ * a reader opens it with LkTable(model, meta_page_id, OpenTable()). A
+ * FaginTable keeps its directory in process memory only, so a reader
+ * process cannot open one over the segment.
+ */
+class shm_storage final : public storage_model {
+
+public:
+
+	/**
+	 * Writer: creates the object, or attaches to an existing one with the
+	 * same page size and capacity.
+	 */
+	shm_storage(const std::string& name, size_t page_size, size_t max_pages) {
+		this->name = name;
+		this->writer = true;
+		this->header_size = (size_t)::sysconf(_SC_PAGESIZE);
+		this->fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT, 0644);
+		if (fd < 0) {
+			throw_io_error("shm_open " + name);
+		}
+		struct stat info;
+		if (::fstat(fd, &info) != 0) {
+			close_and_throw("stat " + name);
+		}
+		bool existing = info.st_size != 0;
+		if (!existing) {
+			header_size = layout_size(max_pages);
+		}
+		mapped_size = existing ? info.st_size : header_size + max_pages * page_size;
+		if (!existing && ::ftruncate(fd, mapped_size) != 0) {
+			close_and_throw("truncate " + name);
+		}
+		map_object(PROT_READ | PROT_WRITE);
+		if (existing) {
+			check_header();
+			if (header()->page_size != page_size || header()->max_pages != max_pages) {
+				unmap_and_throw(name + " has page size " + std::to_string(header()->page_size) +
+					" and capacity " + std::to_string(header()->max_pages));
+			}
+		} else {
+			init_header(page_size, max_pages);
+		}
+		this->page_size = page_size;
+	}
+
+	/**
+	 * Reader: attaches read-only to an object created by a writer.
+	 */
+	explicit shm_storage(const std::string& name) {
+		this->name = name;
+		this->writer = false;
+		this->header_size = (size_t)::sysconf(_SC_PAGESIZE);
+		this->fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+		if (fd < 0) {
+			throw_io_error("shm_open " + name);
+		}
+		struct stat info;
+		if (::fstat(fd, &info) != 0) {
+			close_and_throw("stat " + name);
+		}
+		if ((size_t)info.st_size < header_size) {
+			::close(fd);
+			throw std::runtime_error("shm_storage: " + name + " is not initialized");
+		}
+		mapped_size = info.st_size;
+		map_object(PROT_READ);
+		check_header();
+		this->page_size = header()->page_size;
+	}
+
+	~shm_storage() {
+		::munmap(mapping, mapped_size);
+		::close(fd);
+	}
+
+	size_t get_page_size() const {
+		return page_size;
+	}
+
+	size_t create_page() {
+		check_writer("create_page");
+		if (header()->free_head.load(std::memory_order_acquire) != 0) {
+			free_list_lock lock(header());
+			uint64_t head = header()->free_head.load(std::memory_order_relaxed);
+			if (head != 0) {
+				uint64_t next;
+				std::memcpy(&next, page_at(head - 1), sizeof(next));
+				header()->free_head.store(next, std::memory_order_release);
+				set_free(head - 1, false);
+				std::memset(page_at(head - 1), 0, page_size);
+				return head - 1;
+			}
+		}
+		uint64_t address = header()->page_count.load(std::memory_order_relaxed);
+		do {
+			if (address >= header()->max_pages) {
+				throw std::bad_alloc();
+			}
+		} while (!header()->page_count.compare_exchange_weak(address, address + 1,
+				std::memory_order_acq_rel, std::memory_order_relaxed));
+		return address;
+	}
+
+	char* load_page(size_t address) {
+		if (address >= header()->page_count.load(std::memory_order_acquire)) {
+			throw std::out_of_range("shm_storage: no page " + std::to_string(address));
+		}
+		return page_at(address);
+	}
+
+	void save_page(size_t address, char* page) {
+		// No operation here, the page is the shared memory.
+	}
+
+	void update_page(size_t address, char* page) {
+		// No operation here, the page is the shared memory.
+	}
+
+	void release_page(size_t address) {
+		// No operation here.
+	}
+
+	void free_page(size_t address) {
+		check_writer("free_page");
+		if (page_size < sizeof(uint64_t)) {
+			throw std::runtime_error("shm_storage: pages are too small to be freed");
+		}
+		char* page = load_page(address);
+		free_list_lock lock(header());
+		if (is_free(address)) {
+			throw std::runtime_error("shm_storage: page " + std::to_string(address) + " is already free");
+		}
+		uint64_t head = header()->free_head.load(std::memory_order_relaxed);
+		std::memcpy(page, &head, sizeof(head));
+		header()->free_head.store(address + 1, std::memory_order_release);
+		set_free(address, true);
+	}
+
+	void prefetch_pages(const size_t* addresses, size_t count) {
+		size_t limit = header()->page_count.load(std::memory_order_acquire);
+		for (size_t index = 0; index < count; ++index) {
+			if (addresses[index] < limit) {
+				__builtin_prefetch(page_at(addresses[index]));
+			}
+		}
+	}
+
+public:
+
+	/**
+	 * Remove the shared memory object; processes which have it mapped
+	 * keep using it until they unmap it.
+	 */
+	static void remove(const std::string& name) {
+		if (::shm_unlink(name.c_str()) != 0 && errno != ENOENT) {
+			throw_io_error("shm_unlink " + name);
+		}
+	}
+
+	bool is_writer() const {
+		return writer;
+	}
+
+	/**
+	 * Number of created pages, freed pages included.
+	 */
+	size_t get_page_count() const {
+		return header()->page_count.load(std::memory_order_acquire);
+	}
+
+	size_t get_max_pages() const {
+		return header()->max_pages;
+	}
+
+	/**
+	 * Publish a word, e.g. the root page of a table, to the readers.
+	 * A reader which sees the word also sees the pages written before.
+	 */
+	void set_root_word(size_t slot, uint64_t value) {
+		check_writer("set_root_word");
+		header()->root_words[check_slot(slot)].store(value, std::memory_order_release);
+	}
+
+	uint64_t get_root_word(size_t slot) const {
+		return header()->root_words[check_slot(slot)].load(std::memory_order_acquire);
+	}
+
+private:
+
+	static const size_t root_word_count = 8;
+
+	/**
+	 * The atomics are lock-free, so they work between processes.
+	 */
+	struct shm_header {
+		char magic[8];
+		uint64_t page_size;
+		uint64_t max_pages;
+		std::atomic<uint64_t> page_count;
+		// Address of the first free page plus one, 0 if there is none.
+		std::atomic<uint64_t> free_head;
+		pthread_mutex_t free_mutex;
+		std::atomic<uint64_t> root_words[root_word_count];
+	};
+
+	static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "shm_storage: atomics must be plain words");
+
+	class free_list_lock {
+	public:
+		free_list_lock(shm_header* header) : header(header) {
+			::pthread_mutex_lock(&header->free_mutex);
+		}
+		~free_list_lock() {
+			::pthread_mutex_unlock(&header->free_mutex);
+		}
+	private:
+		shm_header* header;
+	};
+
+	static const char* magic() {
+		return "DOPSHM2";
+	}
+
+	/**
+	 * The header and the free bits, rounded up to whole OS pages so the
+	 * data pages stay aligned.
+	 */
+	static size_t layout_size(size_t max_pages) {
+		size_t os_page = (size_t)::sysconf(_SC_PAGESIZE);
+		size_t size = free_bits_offset() + (max_pages + 63) / 64 * sizeof(uint64_t);
+		return (size + os_page - 1) / os_page * os_page;
+	}
+
+	static size_t free_bits_offset() {
+		return (sizeof(shm_header) + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+	}
+
+	uint64_t* free_bits() const {
+		return (uint64_t*)(mapping + free_bits_offset());
+	}
+
+	bool is_free(size_t address) const {
+		return (free_bits()[address / 64] >> (address % 64)) & 1;
+	}
+
+	void set_free(size_t address, bool free) {
+		uint64_t bit = (uint64_t)1 << (address % 64);
+		if (free) {
+			free_bits()[address / 64] |= bit;
+		} else {
+			free_bits()[address / 64] &= ~bit;
+		}
+	}
+
+	shm_header* header() const {
+		return (shm_header*)mapping;
+	}
+
+	char* page_at(size_t address) const {
+		return mapping + header_size + address * page_size;
+	}
+
+	void map_object(int protection) {
+		void* address = ::mmap(nullptr, mapped_size, protection, MAP_SHARED, fd, 0);
+		if (address == MAP_FAILED) {
+			close_and_throw("mmap " + name);
+		}
+		mapping = (char*)address;
+	}
+
+	/**
+	 * The magic is written last, so a reader never sees a header which
+	 * is only partly written.
+	 */
+	void init_header(size_t page_size, size_t max_pages) {
+		shm_header* created = new (mapping) shm_header;
+		created->page_size = page_size;
+		created->max_pages = max_pages;
+		created->page_count.store(0, std::memory_order_relaxed);
+		created->free_head.store(0, std::memory_order_relaxed);
+		for (size_t slot = 0; slot < root_word_count; ++slot) {
+			created->root_words[slot].store(0, std::memory_order_relaxed);
+		}
+		pthread_mutexattr_t attributes;
+		::pthread_mutexattr_init(&attributes);
+		::pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+		::pthread_mutex_init(&created->free_mutex, &attributes);
+		::pthread_mutexattr_destroy(&attributes);
+		std::atomic_thread_fence(std::memory_order_release);
+		std::memcpy(created->magic, magic(), sizeof(created->magic));
+	}
+
+	void check_header() {
+		if (std::memcmp(header()->magic, magic(), sizeof(header()->magic)) != 0) {
+			unmap_and_throw(name + " is not a page segment");
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+		header_size = layout_size(header()->max_pages);
+		if (mapped_size < header_size + header()->max_pages * header()->page_size) {
+			unmap_and_throw(name + " is truncated");
+		}
+	}
+
+	static size_t check_slot(size_t slot) {
+		if (slot >= root_word_count) {
+			throw std::out_of_range("shm_storage: no root word " + std::to_string(slot));
+		}
+		return slot;
+	}
+
+	void check_writer(const std::string& what) const {
+		if (!writer) {
+			throw std::runtime_error("shm_storage: " + what + " on a reader of " + name);
+		}
+	}
+
+	void close_and_throw(const std::string& what) {
+		int error = errno;
+		::close(fd);
+		errno = error;
+		throw_io_error(what);
+	}
+
+	void unmap_and_throw(const std::string& what) {
+		::munmap(mapping, mapped_size);
+		::close(fd);
+		throw std::runtime_error("shm_storage: " + what);
+	}
+
+	static void throw_io_error(const std::string& what) {
+		throw std::runtime_error("shm_storage: " + what + ": " + std::strerror(errno));
+	}
+
+private:
+
+	std::string name;
+
+	bool writer;
+
+	size_t page_size;
+
+	size_t header_size;
+
+	size_t mapped_size;
+
+	int fd;
+
+	char* mapping;
+
+};
@@ -0,0 +1,265 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include "storage_model.h"
+
+/**
+ * Costs of a simulated device. An access which does not continue where
+ * the previous one ended costs seek_time; every page transferred costs
+ * its size divided by transfer_rate.
+ */
+struct disk_model {
+
+	std::chrono::nanoseconds seek_time;
+
+	uint64_t transfer_rate;
+
+	/**
+	 * Rotating disk: 4 ms seek plus 4 ms rotational delay, 150 MB/s.
+	 */
+	static disk_model hdd() {
+		return {std::chrono::nanoseconds(8000000), 150000000};
+	}
+
+	/**
+	 * SATA flash disk: 80 us per random access, 500 MB/s.
+	 */
+	static disk_model ssd() {
+		return {std::chrono::nanoseconds(80000), 500000000};
+	}
+
+	std::chrono::nanoseconds transfer_time(size_t bytes) const {
+		return std::chrono::nanoseconds(bytes * 1000000000ull / transfer_rate);
+	}
+
+};
+
+/**
+ * Memory model which keeps the pages in memory but accounts for the
+ * time a disk with a page cache in front of it would take.
+ *
+ * The cache holds cache_pages pages and evicts the least recently used.
+ * A load of a page which is not cached reads it from the simulated disk,
+ * evicting a page; a dirty victim is written back first. Created pages
+ * start in the cache, dirty, and save_page and update_page mark a page
+ * dirty. flush writes all dirty pages back, in the order of addresses.
+ * prefetch_pages reads the missing pages in the order of addresses, so
+ * runs of neighbours cost one seek.
+ *
+ * Nothing is really waited for: get_elapsed reports the simulated time
+ * of all accesses so far, so tables can be compared under the costs of
+ * a hard disk or a flash disk without one.
+ */
+class simulated_disk_storage final : public storage_model {
+
+public:
+
+	simulated_disk_storage(size_t page_size, size_t cache_pages, disk_model disk) : pages(page_size) {
+		this->page_size = page_size;
+		this->cache_pages = std::max(cache_pages, (size_t)1);
+		this->disk = disk;
+		this->head = no_address;
+		reset_stats();
+	}
+
+	size_t get_page_size() const {
+		return page_size;
+	}
+
+	size_t create_page() {
+		size_t address = pages.create_page();
+		cache_page(address);
+		cache_index[address]->dirty = true;
+		return address;
+	}
+
+	char* load_page(size_t address) {
+		char* page = pages.load_page(address);
+		if (cache_index.count(address) == 0) {
+			read(address);
+		} else {
+			++hit_count;
+		}
+		cache_page(address);
+		return page;
+	}
+
+	void save_page(size_t address, char* page) {
+		mark_dirty(address);
+	}
+
+	void update_page(size_t address, char* page) {
+		mark_dirty(address);
+	}
+
+	void release_page(size_t address) {
+		// No operation here, eviction does not depend on pins.
+	}
+
+	void free_page(size_t address) {
+		pages.free_page(address);
+		auto iter = cache_index.find(address);
+		if (iter != cache_index.end()) {
+			cache.erase(iter->second);
+			cache_index.erase(iter);
+		}
+	}
+
+	void prefetch_pages(const size_t* addresses, size_t count) {
+		std::vector<size_t> missing;
+		for (size_t index = 0; index < count; ++index) {
+			if (addresses[index] < pages.get_page_count() && cache_index.count(addresses[index]) == 0) {
+				missing.push_back(addresses[index]);
+			}
+		}
+		std::sort(missing.begin(), missing.end());
+		missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+		for (size_t address : missing) {
+			read(address);
+			cache_page(address);
+		}
+	}
+
+public:
+
+	/**
+	 * Write all dirty cached pages back to the simulated disk.
+	 */
+	void flush() {
+		std::vector<size_t> dirty;
+		for (const cached_page& cached : cache) {
+			if (cached.dirty) {
+				dirty.push_back(cached.address);
+			}
+		}
+		std::sort(dirty.begin(), dirty.end());
+		for (size_t address : dirty) {
+			write(address);
+			cache_index[address]->dirty = false;
+		}
+	}
+
+	std::chrono::nanoseconds get_elapsed() const {
+		return elapsed;
+	}
+
+	size_t get_read_count() const {
+		return read_count;
+	}
+
+	size_t get_write_count() const {
+		return write_count;
+	}
+
+	size_t get_seek_count() const {
+		return seek_count;
+	}
+
+	size_t get_hit_count() const {
+		return hit_count;
+	}
+
+	/**
+	 * Zero the time and the counters; the cache keeps its content.
+	 */
+	void reset_stats() {
+		elapsed = std::chrono::nanoseconds(0);
+		read_count = 0;
+		write_count = 0;
+		seek_count = 0;
+		hit_count = 0;
+	}
+
+private:
+
+	static const size_t no_address = SIZE_MAX;
+
+	struct cached_page {
+		size_t address;
+		bool dirty;
+	};
+
+	/**
+	 * Moves the page to the front of the LRU list, inserting it and
+	 * evicting the last page if it is not cached yet.
+	 */
+	void cache_page(size_t address) {
+		auto iter = cache_index.find(address);
+		if (iter != cache_index.end()) {
+			cache.splice(cache.begin(), cache, iter->second);
+			return;
+		}
+		if (cache.size() == cache_pages) {
+			cached_page& victim = cache.back();
+			if (victim.dirty) {
+				write(victim.address);
+			}
+			cache_index.erase(victim.address);
+			cache.pop_back();
+		}
+		cache.push_front({address, false});
+		cache_index[address] = cache.begin();
+	}
+
+	void mark_dirty(size_t address) {
+		auto iter = cache_index.find(address);
+		if (iter != cache_index.end()) {
+			iter->second->dirty = true;
+		} else {
+			// Evicted while the caller kept the pointer; written right away.
+			write(address);
+		}
+	}
+
+	void read(size_t address) {
+		access(address);
+		++read_count;
+	}
+
+	void write(size_t address) {
+		access(address);
+		++write_count;
+	}
+
+	void access(size_t address) {
+		if (head == no_address || address != head + 1) {
+			elapsed += disk.seek_time;
+			++seek_count;
+		}
+		elapsed += disk.transfer_time(page_size);
+		head = address;
+	}
+
+private:
+
+	size_t page_size;
+
+	size_t cache_pages;
+
+	disk_model disk;
+
+	unsafe_inmemory_storage pages;
+
+	std::list<cached_page> cache;
+
+	std::unordered_map<size_t, std::list<cached_page>::iterator> cache_index;
+
+	size_t head;
+
+	std::chrono::nanoseconds elapsed;
+
+	size_t read_count;
+
+	size_t write_count;
+
+	size_t seek_count;
+
+	size_t hit_count;
+
+};
@@ -0,0 +1,294 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "storage_model.h"
+
+/**
+ * Copy-on-write snapshots over any storage model.
+ *
+ * take_snapshot freezes the content of all pages as it is at that
+ * moment; load_snapshot_page reads a page as it was then, while writers
+ * keep changing the pages through the usual interface. A scan which
+ * reads only through its snapshot never sees a half-done multi-page
+ * change (a split, an overflow cascade) and never blocks a writer.
+ *
+ * Callers change a page in place between load_page and update_page, so
+ * the copy is made when the page is loaded, not when it is updated: the
+ * first load_page (or load_pages, or free_page) of a page after a
+ * snapshot preserves the page before it is handed out. The first read
+ * of a page through a snapshot preserves it as well, so a snapshot only
+ * ever reads preserved copies, which nobody changes. Each page is copied
+ * at most once per snapshot, and only if it is used.
+ *
+ * A copy made at a time when the latest snapshot was S serves all
+ * snapshots taken after the previous copy of the page, up to S. A copy
+ * is dropped when release_snapshot releases the last snapshot it serves.
+ *
+ * Snapshots have to be taken when no writer is in the middle of an
+ * operation, i.e. while no page is pinned for writing. Pages created
+ * after a snapshot are read through it as they are when first read.
+ */
+class snapshot_storage : public storage_decorator {
+
+public:
+
+	using snapshot_id = uint64_t;
+
+	snapshot_storage(storage_model* inner) : storage_decorator(inner) {
+		this->page_size = inner->get_page_size();
+		this->last_snapshot = 0;
+		this->preserved_count = 0;
+	}
+
+	char* load_page(size_t address) {
+		preserve(address);
+		return inner->load_page(address);
+	}
+
+	void load_pages(const size_t* addresses, size_t count, char** pages) {
+		for (size_t index = 0; index < count; ++index) {
+			preserve(addresses[index]);
+		}
+		inner->load_pages(addresses, count, pages);
+	}
+
+	void load_page_async(size_t address, page_callback callback) {
+		preserve(address);
+		inner->load_page_async(address, std::move(callback));
+	}
+
+	void load_pages_async(const size_t* addresses, size_t count, page_callback callback) {
+		for (size_t index = 0; index < count; ++index) {
+			preserve(addresses[index]);
+		}
+		inner->load_pages_async(addresses, count, std::move(callback));
+	}
+
+	void free_page(size_t address) {
+		preserve(address);
+		inner->free_page(address);
+	}
+
+	/**
+	 * Moving pages under live snapshots would change what they read.
+	 */
+	size_t compact(relocate_callback relocate) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!live.empty()) {
+				return 0;
+			}
+		}
+		return inner->compact(std::move(relocate));
+	}
+
+public:
+
+	snapshot_id take_snapshot() {
+		std::lock_guard<std::mutex> lock(mutex);
+		live.insert(++last_snapshot);
+		return last_snapshot;
+	}
+
+	/**
+	 * Pointers returned by load_snapshot_page for the snapshot become
+	 * invalid.
+	 */
+	void release_snapshot(snapshot_id snapshot) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (live.erase(snapshot) == 0) {
+			throw std::out_of_range("snapshot_storage: no snapshot " + std::to_string(snapshot));
+		}
+		for (auto iter = versions.begin(); iter != versions.end(); ) {
+			std::vector<page_version>& list = iter->second;
+			snapshot_id previous = 0;
+			size_t kept = 0;
+			for (size_t index = 0; index < list.size(); ++index) {
+				snapshot_id served = list[index].snapshot;
+				if (serves_live(previous, served)) {
+					list[kept++] = std::move(list[index]);
+				} else {
+					--preserved_count;
+				}
+				previous = served;
+			}
+			list.resize(kept);
+			iter = list.empty() ? versions.erase(iter) : std::next(iter);
+		}
+	}
+
+	/**
+	 * The page as it was when the snapshot was taken. The page is not
+	 * pinned and must not be changed; the pointer stays valid until the
+	 * snapshot is released.
+	 */
+	const char* load_snapshot_page(snapshot_id snapshot, size_t address) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (live.count(snapshot) == 0) {
+			throw std::out_of_range("snapshot_storage: no snapshot " + std::to_string(snapshot));
+		}
+		const char* image = find_version(snapshot, address);
+		if (image == nullptr) {
+			// Unchanged since the snapshot: preserve it now.
+			preserve_locked(address);
+			image = find_version(snapshot, address);
+		}
+		return image;
+	}
+
+	size_t get_snapshot_count() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return live.size();
+	}
+
+	/**
+	 * Number of page copies held for live snapshots.
+	 */
+	size_t get_preserved_page_count() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return preserved_count;
+	}
+
+private:
+
+	/**
+	 * Copy of a page, as read by the snapshots taken after the previous
+	 * copy of the page, up to and including the given one.
+	 */
+	struct page_version {
+		snapshot_id snapshot;
+		std::unique_ptr<char[]> image;
+	};
+
+	bool serves_live(snapshot_id previous, snapshot_id last) const {
+		auto iter = live.upper_bound(previous);
+		return iter != live.end() && *iter <= last;
+	}
+
+	const char* find_version(snapshot_id snapshot, size_t address) const {
+		auto iter = versions.find(address);
+		if (iter == versions.end()) {
+			return nullptr;
+		}
+		for (const page_version& version : iter->second) {
+			if (version.snapshot >= snapshot) {
+				return version.image.get();
+			}
+		}
+		return nullptr;
+	}
+
+	void preserve(size_t address) {
+		std::lock_guard<std::mutex> lock(mutex);
+		preserve_locked(address);
+	}
+
+	/**
+	 * Copies the page unless there is no snapshot or it has been copied
+	 * since the latest one was taken.
+	 */
+	void preserve_locked(size_t address) {
+		if (live.empty()) {
+			return;
+		}
+		snapshot_id latest = *live.rbegin();
+		std::vector<page_version>& list = versions[address];
+		if (!list.empty() && list.back().snapshot >= latest) {
+			return;
+		}
+		std::unique_ptr<char[]> image(new char[page_size]);
+		try {
+			std::memcpy(image.get(), inner->load_page(address), page_size);
+			inner->release_page(address);
+		} catch (...) {
+			if (list.empty()) {
+				versions.erase(address);
+			}
+			throw;
+		}
+		list.push_back({latest, std::move(image)});
+		++preserved_count;
+	}
+
+private:
+
+	size_t page_size;
+
+	mutable std::mutex mutex;
+
+	std::set<snapshot_id> live;
+
+	snapshot_id last_snapshot;
+
+	std::unordered_map<size_t, std::vector<page_version>> versions;
+
+	size_t preserved_count;
+
+};
+
+/**
+ * Read-only storage model over one snapshot of a snapshot_storage, so
+ * that a table can be opened on the snapshot, e.g. a Btree with
+ * Btree(view, root_id, size) from the root id and size it had when the
+ * snapshot was taken. load_page is load_snapshot_page: pages are not
+ * pinned, release_page does nothing, and the pages must not be changed.
+ * Creating, saving, updating and freeing pages throw, compact moves
+ * nothing. The view is valid until the snapshot is released.
+ */
+class snapshot_view : public storage_model {
+
+public:
+
+	snapshot_view(snapshot_storage* storage, snapshot_storage::snapshot_id snapshot) {
+		this->storage = storage;
+		this->snapshot = snapshot;
+	}
+
+	size_t get_page_size() const {
+		return storage->get_page_size();
+	}
+
+	size_t create_page() {
+		throw std::runtime_error("snapshot_view: create_page on a read-only snapshot");
+	}
+
+	char* load_page(size_t address) {
+		return const_cast<char*>(storage->load_snapshot_page(snapshot, address));
+	}
+
+	void save_page(size_t address, char* page) {
+		throw std::runtime_error("snapshot_view: save_page on a read-only snapshot");
+	}
+
+	void update_page(size_t address, char* page) {
+		throw std::runtime_error("snapshot_view: update_page on a read-only snapshot");
+	}
+
+	void release_page(size_t address) {
+		// Snapshot pages are not pinned.
+	}
+
+	void free_page(size_t address) {
+		throw std::runtime_error("snapshot_view: free_page on a read-only snapshot");
+	}
+
+	snapshot_storage::snapshot_id get_snapshot() const {
+		return snapshot;
+	}
+
+private:
+
+	snapshot_storage* storage;
+
+	snapshot_storage::snapshot_id snapshot;
+
+};
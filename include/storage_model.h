@@ -1,160 +1,1097 @@
-#pragma once
-
-#include <map>
-#include <iostream>
-#include <fstream>
-#include <bitset>
-#include <limits.h>
-
-/**
- * API definition for page-based memory model.
- *
- * New page can be created using create_page function. This function 
- * return address of the created page.
- *
- * User can get access to the page data by using load_page function. 
- * Data at the returned pointer are managed by this class and user must
- * not delete them.
- *
- * Content of the page can be saved by calling save_page. User is 
- * responsible by providing correct combination of address and page
- * parameters. After call of this function the page pointer must no
- * longer be used as it may be deleted during call of this function.
- *
- * If you just need to update the page in the storage and keep 
- * it in the memory for further use, then you can employ update_page
- * function.
- * 
- * For both aforementioned functions (save_page and update_page),
- * the page must have been obtained by calling create_page function.
- * 
- * The release_page function can be used to release a page from
- * the primary memory without changing it in the secondary memory. This
- * function does NOT delete the page from the storage.
- *
- */
-class storage_model {
-
-public:
-
-	virtual size_t get_page_size() const = 0;
-
-	/**
-	 * @return Address of new page.
-	 */
-	virtual size_t create_page() = 0;
-
-	virtual char* load_page(size_t address) = 0;
-
-	virtual void save_page(size_t address, char* page) = 0;
-
-	virtual void update_page(size_t address, char* page) = 0;
-
-	virtual void release_page(size_t address) = 0;
-
-};
-
-/**
- * In-memory implementation of the memory model.
- */
-class unsafe_inmemory_storage : public storage_model {
-
-public:
-
-	unsafe_inmemory_storage(size_t page_size) {
-		this->page_size = page_size;
-	}
-
-	~unsafe_inmemory_storage() {
-		clear();
-	}
-
-	size_t get_page_size() const {
-		return page_size;
-	}
-
-	size_t create_page() {
-		size_t address = pages.size();
-		char* page = new char[page_size];
-		pages.insert(std::make_pair(address, page));
-		return address;
-	}
-
-	char* load_page(size_t address) {
-		return pages.at(address);
-	}
-
-	void save_page(size_t address, char* page) {
-		// No operation here.
-	}
-
-	void update_page(size_t address, char* page) {
-		// No operation here.
-	}
-
-	void release_page(size_t address) {
-		// No operation here.
-	}
-
-public:
-
-	void print_page(size_t address) {
-		char* page = load_page(address);
-		std::cout << "Page " << address << " :" << std::endl;
-		for (size_t i = 0; i < page_size; ++i) {
-			std::cout << std::bitset<CHAR_BIT>(page[i]) << " ";
-		}
-		std::cout << std::endl;
-	}
-
-	void save_to_file(const std::string& path) const {
-		std::fstream stream(path, std::ios::out | std::ios::binary);
-		stream << pages.size() << "\n";
-		for (auto iter = pages.begin(); iter != pages.end(); ++iter) {
-			write_page(stream, iter->first, iter->second);
-		}
-		stream.close();
-	}
-
-	void load_from_file(const std::string& path) {
-		clear();
-		std::fstream stream(path, std::ios::in | std::ios::binary);
-		size_t page_count;
-		stream >> page_count;
-		for (size_t index = 0; index < page_count; ++index) {
-			read_page(stream);
-		}
-		stream.close();
-	}
-
-	void clear() {
-		for (auto iter = pages.begin(); iter != pages.end(); ++iter) {
-			delete[] iter->second;
-		}
-		pages.clear();
-	}
-
-private:
-
-	void write_page(std::fstream& stream, size_t index, char* data) const {
-		stream << index << " ";
-		stream.write(data, page_size);
-		stream << "\n";
-	}
-
-	void read_page(std::fstream& stream) {
-		size_t address;
-		stream >> address;
-		stream.get();
-		char* page = new char[page_size];
-		stream.read(page, page_size);
-		pages.insert(std::make_pair(address, page));		
-	}
-
-private:
-
-	size_t page_size;
-
-	std::map<size_t, char*> pages;
-
-};
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <bitset>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include <limits.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * API definition for page-based memory model.
+ *
+ * New page can be created using create_page function. This function 
+ * return address of the created page.
+ *
+ * User can get access to the page data by using load_page function. 
+ * Data at the returned pointer are managed by this class and user must
+ * not delete them.
+ *
+ * Content of the page can be saved by calling save_page. User is 
+ * responsible by providing correct combination of address and page
+ * parameters. After call of this function the page pointer must no
+ * longer be used as it may be deleted during call of this function.
+ *
+ * If you just need to update the page in the storage and keep 
+ * it in the memory for further use, then you can employ update_page
+ * function.
+ * 
+ * For both aforementioned functions (save_page and update_page),
+ * the page must have been obtained by calling create_page function.
+ * 
+ * The release_page function can be used to release a page from
+ * the primary memory without changing it in the secondary memory. This
+ * function does NOT delete the page from the storage.
+ *
+ * Pages can also be loaded asynchronously with load_page_async (or its
+ * batched form load_pages_async): the page is pinned as with load_page
+ * and handed to a callback once it is in the primary memory. Storages
+ * without asynchronous I/O load the page right away.
+ *
+ * Walks over many pages should announce the pages they are going to
+ * need with prefetch_pages, so the storage can read them ahead, and
+ * load a group of pages at once with load_pages.
+ *
+ * A page which is no longer needed is given back with free_page; its
+ * address may be returned by a later create_page. compact moves live
+ * pages from the end of the storage into freed ones, so the storage
+ * can shrink, and reports every move to the owner of the pages, which
+ * has to rewrite its references to the moved page. Storages which can
+ * not reuse pages ignore free_page and move nothing.
+ *
+ * pin_page wraps load_page into a page_handle, which releases the page
+ * when it goes out of scope.
+ *
+ */
+class page_handle;
+
+class storage_model {
+
+public:
+
+	/**
+	 * Gets the address and the loaded page, or nullptr if the page could
+	 * not be read. May be called on a thread of the storage.
+	 */
+	using page_callback = std::function<void(size_t address, char* page)>;
+
+	/**
+	 * Gets the old and the new address of a page moved by compact. The
+	 * content is at the new address already, the old one is invalid.
+	 */
+	using relocate_callback = std::function<void(size_t from, size_t to)>;
+
+	virtual ~storage_model() {}
+
+	virtual size_t get_page_size() const = 0;
+
+	/**
+	 * @return Address of new page.
+	 */
+	virtual size_t create_page() = 0;
+
+	virtual char* load_page(size_t address) = 0;
+
+	virtual void save_page(size_t address, char* page) = 0;
+
+	virtual void update_page(size_t address, char* page) = 0;
+
+	virtual void release_page(size_t address) = 0;
+
+	/**
+	 * Gives the page back to the storage. The page must not be pinned
+	 * and must not be used afterwards.
+	 */
+	virtual void free_page(size_t address) {
+		// No operation here, the page is abandoned.
+	}
+
+	/**
+	 * Moves live pages into freed pages so the storage can shrink. No
+	 * page may be pinned and no page may be created or freed during the
+	 * call, except by relocate itself.
+	 * @return Number of moved pages.
+	 */
+	virtual size_t compact(relocate_callback relocate) {
+		return 0;
+	}
+
+	/**
+	 * Hint that the given pages will be loaded soon. The pages are not
+	 * pinned and nothing has to be released. Addresses of pages which do
+	 * not exist are ignored.
+	 */
+	virtual void prefetch_pages(const size_t* addresses, size_t count) {
+		// No operation here.
+	}
+
+	/**
+	 * Loads (and pins) all given pages: pages[index] is the page at
+	 * addresses[index].
+	 */
+	virtual void load_pages(const size_t* addresses, size_t count, char** pages) {
+		for (size_t index = 0; index < count; ++index) {
+			pages[index] = load_page(addresses[index]);
+		}
+	}
+
+	virtual void load_page_async(size_t address, page_callback callback) {
+		callback(address, load_page(address));
+	}
+
+	/**
+	 * Loads all given pages, the reads are submitted together.
+	 */
+	virtual void load_pages_async(const size_t* addresses, size_t count, page_callback callback) {
+		for (size_t index = 0; index < count; ++index) {
+			load_page_async(addresses[index], callback);
+		}
+	}
+
+	/**
+	 * Loads (and pins) the page; the pin is held by the returned handle.
+	 */
+	page_handle pin_page(size_t address);
+
+	std::future<char*> load_page_future(size_t address) {
+		auto promise = std::make_shared<std::promise<char*>>();
+		std::future<char*> future = promise->get_future();
+		try {
+			load_page_async(address, [promise](size_t address, char* page) {
+				if (page) {
+					promise->set_value(page);
+				} else {
+					promise->set_exception(std::make_exception_ptr(
+						std::runtime_error("storage_model: can not load page " + std::to_string(address))));
+				}
+			});
+		} catch (...) {
+			promise->set_exception(std::current_exception());
+		}
+		return future;
+	}
+
+};
+
+/**
+ * Whether Storage can back a table: it has to implement storage_model.
+ * Tables take the storage type as a template parameter (storage_model
+ * by default, where every page access is a virtual call). With one of
+ * the concrete storages, which are final, the compiler calls and may
+ * inline its functions directly, e.g. load_page of
+ * unsafe_inmemory_storage becomes a shift and an index.
+ */
+template<typename Storage>
+struct is_storage_model : std::is_base_of<storage_model, Storage> {};
+
+/**
+ * Move-only owner of one pin of a page.
+ *
+ * The handle holds the storage, the address and the page pointer, and
+ * gives the pin back with release_page when it is destroyed or reset,
+ * so a page can not be left pinned by an early return or an exception.
+ * save gives the pin back through save_page instead. Pinning through a
+ * handle costs nothing beyond the load_page itself: no allocation and
+ * no bookkeeping outside the storage, which keeps the pin count with
+ * the frame (and synchronizes it, where the storage may be shared).
+ */
+class page_handle {
+
+public:
+
+	page_handle() {
+		this->storage = nullptr;
+		this->address = 0;
+		this->page = nullptr;
+	}
+
+	/**
+	 * Takes over a pin obtained from load_page or create_page.
+	 */
+	page_handle(storage_model* storage, size_t address, char* page) {
+		this->storage = storage;
+		this->address = address;
+		this->page = page;
+	}
+
+	page_handle(page_handle&& other) noexcept {
+		this->storage = other.storage;
+		this->address = other.address;
+		this->page = other.page;
+		other.storage = nullptr;
+		other.page = nullptr;
+	}
+
+	page_handle& operator=(page_handle&& other) noexcept {
+		if (this != &other) {
+			reset();
+			storage = other.storage;
+			address = other.address;
+			page = other.page;
+			other.storage = nullptr;
+			other.page = nullptr;
+		}
+		return *this;
+	}
+
+	page_handle(const page_handle&) = delete;
+
+	page_handle& operator=(const page_handle&) = delete;
+
+	~page_handle() {
+		reset();
+	}
+
+	char* get() const {
+		return page;
+	}
+
+	size_t get_address() const {
+		return address;
+	}
+
+	explicit operator bool() const {
+		return page != nullptr;
+	}
+
+	/**
+	 * Marks the page changed; the pin is kept.
+	 */
+	void update() {
+		storage->update_page(address, page);
+	}
+
+	/**
+	 * Saves the page and gives the pin back.
+	 */
+	void save() {
+		storage_model* owner = storage;
+		char* saved = page;
+		storage = nullptr;
+		page = nullptr;
+		owner->save_page(address, saved);
+	}
+
+	/**
+	 * Gives the pin back, if the handle holds one.
+	 */
+	void reset() {
+		if (page != nullptr) {
+			storage_model* owner = storage;
+			storage = nullptr;
+			page = nullptr;
+			owner->release_page(address);
+		}
+	}
+
+	/**
+	 * Gives up the ownership of the pin without releasing it.
+	 * @return The page pointer.
+	 */
+	char* detach() {
+		char* detached = page;
+		storage = nullptr;
+		page = nullptr;
+		return detached;
+	}
+
+private:
+
+	storage_model* storage;
+
+	size_t address;
+
+	char* page;
+
+};
+
+inline page_handle storage_model::pin_page(size_t address) {
+	return page_handle(this, address, load_page(address));
+}
+
+/**
+ * FNV-1a over 64-bit words, continued from the given value (start with
+ * page_checksum_seed), so an image can be checksummed page by page.
+ */
+const uint64_t page_checksum_seed = 0xcbf29ce484222325;
+
+inline uint64_t page_checksum(uint64_t value, const char* data, size_t size) {
+	const uint64_t prime = 0x100000001b3;
+	uint64_t hash = value;
+	size_t index = 0;
+	for (; index + sizeof(uint64_t) <= size; index += sizeof(uint64_t)) {
+		uint64_t word;
+		std::memcpy(&word, data + index, sizeof(word));
+		hash = (hash ^ word) * prime;
+	}
+	for (; index < size; ++index) {
+		hash = (hash ^ (unsigned char)data[index]) * prime;
+	}
+	return hash;
+}
+
+/**
+ * Base of storages which wrap another storage and add something to it,
+ * like logging or checksums. Every call is forwarded to the wrapped
+ * storage; subclasses override the calls they extend. The wrapped
+ * storage is not owned.
+ */
+class storage_decorator : public storage_model {
+
+public:
+
+	storage_decorator(storage_model* inner) {
+		this->inner = inner;
+	}
+
+	size_t get_page_size() const {
+		return inner->get_page_size();
+	}
+
+	size_t create_page() {
+		return inner->create_page();
+	}
+
+	char* load_page(size_t address) {
+		return inner->load_page(address);
+	}
+
+	void save_page(size_t address, char* page) {
+		inner->save_page(address, page);
+	}
+
+	void update_page(size_t address, char* page) {
+		inner->update_page(address, page);
+	}
+
+	void release_page(size_t address) {
+		inner->release_page(address);
+	}
+
+	void free_page(size_t address) {
+		inner->free_page(address);
+	}
+
+	size_t compact(relocate_callback relocate) {
+		return inner->compact(std::move(relocate));
+	}
+
+	void prefetch_pages(const size_t* addresses, size_t count) {
+		inner->prefetch_pages(addresses, count);
+	}
+
+	void load_pages(const size_t* addresses, size_t count, char** pages) {
+		inner->load_pages(addresses, count, pages);
+	}
+
+	void load_page_async(size_t address, page_callback callback) {
+		inner->load_page_async(address, std::move(callback));
+	}
+
+	void load_pages_async(const size_t* addresses, size_t count, page_callback callback) {
+		inner->load_pages_async(addresses, count, std::move(callback));
+	}
+
+	storage_model* get_inner() const {
+		return inner;
+	}
+
+protected:
+
+	storage_model* inner;
+
+};
+
+/**
+ * In-memory implementation of the memory model.
+ *
+ * Pages are allocated from slabs: blocks of slab_pages consecutive
+ * pages, aligned to the OS page. Each page starts on a cache line, so
+ * consecutive pages are page_stride bytes apart (page_size rounded up
+ * to a whole cache line). The page directory is a dense vector of slabs
+ * indexed by address, so load_page is a shift and an index.
+ *
+ * The content can be written to a snapshot file and restored from it.
+ * The snapshot is binary: a fixed snapshot_header followed by the image
+ * of all pages in the order of their addresses. Restoring allocates all
+ * slabs as one block and, when page_stride equals page_size, reads the
+ * whole image into it with a single read.
+ *
+ * Pages passed to create_page, update_page or save_page are marked
+ * dirty. checkpoint writes a full snapshot the first time, and after
+ * that appends only the pages dirty since the previous checkpoint to a
+ * delta file next to the snapshot; either is synced before checkpoint
+ * returns. When the deltas grow beyond
+ * checkpoint_compaction times the size of the snapshot, the next
+ * checkpoint compacts them: it writes a new full snapshot next to the
+ * old one, syncs it and renames it over the old one, and only then
+ * drops the delta file, so a crash leaves either the old snapshot with
+ * its deltas or the new one. restore_checkpoint loads the snapshot and
+ * replays the deltas; a record torn by a crash ends the replay.
+ *
+ * Freed pages are kept in a free list, which create_page takes from
+ * before it extends the storage. The free list is part of snapshots and
+ * deltas. compact moves the last live pages into the lowest free pages
+ * and gives trailing slabs back; the following checkpoint is a full
+ * snapshot.
+ *
+ * For large tables use_huge_pages switches to 2 MiB slabs allocated
+ * with mmap, aligned to 2 MiB and marked with MADV_HUGEPAGE, so that a
+ * slab is backed by a single transparent huge page and a lookup costs
+ * one TLB entry per 2 MiB instead of per 4 KiB. With numa_local the
+ * slabs also prefer the NUMA node of the calling thread (mbind with
+ * MPOL_PREFERRED, so a full node falls back to the others).
+ * get_huge_page_bytes reports how much of the slabs the kernel actually
+ * backs with huge pages.
+ */
+class unsafe_inmemory_storage final : public storage_model {
+
+public:
+
+	unsafe_inmemory_storage(size_t page_size) {
+		this->page_size = page_size;
+		this->page_stride = (page_size + cache_line_size - 1) / cache_line_size * cache_line_size;
+		set_slab_shift(slab_target_size);
+		this->page_count = 0;
+		this->checkpoint_compaction = 1.0;
+		this->huge_pages = false;
+		this->numa_node = -1;
+	}
+
+	~unsafe_inmemory_storage() {
+		clear();
+	}
+
+	size_t get_page_size() const {
+		return page_size;
+	}
+
+	size_t create_page() {
+		if (!free_pages.empty()) {
+			size_t address = free_pages.back();
+			free_pages.pop_back();
+			free_flags[address] = false;
+			std::memset(page_at(address), 0, page_size);
+			dirty[address] = true;
+			return address;
+		}
+		size_t address = page_count;
+		if ((address >> slab_shift) == slabs.size()) {
+			slabs.push_back(allocate_block(slab_size()));
+		}
+		++page_count;
+		dirty.push_back(true);
+		free_flags.push_back(false);
+		return address;
+	}
+
+	char* load_page(size_t address) {
+		if (address >= page_count) {
+			throw std::out_of_range("unsafe_inmemory_storage: no page " + std::to_string(address));
+		}
+		return page_at(address);
+	}
+
+	void save_page(size_t address, char* page) {
+		dirty.at(address) = true;
+	}
+
+	void update_page(size_t address, char* page) {
+		dirty.at(address) = true;
+	}
+
+	void release_page(size_t address) {
+		// No operation here.
+	}
+
+	void free_page(size_t address) {
+		load_page(address);
+		if (free_flags[address]) {
+			throw std::runtime_error("unsafe_inmemory_storage: page " + std::to_string(address) + " is already free");
+		}
+		free_pages.push_back(address);
+		free_flags[address] = true;
+		dirty[address] = true;
+	}
+
+	size_t compact(relocate_callback relocate) {
+		std::sort(free_pages.begin(), free_pages.end());
+		size_t moved = 0;
+		size_t first = 0;
+		size_t last = free_pages.size();
+		while (first < last) {
+			size_t top = page_count - 1;
+			--page_count;
+			if (free_pages[last - 1] == top) {
+				--last;
+				continue;
+			}
+			// The top page is live and every remaining free page is below it.
+			size_t to = free_pages[first++];
+			std::memcpy(page_at(to), page_at(top), page_size);
+			dirty[to] = true;
+			relocate(top, to);
+			++moved;
+		}
+		free_pages.clear();
+		free_flags.assign(page_count, false);
+		dirty.resize(page_count);
+		size_t slab_count = (page_count + slab_pages() - 1) >> slab_shift;
+		while (slabs.size() > slab_count && blocks.back().get() == slabs.back()) {
+			slabs.pop_back();
+			blocks.pop_back();
+		}
+		checkpoint_path.clear();
+		return moved;
+	}
+
+	/**
+	 * The pages are in the memory already, bring their first cache line
+	 * into the processor cache.
+	 */
+	void prefetch_pages(const size_t* addresses, size_t count) {
+		for (size_t index = 0; index < count; ++index) {
+			if (addresses[index] < page_count) {
+				__builtin_prefetch(page_at(addresses[index]));
+			}
+		}
+	}
+
+public:
+
+	void print_page(size_t address) {
+		char* page = load_page(address);
+		std::cout << "Page " << address << " :" << std::endl;
+		for (size_t i = 0; i < page_size; ++i) {
+			std::cout << std::bitset<CHAR_BIT>(page[i]) << " ";
+		}
+		std::cout << std::endl;
+	}
+
+	void save_to_file(const std::string& path) const {
+		snapshot_header header = make_header();
+		for (size_t address = 0; address < page_count; ++address) {
+			header.checksum = page_checksum(header.checksum, page_at(address), page_size);
+		}
+		std::vector<uint64_t> free_list = make_free_list();
+		header.checksum = page_checksum(header.checksum, (const char*)free_list.data(), free_list.size() * sizeof(uint64_t));
+		std::ofstream stream(path, std::ios::out | std::ios::binary | std::ios::trunc);
+		stream.write((const char*)&header, sizeof(header));
+		if (page_stride == page_size) {
+			for (size_t slab = 0; slab < slabs.size(); ++slab) {
+				size_t count = std::min(page_count - (slab << slab_shift), slab_pages());
+				stream.write(slabs[slab], count * page_size);
+			}
+		} else {
+			for (size_t address = 0; address < page_count; ++address) {
+				stream.write(page_at(address), page_size);
+			}
+		}
+		stream.write((const char*)free_list.data(), free_list.size() * sizeof(uint64_t));
+		stream.close();
+		if (!stream) {
+			throw std::runtime_error("unsafe_inmemory_storage: can not write " + path);
+		}
+	}
+
+	void load_from_file(const std::string& path) {
+		clear();
+		std::ifstream stream(path, std::ios::in | std::ios::binary);
+		snapshot_header header;
+		if (!stream.read((char*)&header, sizeof(header))) {
+			throw std::runtime_error("unsafe_inmemory_storage: can not read " + path);
+		}
+		check_header(header, path);
+
+		size_t slab_count = (header.page_count + slab_pages() - 1) >> slab_shift;
+		char* image = allocate_block(slab_count * slab_size());
+		for (size_t slab = 0; slab < slab_count; ++slab) {
+			slabs.push_back(image + slab * slab_size());
+		}
+		page_count = header.page_count;
+
+		bool complete = true;
+		if (page_stride == page_size) {
+			complete = (bool)stream.read(image, page_count * page_size);
+		} else {
+			for (size_t address = 0; complete && address < page_count; ++address) {
+				complete = (bool)stream.read(page_at(address), page_size);
+			}
+		}
+		// Version 1 snapshots have no free list.
+		std::vector<uint64_t> free_list;
+		if (complete && header.version >= 2) {
+			complete = read_free_list(stream, free_list, page_count);
+		}
+		if (!complete) {
+			clear();
+			throw std::runtime_error("unsafe_inmemory_storage: " + path + " is truncated");
+		}
+		uint64_t image_checksum = page_checksum_seed;
+		for (size_t address = 0; address < page_count; ++address) {
+			image_checksum = page_checksum(image_checksum, page_at(address), page_size);
+		}
+		image_checksum = page_checksum(image_checksum, (const char*)free_list.data(), free_list.size() * sizeof(uint64_t));
+		if (image_checksum != header.checksum) {
+			clear();
+			throw std::runtime_error("unsafe_inmemory_storage: " + path + " is corrupted");
+		}
+		set_free_list(free_list);
+		dirty.assign(page_count, false);
+	}
+
+	void clear() {
+		slabs.clear();
+		blocks.clear();
+		dirty.clear();
+		free_pages.clear();
+		free_flags.clear();
+		page_count = 0;
+		checkpoint_path.clear();
+	}
+
+	/**
+	 * Persist the pages changed since the last checkpoint to path.
+	 * @return Number of pages written.
+	 */
+	size_t checkpoint(const std::string& path) {
+		std::string delta_path = path + ".delta";
+		if (path != checkpoint_path || needs_compaction(path, delta_path)) {
+			std::string temporary_path = path + ".tmp";
+			save_to_file(temporary_path);
+			sync_file(temporary_path);
+			if (std::rename(temporary_path.c_str(), path.c_str()) != 0) {
+				std::remove(temporary_path.c_str());
+				throw std::runtime_error("unsafe_inmemory_storage: can not rename " + temporary_path + ": " + std::strerror(errno));
+			}
+			std::remove(delta_path.c_str());
+			dirty.assign(page_count, false);
+			checkpoint_path = path;
+			return page_count;
+		}
+
+		delta_header header;
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, delta_magic(), sizeof(header.magic));
+		header.page_count = page_count;
+		header.checksum = page_checksum_seed;
+		for (size_t address = 0; address < page_count; ++address) {
+			if (dirty[address]) {
+				// The address is one whole word, so this equals the checksum
+				// of the record as one piece.
+				uint64_t record_address = address;
+				header.checksum = page_checksum(header.checksum, (const char*)&record_address, sizeof(record_address));
+				header.checksum = page_checksum(header.checksum, page_at(address), page_size);
+				++header.dirty_count;
+			}
+		}
+		if (header.dirty_count == 0) {
+			return 0;
+		}
+		std::vector<uint64_t> free_list = make_free_list();
+		header.checksum = page_checksum(header.checksum, (const char*)free_list.data(), free_list.size() * sizeof(uint64_t));
+
+		std::ofstream stream(delta_path, std::ios::out | std::ios::binary | std::ios::app);
+		stream.write((const char*)&header, sizeof(header));
+		for (size_t address = 0; address < page_count; ++address) {
+			if (dirty[address]) {
+				uint64_t record_address = address;
+				stream.write((const char*)&record_address, sizeof(record_address));
+				stream.write(page_at(address), page_size);
+			}
+		}
+		stream.write((const char*)free_list.data(), free_list.size() * sizeof(uint64_t));
+		stream.close();
+		if (!stream) {
+			throw std::runtime_error("unsafe_inmemory_storage: can not write " + delta_path);
+		}
+		sync_file(delta_path);
+		dirty.assign(page_count, false);
+		return header.dirty_count;
+	}
+
+	/**
+	 * Load the snapshot at path and replay its deltas.
+	 */
+	void restore_checkpoint(const std::string& path) {
+		load_from_file(path);
+		std::string delta_path = path + ".delta";
+		std::ifstream stream(delta_path, std::ios::in | std::ios::binary);
+		std::vector<char> records;
+		std::vector<uint64_t> free_list;
+		delta_header header;
+		while (stream.read((char*)&header, sizeof(header))) {
+			if (std::memcmp(header.magic, delta_magic(), sizeof(header.magic)) != 0) {
+				break;
+			}
+			size_t record_size = sizeof(uint64_t) + page_size;
+			records.resize(header.dirty_count * record_size);
+			if (!stream.read(records.data(), records.size()) || !read_free_list(stream, free_list, header.page_count)) {
+				break;
+			}
+			uint64_t records_checksum = page_checksum_seed;
+			for (size_t index = 0; index < header.dirty_count; ++index) {
+				records_checksum = page_checksum(records_checksum, records.data() + index * record_size, record_size);
+			}
+			records_checksum = page_checksum(records_checksum, (const char*)free_list.data(), free_list.size() * sizeof(uint64_t));
+			if (records_checksum != header.checksum) {
+				break;
+			}
+			for (size_t index = 0; index < header.dirty_count; ++index) {
+				uint64_t address;
+				std::memcpy(&address, records.data() + index * record_size, sizeof(address));
+				if (address >= header.page_count) {
+					clear();
+					throw std::runtime_error("unsafe_inmemory_storage: " + delta_path + " is corrupted");
+				}
+			}
+			while (page_count < header.page_count) {
+				create_page();
+			}
+			for (size_t index = 0; index < header.dirty_count; ++index) {
+				const char* record = records.data() + index * record_size;
+				uint64_t address;
+				std::memcpy(&address, record, sizeof(address));
+				std::memcpy(page_at(address), record + sizeof(address), page_size);
+			}
+			set_free_list(free_list);
+		}
+		dirty.assign(page_count, false);
+		checkpoint_path = path;
+	}
+
+	/**
+	 * Deltas are compacted once they are larger than ratio times the
+	 * snapshot.
+	 */
+	void set_checkpoint_compaction(double ratio) {
+		checkpoint_compaction = ratio;
+	}
+
+	/**
+	 * Allocate slabs as transparent huge pages, on the NUMA node of the
+	 * calling thread if numa_local is set. Only allowed while the
+	 * storage is empty, as it changes the slab size.
+	 */
+	void use_huge_pages(bool numa_local = false) {
+		if (!slabs.empty()) {
+			throw std::runtime_error("unsafe_inmemory_storage: huge pages must be chosen before pages are created");
+		}
+		huge_pages = true;
+		numa_node = numa_local ? current_numa_node() : -1;
+		set_slab_shift(huge_page_size);
+	}
+
+	bool uses_huge_pages() const {
+		return huge_pages;
+	}
+
+	/**
+	 * Node the slabs are placed on, or -1 if they are not NUMA-local.
+	 */
+	int get_numa_node() const {
+		return numa_node;
+	}
+
+	/**
+	 * Bytes allocated for slabs.
+	 */
+	size_t get_allocated_bytes() const {
+		size_t total = 0;
+		for (const auto& block : blocks) {
+			total += block.get_deleter().size;
+		}
+		return total;
+	}
+
+	/**
+	 * Bytes of the slabs backed by transparent huge pages, according to
+	 * the AnonHugePages lines of /proc/self/smaps. Mappings are counted
+	 * whole, and the kernel may merge neighbouring huge-page mappings,
+	 * so the result is capped at get_allocated_bytes. Always 0 unless
+	 * use_huge_pages was called.
+	 */
+	size_t get_huge_page_bytes() const {
+		if (!huge_pages || blocks.empty()) {
+			return 0;
+		}
+		std::ifstream smaps("/proc/self/smaps");
+		std::string line;
+		bool ours = false;
+		size_t total = 0;
+		while (std::getline(smaps, line)) {
+			unsigned long long begin, end;
+			unsigned long long kilobytes;
+			if (std::sscanf(line.c_str(), "%llx-%llx ", &begin, &end) == 2 && line.find(':') > line.find(' ')) {
+				ours = false;
+				for (const auto& block : blocks) {
+					uintptr_t start = (uintptr_t)block.get();
+					ours |= start < end && begin < start + block.get_deleter().size;
+				}
+			} else if (ours && std::sscanf(line.c_str(), "AnonHugePages: %llu kB", &kilobytes) == 1) {
+				total += kilobytes * 1024;
+			}
+		}
+		return std::min(total, get_allocated_bytes());
+	}
+
+	size_t get_dirty_page_count() const {
+		return std::count(dirty.begin(), dirty.end(), true);
+	}
+
+	size_t get_page_count() const {
+		return page_count;
+	}
+
+	size_t get_free_page_count() const {
+		return free_pages.size();
+	}
+
+private:
+
+	/**
+	 * Fixed-size prefix of a snapshot file. The checksum covers the page
+	 * image which follows the header and, since version 2, the free list
+	 * after the image.
+	 */
+	struct snapshot_header {
+		char magic[8];
+		uint32_t version;
+		uint32_t reserved;
+		uint64_t page_size;
+		uint64_t page_count;
+		uint64_t checksum;
+	};
+
+	static const uint32_t snapshot_version = 2;
+
+	static const char* snapshot_magic() {
+		return "DOPSNAP";
+	}
+
+	snapshot_header make_header() const {
+		snapshot_header header;
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, snapshot_magic(), sizeof(header.magic));
+		header.version = snapshot_version;
+		header.page_size = page_size;
+		header.page_count = page_count;
+		header.checksum = page_checksum_seed;
+		return header;
+	}
+
+	/**
+	 * Header of one delta record, followed by dirty_count pairs of a
+	 * 64-bit address and the page image, and by the free list. The
+	 * checksum covers the pairs and the free list.
+	 */
+	struct delta_header {
+		char magic[8];
+		uint64_t page_count;
+		uint64_t dirty_count;
+		uint64_t checksum;
+	};
+
+	static const char* delta_magic() {
+		return "DOPDEL2";
+	}
+
+	/**
+	 * The free list as stored in files: the number of free pages and
+	 * their addresses, all 64-bit.
+	 */
+	std::vector<uint64_t> make_free_list() const {
+		std::vector<uint64_t> free_list(1, free_pages.size());
+		free_list.insert(free_list.end(), free_pages.begin(), free_pages.end());
+		return free_list;
+	}
+
+	static bool read_free_list(std::istream& stream, std::vector<uint64_t>& free_list, size_t page_count) {
+		uint64_t count;
+		if (!stream.read((char*)&count, sizeof(count)) || count > page_count) {
+			return false;
+		}
+		free_list.resize(count + 1);
+		free_list[0] = count;
+		return (bool)stream.read((char*)(free_list.data() + 1), count * sizeof(uint64_t));
+	}
+
+	void set_free_list(const std::vector<uint64_t>& free_list) {
+		free_pages.clear();
+		free_flags.assign(page_count, false);
+		for (size_t index = 1; index < free_list.size(); ++index) {
+			if (free_list[index] < page_count && !free_flags[free_list[index]]) {
+				free_pages.push_back(free_list[index]);
+				free_flags[free_list[index]] = true;
+			}
+		}
+	}
+
+	static void sync_file(const std::string& path) {
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0 || ::fsync(fd) != 0) {
+			int error = errno;
+			if (fd >= 0) {
+				::close(fd);
+			}
+			throw std::runtime_error("unsafe_inmemory_storage: can not sync " + path + ": " + std::strerror(error));
+		}
+		::close(fd);
+	}
+
+	bool needs_compaction(const std::string& path, const std::string& delta_path) const {
+		std::ifstream snapshot(path, std::ios::in | std::ios::binary | std::ios::ate);
+		std::ifstream delta(delta_path, std::ios::in | std::ios::binary | std::ios::ate);
+		if (!snapshot) {
+			return true;
+		}
+		if (!delta) {
+			return false;
+		}
+		return (double)delta.tellg() > checkpoint_compaction * (double)snapshot.tellg();
+	}
+
+	void check_header(const snapshot_header& header, const std::string& path) const {
+		if (std::memcmp(header.magic, snapshot_magic(), sizeof(header.magic)) != 0) {
+			throw std::runtime_error("unsafe_inmemory_storage: " + path + " is not a snapshot");
+		}
+		if (header.version == 0 || header.version > snapshot_version) {
+			throw std::runtime_error("unsafe_inmemory_storage: " + path + " has unsupported version " +
+				std::to_string(header.version));
+		}
+		if (header.page_size != page_size) {
+			throw std::runtime_error("unsafe_inmemory_storage: " + path + " has page size " +
+				std::to_string(header.page_size));
+		}
+	}
+
+	/**
+	 * Slabs are aligned to the OS page and hold 2^slab_shift pages of
+	 * page_stride bytes, about slab_target_size bytes in total.
+	 */
+	static const size_t cache_line_size = 64;
+
+	static const size_t slab_alignment = 4096;
+
+	static const size_t slab_target_size = 1 << 20;
+
+	static const size_t huge_page_size = 2 << 20;
+
+	/**
+	 * Blocks of huge pages are mapped, the others come from malloc.
+	 */
+	struct block_deleter {
+		size_t size = 0;
+		bool mapped = false;
+		void operator()(char* block) const {
+			if (mapped) {
+				::munmap(block, size);
+			} else {
+				::free(block);
+			}
+		}
+	};
+
+	void set_slab_shift(size_t target_size) {
+		slab_shift = 0;
+		while ((page_stride << (slab_shift + 1)) <= target_size) {
+			++slab_shift;
+		}
+	}
+
+	size_t slab_pages() const {
+		return (size_t)1 << slab_shift;
+	}
+
+	size_t slab_size() const {
+		return page_stride << slab_shift;
+	}
+
+	char* page_at(size_t address) const {
+		return slabs[address >> slab_shift] + (address & (slab_pages() - 1)) * page_stride;
+	}
+
+	char* allocate_block(size_t size) {
+		if (huge_pages) {
+			return allocate_huge_block(size);
+		}
+		void* block = nullptr;
+		if (::posix_memalign(&block, slab_alignment, size) != 0) {
+			throw std::bad_alloc();
+		}
+		blocks.emplace_back((char*)block, block_deleter{size, false});
+		return (char*)block;
+	}
+
+	/**
+	 * Maps one huge page more than needed and trims the ends, so the
+	 * block starts on a huge page boundary.
+	 */
+	char* allocate_huge_block(size_t size) {
+		size = (size + huge_page_size - 1) / huge_page_size * huge_page_size;
+		size_t mapped_size = size + huge_page_size;
+		void* mapping = ::mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mapping == MAP_FAILED) {
+			throw std::bad_alloc();
+		}
+		uintptr_t start = ((uintptr_t)mapping + huge_page_size - 1) / huge_page_size * huge_page_size;
+		size_t head = start - (uintptr_t)mapping;
+		if (head > 0) {
+			::munmap(mapping, head);
+		}
+		::munmap((char*)start + size, huge_page_size - head);
+		char* block = (char*)start;
+		::madvise(block, size, MADV_HUGEPAGE);
+		if (numa_node >= 0) {
+			// MPOL_PREFERRED; called directly, libnuma is not required.
+			const int preferred = 1;
+			unsigned long mask = 1ul << numa_node;
+			::syscall(SYS_mbind, block, size, preferred, &mask, sizeof(mask) * CHAR_BIT, 0);
+		}
+		blocks.emplace_back(block, block_deleter{size, true});
+		return block;
+	}
+
+	static int current_numa_node() {
+		unsigned cpu = 0;
+		unsigned node = 0;
+		if (::syscall(SYS_getcpu, &cpu, &node, nullptr) != 0 || node >= sizeof(unsigned long) * CHAR_BIT) {
+			return -1;
+		}
+		return (int)node;
+	}
+
+private:
+
+	size_t page_size;
+
+	size_t page_stride;
+
+	size_t slab_shift;
+
+	size_t page_count;
+
+	std::vector<char*> slabs;
+
+	std::vector<std::unique_ptr<char, block_deleter>> blocks;
+
+	std::vector<bool> dirty;
+
+	std::vector<size_t> free_pages;
+
+	// One bit per page, set while the page is on free_pages.
+	std::vector<bool> free_flags;
+
+	std::string checkpoint_path;
+
+	double checkpoint_compaction;
+
+	bool huge_pages;
+
+	int numa_node;
+
+};
@@ -0,0 +1,410 @@
+#pragma once
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "storage_model.h"
+
+/**
+ * Two-tier memory model: a fixed number of hot pages held in DRAM in
+ * front of a cold storage (typically a buffered_file_storage), which is
+ * the home of every page.
+ *
+ * Every load counts an access of the page. When a page which is not hot
+ * is loaded, and is not pinned, it is promoted into the hot tier if
+ * there is a free hot slot, or if it has been accessed more often than
+ * the least accessed unpinned hot page; that page is demoted, and
+ * written back to the cold storage first if it was changed. Otherwise
+ * the page is served by the cold storage. Counts are halved every
+ * aging_interval accesses, so the hot tier follows a moving working set
+ * rather than the all-time favourites, and pages whose count drops to
+ * zero are forgotten.
+ *
+ * Pages pinned in the hot tier are never demoted; pinned cold pages are
+ * not promoted, so a page pointer stays valid until its release. flush
+ * (and the destructor) writes changed hot pages back to the cold tier;
+ * making the cold tier durable is up to it. The destructor drops an
+ * error of the cold tier, so call flush before if it has to be seen.
+ *
+ * The cold storage is not owned. All functions may be called from
+ * several threads.
+ */
+class tiered_storage : public storage_decorator {
+
+public:
+
+	tiered_storage(storage_model* cold, size_t hot_pages) : storage_decorator(cold) {
+		this->page_size = cold->get_page_size();
+		this->hot_pages = hot_pages;
+		this->aging_interval = 8 * hot_pages + 64;
+		this->access_count = 0;
+		this->promotion_count = 0;
+		this->demotion_count = 0;
+		this->hot_hit_count = 0;
+		void* block = nullptr;
+		if (hot_pages > 0 && ::posix_memalign(&block, 4096, hot_pages * page_size) != 0) {
+			throw std::bad_alloc();
+		}
+		hot_arena.reset((char*)block);
+		for (size_t slot = hot_pages; slot > 0; --slot) {
+			free_slots.push_back(slot - 1);
+		}
+	}
+
+	/**
+	 * Writes the changed hot pages back; an error is dropped here, call
+	 * flush first to see it.
+	 */
+	~tiered_storage() {
+		try {
+			flush();
+		} catch (const std::exception&) {
+		}
+	}
+
+	size_t create_page() {
+		std::lock_guard<std::mutex> lock(mutex);
+		size_t address = inner->create_page();
+		page_state& state = states[address];
+		state.count = 1;
+		state.pins = 1;
+		if (!free_slots.empty()) {
+			// A new page is hot as long as there is room, without demotions.
+			char* page = inner->load_page(address);
+			move_in(address, state, free_slots.back(), page);
+			free_slots.pop_back();
+			inner->release_page(address);
+			inner->release_page(address);
+			state.dirty = true;
+		}
+		return address;
+	}
+
+	char* load_page(size_t address) {
+		std::lock_guard<std::mutex> lock(mutex);
+		page_state& state = states[address];
+		touch(address, state);
+		char* page;
+		try {
+			if (state.slot == no_slot && state.pins == 0) {
+				promote(address, state);
+			}
+			if (state.slot != no_slot) {
+				++hot_hit_count;
+				page = slot_data(state.slot);
+			} else {
+				page = inner->load_page(address);
+			}
+		} catch (...) {
+			forget(address);
+			throw;
+		}
+		++state.pins;
+		return page;
+	}
+
+	void save_page(size_t address, char* page) {
+		std::lock_guard<std::mutex> lock(mutex);
+		page_state& state = states.at(address);
+		if (state.slot != no_slot) {
+			state.dirty = true;
+		} else {
+			inner->save_page(address, page);
+		}
+		unpin(address, state);
+	}
+
+	void update_page(size_t address, char* page) {
+		std::lock_guard<std::mutex> lock(mutex);
+		page_state& state = states.at(address);
+		if (state.slot != no_slot) {
+			state.dirty = true;
+		} else {
+			inner->update_page(address, page);
+		}
+	}
+
+	void release_page(size_t address) {
+		std::lock_guard<std::mutex> lock(mutex);
+		page_state& state = states.at(address);
+		if (state.slot == no_slot) {
+			inner->release_page(address);
+		}
+		unpin(address, state);
+	}
+
+	void free_page(size_t address) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto iter = states.find(address);
+		if (iter != states.end()) {
+			if (iter->second.slot != no_slot) {
+				move_out(address, iter->second, false);
+			}
+			states.erase(iter);
+		}
+		inner->free_page(address);
+	}
+
+	/**
+	 * Hot pages are written back first, so the cold storage moves their
+	 * current content; the moved ones keep their slots.
+	 */
+	size_t compact(relocate_callback relocate) {
+		flush();
+		std::unique_lock<std::mutex> lock(mutex);
+		return inner->compact([this, &lock, &relocate](size_t from, size_t to) {
+			auto iter = states.find(from);
+			if (iter != states.end()) {
+				page_state state = iter->second;
+				states.erase(iter);
+				if (state.slot != no_slot) {
+					hot_by_count.erase(std::make_pair(state.count, from));
+					hot_by_count.insert(std::make_pair(state.count, to));
+				}
+				states[to] = state;
+			}
+			lock.unlock();
+			relocate(from, to);
+			lock.lock();
+		});
+	}
+
+	void prefetch_pages(const size_t* addresses, size_t count) {
+		std::vector<size_t> cold;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (size_t index = 0; index < count; ++index) {
+				auto iter = states.find(addresses[index]);
+				if (iter == states.end() || iter->second.slot == no_slot) {
+					cold.push_back(addresses[index]);
+				}
+			}
+		}
+		inner->prefetch_pages(cold.data(), cold.size());
+	}
+
+	void load_pages(const size_t* addresses, size_t count, char** pages) {
+		storage_model::load_pages(addresses, count, pages);
+	}
+
+	void load_page_async(size_t address, page_callback callback) {
+		storage_model::load_page_async(address, std::move(callback));
+	}
+
+	void load_pages_async(const size_t* addresses, size_t count, page_callback callback) {
+		storage_model::load_pages_async(addresses, count, std::move(callback));
+	}
+
+public:
+
+	/**
+	 * Write all changed hot pages back to the cold storage. They stay hot.
+	 */
+	void flush() {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto& entry : states) {
+			if (entry.second.slot != no_slot && entry.second.dirty) {
+				write_back(entry.first, entry.second);
+			}
+		}
+	}
+
+	/**
+	 * Halve all access counts after this many accesses.
+	 */
+	void set_aging_interval(size_t interval) {
+		std::lock_guard<std::mutex> lock(mutex);
+		aging_interval = std::max(interval, (size_t)1);
+	}
+
+	size_t get_hot_page_count() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return hot_by_count.size();
+	}
+
+	bool is_hot(size_t address) const {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto iter = states.find(address);
+		return iter != states.end() && iter->second.slot != no_slot;
+	}
+
+	size_t get_promotion_count() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return promotion_count;
+	}
+
+	size_t get_demotion_count() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return demotion_count;
+	}
+
+	/**
+	 * Number of loads served by the hot tier.
+	 */
+	size_t get_hot_hit_count() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return hot_hit_count;
+	}
+
+private:
+
+	static const size_t no_slot = SIZE_MAX;
+
+	struct page_state {
+		uint64_t count = 0;
+		size_t pins = 0;
+		size_t slot = no_slot;
+		bool dirty = false;
+	};
+
+	struct arena_deleter {
+		void operator()(char* arena) const {
+			::free(arena);
+		}
+	};
+
+	char* slot_data(size_t slot) const {
+		return hot_arena.get() + slot * page_size;
+	}
+
+	void touch(size_t address, page_state& state) {
+		if (state.slot != no_slot) {
+			hot_by_count.erase(std::make_pair(state.count, address));
+			hot_by_count.insert(std::make_pair(state.count + 1, address));
+		}
+		++state.count;
+		if (++access_count % aging_interval == 0) {
+			age(address);
+		}
+	}
+
+	/**
+	 * Halves all counts; cold pages which are not pinned and have no
+	 * accesses left are forgotten, except the page being accessed.
+	 */
+	void age(size_t accessed) {
+		hot_by_count.clear();
+		for (auto iter = states.begin(); iter != states.end(); ) {
+			page_state& state = iter->second;
+			state.count /= 2;
+			if (state.slot != no_slot) {
+				hot_by_count.insert(std::make_pair(state.count, iter->first));
+			} else if (state.count == 0 && state.pins == 0 && iter->first != accessed) {
+				iter = states.erase(iter);
+				continue;
+			}
+			++iter;
+		}
+	}
+
+	void forget(size_t address) {
+		auto iter = states.find(address);
+		if (iter != states.end() && iter->second.slot == no_slot && iter->second.pins == 0) {
+			states.erase(iter);
+		}
+	}
+
+	void unpin(size_t address, page_state& state) {
+		if (state.pins > 0) {
+			--state.pins;
+		}
+	}
+
+	/**
+	 * Brings the page into a free slot, or into the slot of the least
+	 * accessed unpinned hot page if that one is accessed less often.
+	 */
+	void promote(size_t address, page_state& state) {
+		auto victim = hot_by_count.begin();
+		if (free_slots.empty()) {
+			while (victim != hot_by_count.end() && states[victim->second].pins > 0) {
+				++victim;
+			}
+			if (victim == hot_by_count.end() || victim->first >= state.count) {
+				return;
+			}
+		}
+		// Read the page before anything is demoted, the read may fail.
+		char* page = inner->load_page(address);
+		size_t slot;
+		if (!free_slots.empty()) {
+			slot = free_slots.back();
+		} else {
+			size_t victim_address = victim->second;
+			page_state& victim_state = states[victim_address];
+			slot = victim_state.slot;
+			move_out(victim_address, victim_state, true);
+			++demotion_count;
+		}
+		move_in(address, state, slot, page);
+		inner->release_page(address);
+		free_slots.erase(std::remove(free_slots.begin(), free_slots.end(), slot), free_slots.end());
+		++promotion_count;
+	}
+
+	void move_in(size_t address, page_state& state, size_t slot, const char* page) {
+		std::memcpy(slot_data(slot), page, page_size);
+		state.slot = slot;
+		state.dirty = false;
+		hot_by_count.insert(std::make_pair(state.count, address));
+	}
+
+	/**
+	 * Takes the page out of the hot tier, writing it back first if asked
+	 * to and it was changed. Its slot becomes free.
+	 */
+	void move_out(size_t address, page_state& state, bool keep) {
+		if (keep && state.dirty) {
+			write_back(address, state);
+		}
+		hot_by_count.erase(std::make_pair(state.count, address));
+		free_slots.push_back(state.slot);
+		state.slot = no_slot;
+		state.dirty = false;
+	}
+
+	void write_back(size_t address, page_state& state) {
+		char* page = inner->load_page(address);
+		std::memcpy(page, slot_data(state.slot), page_size);
+		inner->save_page(address, page);
+		state.dirty = false;
+	}
+
+private:
+
+	size_t page_size;
+
+	size_t hot_pages;
+
+	size_t aging_interval;
+
+	std::unique_ptr<char, arena_deleter> hot_arena;
+
+	std::vector<size_t> free_slots;
+
+	std::unordered_map<size_t, page_state> states;
+
+	std::set<std::pair<uint64_t, size_t>> hot_by_count;
+
+	mutable std::mutex mutex;
+
+	uint64_t access_count;
+
+	size_t promotion_count;
+
+	size_t demotion_count;
+
+	size_t hot_hit_count;
+
+};
@@ -9,13 +9,19 @@
  * Press
  */
 
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <functional>
 #include <random>
 #include <string>
 #include <type_traits>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 
 namespace data_org_project_names {
 
@@ -48,6 +54,10 @@ class UniHash16 {
            "adder_: "       + std::to_string(adder_) + "}";
   }
 
+  uint32_t RandomMask() const { return randomMask_; }
+  uint32_t Multiplier() const { return multiplier_; }
+  uint32_t Adder()      const { return adder_; }
+
   friend uint16_t Hash16(uint32_t,const UniHash16&);
 
  private:
@@ -56,16 +66,18 @@ class UniHash16 {
   uint32_t adder_;
 };
 
+//this prime number was retrieved from: 
+//https://primes.utm.edu/lists/small/small.html
+const uint64_t kBigPrime = 5915587277; // > 2^32
+
 /*
  * Hash16
  */
-uint16_t Hash16(uint32_t key, const UniHash16& parameters)
+inline uint16_t Hash16(uint32_t key, const UniHash16& parameters)
 {
   uint64_t hash = key;
 
-  //this prime number was retrieved from: 
-  //https://primes.utm.edu/lists/small/small.html
-  static const uint64_t big_prime = 5915587277; // > 2^32
+  static const uint64_t big_prime = kBigPrime;
 
   //int-modulated twice to make sure we don't overflow...
   hash ^= parameters.randomMask_;
@@ -77,6 +89,145 @@ uint16_t Hash16(uint32_t key, const UniHash16& parameters)
   return hash;
 }
 
+/*
+ * HashIsa
+ *
+ * Instruction set of the batch hash functions.  The best one the
+ * processor supports is picked at run time; all of them give the same
+ * hashes as the scalar Hash16.
+ */
+enum class HashIsa { kScalar, kAvx2, kAvx512 };
+
+inline HashIsa
+BestHashIsa()
+{
+#if defined(__x86_64__)
+  static const HashIsa best =
+      __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") ? HashIsa::kAvx512 :
+      __builtin_cpu_supports("avx2") ? HashIsa::kAvx2 : HashIsa::kScalar;
+  return best;
+#else
+  return HashIsa::kScalar;
+#endif
+}
+
+inline bool
+HashIsaSupported(HashIsa isa)
+{
+  return isa <= BestHashIsa();
+}
+
+#if defined(__x86_64__)
+
+/*
+ * ModBigPrimeAvx2
+ *
+ * x mod kBigPrime for four 64-bit lanes.  There is no vector division,
+ * so the quotient is estimated in double precision: it is below 2^32 and
+ * the estimate, rounded to the nearest integer, is the quotient or one
+ * more, which the final correction takes care of.  AVX2 has no 64-bit
+ * conversions either, the halves are converted with the 2^52 trick.
+ */
+__attribute__((target("avx2")))
+inline __m256i
+ModBigPrimeAvx2(__m256i x)
+{
+  const __m256d magic     = _mm256_set1_pd(4503599627370496.0); // 2^52
+  const __m256i magicBits = _mm256_castpd_si256(magic);
+  const __m256i low32     = _mm256_set1_epi64x(0xffffffff);
+
+  __m256d lo = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(x, low32), magicBits)), magic);
+  __m256d hi = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(x, 32), magicBits)), magic);
+  __m256d quotient = _mm256_mul_pd(
+      _mm256_add_pd(_mm256_mul_pd(hi, _mm256_set1_pd(4294967296.0)), lo),
+      _mm256_set1_pd(1.0 / kBigPrime));
+  __m256i q = _mm256_and_si256(_mm256_castpd_si256(_mm256_add_pd(quotient, magic)), low32);
+
+  // q * kBigPrime, with kBigPrime = 2^32 + (kBigPrime - 2^32)
+  __m256i product = _mm256_add_epi64(
+      _mm256_slli_epi64(q, 32),
+      _mm256_mul_epu32(q, _mm256_set1_epi64x(kBigPrime - ((uint64_t)1 << 32))));
+  __m256i r = _mm256_sub_epi64(x, product);
+  __m256i negative = _mm256_cmpgt_epi64(_mm256_setzero_si256(), r);
+  return _mm256_add_epi64(r, _mm256_and_si256(negative, _mm256_set1_epi64x(kBigPrime)));
+}
+
+/*
+ * Hash16Avx2
+ *
+ * Hash16 of four keys, one in the low half of each 64-bit lane.
+ */
+__attribute__((target("avx2")))
+inline __m256i
+Hash16Avx2(__m256i key, const UniHash16& parameters)
+{
+  __m256i hash = _mm256_xor_si256(key, _mm256_set1_epi64x(parameters.RandomMask()));
+  hash = _mm256_mul_epu32(hash, _mm256_set1_epi64x(parameters.Multiplier()));
+  hash = ModBigPrimeAvx2(hash);
+  hash = _mm256_add_epi64(hash, _mm256_set1_epi64x(parameters.Adder()));
+  // below twice the prime, one subtraction is enough
+  __m256i above = _mm256_cmpgt_epi64(hash, _mm256_set1_epi64x(kBigPrime - 1));
+  hash = _mm256_sub_epi64(hash, _mm256_and_si256(above, _mm256_set1_epi64x(kBigPrime)));
+  return _mm256_and_si256(hash, _mm256_set1_epi64x(0xffff));
+}
+
+/*
+ * ModBigPrimeAvx512
+ *
+ * As ModBigPrimeAvx2 for eight lanes, with the 64-bit conversions and
+ * multiplication of AVX-512DQ.
+ */
+__attribute__((target("avx512f,avx512dq")))
+inline __m512i
+ModBigPrimeAvx512(__m512i x)
+{
+  const __m512i prime = _mm512_set1_epi64(kBigPrime);
+
+  __m512d quotient = _mm512_mul_pd(
+      _mm512_cvt_roundepu64_pd(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC),
+      _mm512_set1_pd(1.0 / kBigPrime));
+  __m512i q = _mm512_cvt_roundpd_epu64(quotient, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m512i r = _mm512_sub_epi64(x, _mm512_mullo_epi64(q, prime));
+  __mmask8 negative = _mm512_cmplt_epi64_mask(r, _mm512_setzero_si512());
+  return _mm512_mask_add_epi64(r, negative, r, prime);
+}
+
+/*
+ * Hash16Avx512
+ *
+ * Hash16 of eight keys, one in the low half of each 64-bit lane.
+ */
+__attribute__((target("avx512f,avx512dq")))
+inline __m512i
+Hash16Avx512(__m512i key, const UniHash16& parameters)
+{
+  const __m512i prime = _mm512_set1_epi64(kBigPrime);
+
+  __m512i hash = _mm512_xor_si512(key, _mm512_set1_epi64(parameters.RandomMask()));
+  hash = _mm512_mul_epu32(hash, _mm512_set1_epi64(parameters.Multiplier()));
+  hash = ModBigPrimeAvx512(hash);
+  hash = _mm512_add_epi64(hash, _mm512_set1_epi64(parameters.Adder()));
+  __mmask8 above = _mm512_cmpge_epu64_mask(hash, prime);
+  hash = _mm512_mask_sub_epi64(hash, above, hash, prime);
+  return _mm512_and_si512(hash, _mm512_set1_epi64(0xffff));
+}
+
+#endif
+
+/*
+ * KeyWords
+ *
+ * A key over 32-bit words, to read its object representation.  The
+ * union is zero-initialized through the words before the key is stored
+ * (see "BUG OF DEATH"); reading the words of the union is how GCC allows
+ * type punning, a cast of the word array to Key* is not.
+ */
+template<typename Key>
+union KeyWords {
+  uint32_t words[sizeof(Key) / 4];
+  Key      key;
+};
+
 /*
  * Key -> uint64_t
  */
@@ -85,13 +236,23 @@ template<typename Key,
            std::is_trivially_copyable<Key>::value>
          >
 struct UniHash {
-  static_assert(sizeof(Key) >= 4 && sizeof(Key) % 4 == 0);
+  static_assert(sizeof(Key) >= 4 && sizeof(Key) % 4 == 0,
+                "UniHash: keys must be made of whole 32-bit words");
 
   //Need at least four UniHash16 to generate a full hash
   static const size_t kNumParams = std::max(sizeof(Key)/2, (size_t)4);
 
   UniHash16 parameters[kNumParams]; //TODO make private
 
+  /*
+   * A key is hashed as kTerms terms: term t hashes word t % kWords with
+   * parameters[TermParameter(t)] into the 16-bit lane t % 4 of the hash.
+   */
+  static constexpr size_t kWords = sizeof(Key) / 4;
+  static constexpr size_t kTerms = kWords == 1 ? 4 : kWords;
+
+  static constexpr size_t TermParameter(size_t t) { return kWords == 1 ? t : t % 4; }
+
   UniHash() { 
     Refresh();
   }
@@ -104,50 +265,73 @@ struct UniHash {
    * The key must be translated to zero-initialized memory before reading
    * its object representation for the hash function.  This is because not
    * fully-aligned structures may have noise that can affect the hash
-   * function
+   * function.  The copy lives on the stack, so hashing allocates nothing.
    */
   /*
    * operator()
+   *
+   * Every 32-bit word of the key is hashed by Hash16 into one of the four
+   * 16-bit lanes of the result: word i with parameters[i % 4] into lane
+   * i % 4.  A 4-byte key has a single word, which is hashed into all four
+   * lanes with four different parameters.  The common key sizes are
+   * unrolled at compile time.
    */
   uint64_t 
   operator()(const Key& key) const
   {
-    Key* fresh = (Key*)calloc(sizeof(key), 1);
-    *fresh = key;
-
-    uint64_t hash = 0;
-    auto reg = (uint32_t*)fresh; //register
-    auto acc = (uint16_t*)&hash;  //accumulator
-
-    /*
-     * If the Key type is large enough, simply run through its object,
-     * collecting bits
-     */
-    if (sizeof(Key)/2 >= kNumParams)
-    {
-      for (size_t i = 0; i < sizeof(Key)/4; ++i)
-      {
-        auto acc_ = acc + i % 4;
-        *acc_    ^= Hash16(*reg++, parameters[i % 4]);
+    KeyWords<Key> copy = {};
+    copy.key = key;
+    const uint32_t* words = copy.words;
 
-        printf("\tHash: %zu\n", hash);
-      }
-
-    } else {
+    uint16_t lanes[4] = {};
 
-      for (size_t i = 0; i < kNumParams; ++i)
+    if constexpr (kWords == 1)
+    {
+      lanes[0] = Hash16(words[0], parameters[0]);
+      lanes[1] = Hash16(words[0], parameters[1]);
+      lanes[2] = Hash16(words[0], parameters[2]);
+      lanes[3] = Hash16(words[0], parameters[3]);
+    }
+    else if constexpr (kWords == 2)
+    {
+      lanes[0] = Hash16(words[0], parameters[0]);
+      lanes[1] = Hash16(words[1], parameters[1]);
+    }
+    else if constexpr (kWords == 4)
+    {
+      lanes[0] = Hash16(words[0], parameters[0]);
+      lanes[1] = Hash16(words[1], parameters[1]);
+      lanes[2] = Hash16(words[2], parameters[2]);
+      lanes[3] = Hash16(words[3], parameters[3]);
+    }
+    else
+    {
+      for (size_t i = 0; i < kWords; ++i)
       {
-        auto reg_ = reg + i % (sizeof(Key)/4);
-        *acc++   ^= Hash16(*reg_, parameters[i]);
-
-        printf("\thash: %zu\n", hash);
+        lanes[i % 4] ^= Hash16(words[i], parameters[i % 4]);
       }
     }
 
-    free(fresh);
-
+    uint64_t hash;
+    std::memcpy(&hash, lanes, sizeof(hash));
     return hash;
   }
+  /*
+   * hash_batch
+   *
+   * out[i] = (*this)(keys[i]) for n keys, computed for 4 (AVX2) or 8
+   * (AVX-512) keys at once when the processor has the instructions.
+   */
+  void
+  hash_batch(const Key* keys, size_t n, uint64_t* out, HashIsa isa = BestHashIsa()) const
+  {
+    size_t done = 0;
+#if defined(__x86_64__)
+    if (isa == HashIsa::kAvx512) done = HashBatchAvx512(keys, n, out);
+    else if (isa == HashIsa::kAvx2) done = HashBatchAvx2(keys, n, out);
+#endif
+    for (size_t i = done; i < n; ++i) out[i] = (*this)(keys[i]);
+  }
   /*
    * ToString
    */
@@ -160,6 +344,136 @@ struct UniHash {
     return str + "}";
   }
 
+ private:
+
+#if defined(__x86_64__)
+  /*
+   * LoadWords - words[w] holds word w of the keys, one key per 64-bit
+   * lane.  Keys without padding are read in place: keys of one or two
+   * words with plain loads, longer keys with a gather per word.  Other
+   * keys are first copied into zeroed words (see "BUG OF DEATH").
+   */
+  static constexpr bool kInPlace = std::has_unique_object_representations<Key>::value;
+
+  template<size_t kWidth>
+  static void
+  TransposeKeys(const Key* keys, uint64_t (&columns)[kWords][kWidth])
+  {
+    for (size_t k = 0; k < kWidth; ++k)
+    {
+      KeyWords<Key> copy = {};
+      copy.key = keys[k];
+      for (size_t w = 0; w < kWords; ++w) columns[w][k] = copy.words[w];
+    }
+  }
+
+  __attribute__((target("avx2")))
+  static void
+  LoadWordsAvx2(const Key* keys, __m256i (&words)[kWords])
+  {
+    const __m256i low32 = _mm256_set1_epi64x(0xffffffff);
+
+    if (kInPlace && kWords == 1)
+    {
+      words[0] = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*)keys));
+    }
+    else if (kInPlace && kWords == 2)
+    {
+      __m256i pairs = _mm256_loadu_si256((const __m256i*)keys);
+      words[0] = _mm256_and_si256(pairs, low32);
+      words[kWords - 1] = _mm256_srli_epi64(pairs, 32);
+    }
+    else if (kInPlace)
+    {
+      const __m128i index = _mm_setr_epi32(0, kWords, 2 * kWords, 3 * kWords);
+      for (size_t w = 0; w < kWords; ++w)
+        words[w] = _mm256_cvtepu32_epi64(_mm_i32gather_epi32((const int*)keys + w, index, 4));
+    }
+    else
+    {
+      alignas(32) uint64_t columns[kWords][4];
+      TransposeKeys<4>(keys, columns);
+      for (size_t w = 0; w < kWords; ++w) words[w] = _mm256_load_si256((const __m256i*)columns[w]);
+    }
+  }
+
+  __attribute__((target("avx512f,avx512dq")))
+  static void
+  LoadWordsAvx512(const Key* keys, __m512i (&words)[kWords])
+  {
+    const __m512i low32 = _mm512_set1_epi64(0xffffffff);
+
+    if (kInPlace && kWords == 1)
+    {
+      words[0] = _mm512_cvtepu32_epi64(_mm256_loadu_si256((const __m256i*)keys));
+    }
+    else if (kInPlace && kWords == 2)
+    {
+      __m512i pairs = _mm512_loadu_si512((const void*)keys);
+      words[0] = _mm512_and_si512(pairs, low32);
+      words[kWords - 1] = _mm512_srli_epi64(pairs, 32);
+    }
+    else if (kInPlace)
+    {
+      const __m256i index = _mm256_setr_epi32(
+          0, kWords, 2 * kWords, 3 * kWords, 4 * kWords, 5 * kWords, 6 * kWords, 7 * kWords);
+      for (size_t w = 0; w < kWords; ++w)
+        words[w] = _mm512_cvtepu32_epi64(_mm256_i32gather_epi32((const int*)keys + w, index, 4));
+    }
+    else
+    {
+      alignas(64) uint64_t columns[kWords][8];
+      TransposeKeys<8>(keys, columns);
+      for (size_t w = 0; w < kWords; ++w) words[w] = _mm512_load_si512((const void*)columns[w]);
+    }
+  }
+  /*
+   * HashBatchAvx2 - returns the number of keys hashed, a multiple of 4
+   */
+  __attribute__((target("avx2")))
+  size_t
+  HashBatchAvx2(const Key* keys, size_t n, uint64_t* out) const
+  {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+      __m256i words[kWords];
+      LoadWordsAvx2(keys + i, words);
+
+      __m256i hash = _mm256_setzero_si256();
+      for (size_t t = 0; t < kTerms; ++t)
+      {
+        __m256i term = Hash16Avx2(words[t % kWords], parameters[TermParameter(t)]);
+        hash = _mm256_xor_si256(hash, _mm256_sllv_epi64(term, _mm256_set1_epi64x(16 * (t % 4))));
+      }
+      _mm256_storeu_si256((__m256i*)(out + i), hash);
+    }
+    return i;
+  }
+  /*
+   * HashBatchAvx512 - returns the number of keys hashed, a multiple of 8
+   */
+  __attribute__((target("avx512f,avx512dq")))
+  size_t
+  HashBatchAvx512(const Key* keys, size_t n, uint64_t* out) const
+  {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+      __m512i words[kWords];
+      LoadWordsAvx512(keys + i, words);
+
+      __m512i hash = _mm512_setzero_si512();
+      for (size_t t = 0; t < kTerms; ++t)
+      {
+        __m512i term = Hash16Avx512(words[t % kWords], parameters[TermParameter(t)]);
+        hash = _mm512_xor_si512(hash, _mm512_sllv_epi64(term, _mm512_set1_epi64(16 * (t % 4))));
+      }
+      _mm512_storeu_si512((void*)(out + i), hash);
+    }
+    return i;
+  }
+#endif
 };
 
 
@@ -0,0 +1,671 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "storage_model.h"
+
+/**
+ * Write-ahead log over any storage model.
+ *
+ * Every create_page, update_page and save_page appends a redo record to
+ * the log; updates are logged as full page images. Records are collected
+ * in memory and reach the log file only on commit, which appends a
+ * commit record and returns once everything logged so far is on the
+ * disk.
+ *
+ * The log is no-steal: a change reaches the wrapped storage only after
+ * the commit which covers it is durable, so whatever the wrapped storage
+ * writes on its own (buffered_file_storage evicting or flushing a frame,
+ * mmap_storage's mapping written back by the kernel) is committed state,
+ * and redo records are all recovery needs. load_page hands out a private
+ * copy of the page, which is kept while it is pinned or holds changes
+ * not yet applied; once the commit is durable the leader copies the
+ * committed images into the wrapped storage, and the copies which are
+ * neither pinned nor changed again are dropped. free_page is held back
+ * the same way, so the wrapped storage can't hand a page to create_page
+ * while the committed state still uses it; frees are not logged, a
+ * crash before they are applied leaves the pages allocated.
+ *
+ * Concurrent committers share one fsync (group commit): the first one
+ * becomes the leader, writes all records collected until then and syncs
+ * the file, the others wait for it and return together. The leader may
+ * wait group_commit_delay before writing, so that more committers can
+ * join. A table wrapped in wal_storage becomes durable by calling commit
+ * after a batch of inserts, with one fsync for the whole batch; the
+ * table's SaveMeta, logged before the commit, makes it possible to open
+ * the table again after recovery.
+ *
+ * If the leader's write or fsync fails, the log file is cut back to the
+ * end of the last durable commit, so no torn record is left for later
+ * commits to be appended after, and the log is failed: the records of
+ * the group are lost, and this and every later commit throw until
+ * truncate_log is called, which logs the changed pages again. If
+ * applying a durable commit to the wrapped storage fails, the log is
+ * failed too; the commit is in the log and replayed on the next open.
+ *
+ * When opened, the log is replayed into the wrapped storage: pages
+ * created by the log are created, page images are copied into their
+ * pages and saved. Only records up to the last commit are replayed,
+ * anything after it (including a record torn by a crash) is cut off.
+ * Replay is idempotent, so the log can be kept until the wrapped storage
+ * has been made durable by its own means (flush, sync, checkpoint);
+ * truncate_log then empties it.
+ *
+ * compact is forwarded without being logged: compact the wrapped storage
+ * only after truncate_log, with no changes left to commit.
+ *
+ * All calls are serialized by the log mutex, except the write and sync
+ * of a commit group.
+ */
+class wal_storage : public storage_decorator {
+
+public:
+
+	wal_storage(storage_model* inner, const std::string& path) : storage_decorator(inner) {
+		this->path = path;
+		this->page_size = inner->get_page_size();
+		this->next_lsn = 1;
+		this->durable_lsn = 0;
+		this->applied_lsn = 0;
+		this->flushing = false;
+		this->failed = false;
+		this->sync_count = 0;
+		this->group_commit_delay = std::chrono::microseconds(0);
+		this->fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+		if (fd < 0) {
+			throw_io_error("open " + path);
+		}
+		try {
+			recover();
+		} catch (...) {
+			::close(fd);
+			throw;
+		}
+		applied_lsn = durable_lsn;
+	}
+
+	~wal_storage() {
+		::close(fd);
+	}
+
+	size_t create_page() {
+		std::lock_guard<std::mutex> lock(mutex);
+		size_t address = inner->create_page();
+		try {
+			cached_page& cached = cache_page(address);
+			cached.pins = 1;
+		} catch (...) {
+			inner->release_page(address);
+			throw;
+		}
+		inner->release_page(address);
+		append(record_create, address, nullptr);
+		return address;
+	}
+
+	char* load_page(size_t address) {
+		std::lock_guard<std::mutex> lock(mutex);
+		cached_page& cached = cache_page(address);
+		++cached.pins;
+		return cached.image.get();
+	}
+
+	void save_page(size_t address, char* page) {
+		std::lock_guard<std::mutex> lock(mutex);
+		cached_page& cached = pinned_page(address);
+		log_page(address, cached, page);
+		--cached.pins;
+	}
+
+	void update_page(size_t address, char* page) {
+		std::lock_guard<std::mutex> lock(mutex);
+		log_page(address, pinned_page(address), page);
+	}
+
+	void release_page(size_t address) {
+		std::lock_guard<std::mutex> lock(mutex);
+		cached_page& cached = pinned_page(address);
+		if (--cached.pins == 0 && !cached.changed) {
+			cache.erase(address);
+		}
+	}
+
+	void free_page(size_t address) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto iter = cache.find(address);
+		if (iter != cache.end()) {
+			if (iter->second.pins > 0) {
+				throw std::runtime_error("wal_storage: page " + std::to_string(address) + " is pinned");
+			}
+			cache.erase(iter);
+		}
+		// Applied by the first commit logged after the free.
+		freed.push_back({next_lsn, address});
+	}
+
+	size_t compact(relocate_callback relocate) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (auto& entry : cache) {
+				if (entry.second.pins > 0 || entry.second.lsn > applied_lsn) {
+					throw std::runtime_error("wal_storage: compact with page " +
+						std::to_string(entry.first) + " pinned or not committed");
+				}
+			}
+			if (!freed.empty()) {
+				throw std::runtime_error("wal_storage: compact with frees not committed");
+			}
+			cache.clear();
+		}
+		return inner->compact(std::move(relocate));
+	}
+
+	// Loads go through the private copies, not the wrapped storage.
+
+	void load_pages(const size_t* addresses, size_t count, char** pages) {
+		storage_model::load_pages(addresses, count, pages);
+	}
+
+	void load_page_async(size_t address, page_callback callback) {
+		storage_model::load_page_async(address, std::move(callback));
+	}
+
+	void load_pages_async(const size_t* addresses, size_t count, page_callback callback) {
+		storage_model::load_pages_async(addresses, count, std::move(callback));
+	}
+
+public:
+
+	/**
+	 * Makes all records logged so far durable.
+	 * @return Sequence number of the commit record.
+	 */
+	uint64_t commit() {
+		std::unique_lock<std::mutex> lock(mutex);
+		check_failed();
+		uint64_t lsn = append(record_commit, 0, nullptr);
+		while (durable_lsn < lsn) {
+			check_failed();
+			if (flushing) {
+				synced.wait(lock);
+				continue;
+			}
+			flushing = true;
+			if (group_commit_delay.count() > 0) {
+				lock.unlock();
+				std::this_thread::sleep_for(group_commit_delay);
+				lock.lock();
+			}
+			std::vector<char> records;
+			records.swap(pending);
+			uint64_t last_lsn = next_lsn - 1;
+			lock.unlock();
+			try {
+				write_all(records.data(), records.size());
+				if (::fdatasync(fd) != 0) {
+					throw_io_error("fdatasync");
+				}
+			} catch (const std::exception& error) {
+				lock.lock();
+				fail(error.what());
+				flushing = false;
+				synced.notify_all();
+				throw;
+			}
+			lock.lock();
+			durable_size += records.size();
+			durable_lsn = last_lsn;
+			++sync_count;
+			flushing = false;
+			synced.notify_all();
+			unapplied.insert(unapplied.end(), records.begin(), records.end());
+			try {
+				apply_committed();
+			} catch (const std::exception& error) {
+				failed = true;
+				failure = std::string("apply: ") + error.what();
+				throw;
+			}
+		}
+		return lsn;
+	}
+
+	/**
+	 * Empties the log. The wrapped storage must already hold everything
+	 * which was committed, durably; records not yet committed are lost.
+	 * A failed log is usable again afterwards.
+	 */
+	void truncate_log() {
+		std::unique_lock<std::mutex> lock(mutex);
+		synced.wait(lock, [this]() { return !flushing; });
+		pending.clear();
+		unapplied.clear();
+		if (::ftruncate(fd, 0) != 0) {
+			throw_io_error("truncate " + path);
+		}
+		write_header();
+		durable_size = sizeof(log_header);
+		durable_lsn = next_lsn - 1;
+		applied_lsn = durable_lsn;
+		failed = false;
+		failure.clear();
+		// Changes which were not committed (or whose commit failed) are
+		// only in the private copies now; log them for the next commit.
+		for (auto& entry : cache) {
+			if (entry.second.changed) {
+				entry.second.lsn = append(record_page, entry.first, entry.second.image.get());
+			}
+		}
+	}
+
+	void set_group_commit_delay(std::chrono::microseconds delay) {
+		std::lock_guard<std::mutex> lock(mutex);
+		group_commit_delay = delay;
+	}
+
+	/**
+	 * True after a commit failed to write or sync the log.
+	 */
+	bool is_failed() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return failed;
+	}
+
+	uint64_t get_durable_lsn() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return durable_lsn;
+	}
+
+	/**
+	 * Number of fsyncs done by commit, at most one per committer.
+	 */
+	size_t get_sync_count() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return sync_count;
+	}
+
+	/**
+	 * Number of records replayed when the log was opened.
+	 */
+	size_t get_replayed_count() const {
+		return replayed_count;
+	}
+
+private:
+
+	struct log_header {
+		char magic[8];
+		uint64_t page_size;
+	};
+
+	static const char* magic() {
+		return "DOPWAL";
+	}
+
+	enum record_type : uint32_t {
+		record_create = 1,
+		record_page = 2,
+		record_commit = 3,
+	};
+
+	/**
+	 * Header of one record; page records are followed by the page image.
+	 * The checksum covers the header (with checksum 0) and the image.
+	 */
+	struct record_header {
+		uint32_t type;
+		uint32_t reserved;
+		uint64_t lsn;
+		uint64_t address;
+		uint64_t checksum;
+	};
+
+	size_t payload_size(uint32_t type) const {
+		return type == record_page ? page_size : 0;
+	}
+
+	/**
+	 * Private copy of a page. lsn is the record of its last change,
+	 * changed is set until that change has been applied.
+	 */
+	struct cached_page {
+		std::unique_ptr<char[]> image;
+		size_t pins;
+		uint64_t lsn;
+		bool changed;
+	};
+
+	/**
+	 * The copy of the page, made from the wrapped storage if there is
+	 * none; called under the mutex.
+	 */
+	cached_page& cache_page(size_t address) {
+		auto iter = cache.find(address);
+		if (iter != cache.end()) {
+			return iter->second;
+		}
+		std::unique_ptr<char[]> image(new char[page_size]);
+		char* page = inner->load_page(address);
+		std::memcpy(image.get(), page, page_size);
+		inner->release_page(address);
+		cached_page& cached = cache[address];
+		cached.image = std::move(image);
+		cached.pins = 0;
+		cached.lsn = 0;
+		cached.changed = false;
+		return cached;
+	}
+
+	cached_page& pinned_page(size_t address) {
+		auto iter = cache.find(address);
+		if (iter == cache.end() || iter->second.pins == 0) {
+			throw std::runtime_error("wal_storage: page " + std::to_string(address) + " is not pinned");
+		}
+		return iter->second;
+	}
+
+	void log_page(size_t address, cached_page& cached, const char* page) {
+		if (page != cached.image.get()) {
+			std::memcpy(cached.image.get(), page, page_size);
+		}
+		cached.lsn = append(record_page, address, cached.image.get());
+		cached.changed = true;
+	}
+
+	/**
+	 * Copies the page images of the durable records up to the last
+	 * commit into the wrapped storage, gives it the frees they cover and
+	 * drops the copies which are neither pinned nor changed since;
+	 * called under the mutex by the leader of a group. Records after
+	 * the last commit wait for the next group.
+	 */
+	void apply_committed() {
+		size_t committed_end = 0;
+		uint64_t committed_lsn = applied_lsn;
+		for (size_t offset = 0; offset < unapplied.size(); ) {
+			record_header record;
+			std::memcpy(&record, unapplied.data() + offset, sizeof(record));
+			offset += sizeof(record) + payload_size(record.type);
+			if (record.type == record_commit) {
+				committed_end = offset;
+				committed_lsn = record.lsn;
+			}
+		}
+		for (size_t offset = 0; offset < committed_end; ) {
+			record_header record;
+			std::memcpy(&record, unapplied.data() + offset, sizeof(record));
+			offset += sizeof(record);
+			if (record.type == record_page) {
+				char* page = inner->load_page(record.address);
+				std::memcpy(page, unapplied.data() + offset, page_size);
+				inner->save_page(record.address, page);
+			}
+			offset += payload_size(record.type);
+		}
+		unapplied.erase(unapplied.begin(), unapplied.begin() + committed_end);
+		applied_lsn = committed_lsn;
+
+		while (!freed.empty() && freed.front().first <= applied_lsn) {
+			inner->free_page(freed.front().second);
+			freed.pop_front();
+		}
+		for (auto iter = cache.begin(); iter != cache.end(); ) {
+			cached_page& cached = iter->second;
+			if (cached.lsn <= applied_lsn) {
+				cached.changed = false;
+			}
+			if (cached.pins == 0 && !cached.changed) {
+				iter = cache.erase(iter);
+			} else {
+				++iter;
+			}
+		}
+	}
+
+	/**
+	 * Adds a record to the pending records; called under the mutex.
+	 * @return Sequence number of the record.
+	 */
+	uint64_t append(record_type type, size_t address, const char* page) {
+		record_header header;
+		std::memset(&header, 0, sizeof(header));
+		header.type = type;
+		header.lsn = next_lsn++;
+		header.address = address;
+		header.checksum = record_checksum(header, page);
+		size_t offset = pending.size();
+		pending.resize(offset + sizeof(header) + payload_size(type));
+		std::memcpy(pending.data() + offset, &header, sizeof(header));
+		if (page) {
+			std::memcpy(pending.data() + offset + sizeof(header), page, page_size);
+		}
+		return header.lsn;
+	}
+
+	void check_failed() const {
+		if (failed) {
+			throw std::runtime_error("wal_storage: " + path + " failed: " + failure);
+		}
+	}
+
+	/**
+	 * Latches the failure of a group and cuts off what it may have
+	 * written; called under the mutex.
+	 */
+	void fail(const std::string& what) {
+		failed = true;
+		failure = what;
+		pending.clear();
+		if (::ftruncate(fd, (off_t)durable_size) == 0) {
+			::lseek(fd, (off_t)durable_size, SEEK_SET);
+		}
+	}
+
+	uint64_t record_checksum(record_header header, const char* payload) const {
+		header.checksum = 0;
+		uint64_t checksum = page_checksum(page_checksum_seed, (const char*)&header, sizeof(header));
+		return page_checksum(checksum, payload, payload_size(header.type));
+	}
+
+	/**
+	 * Reads the log, replays the committed records into the wrapped
+	 * storage and cuts off the rest.
+	 */
+	void recover() {
+		struct stat info;
+		if (::fstat(fd, &info) != 0) {
+			throw_io_error("stat " + path);
+		}
+		replayed_count = 0;
+		if ((size_t)info.st_size < sizeof(log_header)) {
+			if (::ftruncate(fd, 0) != 0) {
+				throw_io_error("truncate " + path);
+			}
+			write_header();
+			durable_size = sizeof(log_header);
+			return;
+		}
+		std::vector<char> log(info.st_size);
+		read_all(log.data(), log.size());
+		log_header header;
+		std::memcpy(&header, log.data(), sizeof(header));
+		if (std::memcmp(header.magic, magic(), sizeof(header.magic)) != 0) {
+			throw std::runtime_error("wal_storage: " + path + " is not a log");
+		}
+		if (header.page_size != page_size) {
+			throw std::runtime_error("wal_storage: " + path + " has page size " +
+				std::to_string(header.page_size));
+		}
+
+		// Find the end of the last commit, only what precedes it is replayed.
+		size_t committed_end = sizeof(log_header);
+		size_t offset = sizeof(log_header);
+		while (offset + sizeof(record_header) <= log.size()) {
+			record_header record;
+			std::memcpy(&record, log.data() + offset, sizeof(record));
+			size_t size = sizeof(record) + payload_size(record.type);
+			if (record.type < record_create || record.type > record_commit ||
+					offset + size > log.size() ||
+					record.checksum != record_checksum(record, log.data() + offset + sizeof(record))) {
+				break;
+			}
+			offset += size;
+			next_lsn = record.lsn + 1;
+			if (record.type == record_commit) {
+				committed_end = offset;
+			}
+		}
+
+		for (offset = sizeof(log_header); offset < committed_end; ) {
+			record_header record;
+			std::memcpy(&record, log.data() + offset, sizeof(record));
+			replay(record, log.data() + offset + sizeof(record));
+			offset += sizeof(record) + payload_size(record.type);
+			++replayed_count;
+		}
+		if (committed_end < log.size() && ::ftruncate(fd, committed_end) != 0) {
+			throw_io_error("truncate " + path);
+		}
+		if (::lseek(fd, committed_end, SEEK_SET) < 0) {
+			throw_io_error("seek " + path);
+		}
+		durable_size = committed_end;
+		durable_lsn = next_lsn - 1;
+	}
+
+	void replay(const record_header& record, const char* payload) {
+		if (record.type == record_create) {
+			ensure_page(record.address);
+		} else if (record.type == record_page) {
+			ensure_page(record.address);
+			char* page = inner->load_page(record.address);
+			std::memcpy(page, payload, page_size);
+			inner->save_page(record.address, page);
+		}
+	}
+
+	/**
+	 * The wrapped storage may already hold the page, if it was made
+	 * durable after the record had been logged.
+	 */
+	void ensure_page(size_t address) {
+		try {
+			inner->load_page(address);
+			inner->release_page(address);
+		} catch (const std::out_of_range&) {
+			size_t created;
+			do {
+				created = inner->create_page();
+				inner->release_page(created);
+			} while (created < address);
+		}
+	}
+
+	void write_header() {
+		log_header header;
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, magic(), sizeof(header.magic));
+		header.page_size = page_size;
+		if (::lseek(fd, 0, SEEK_SET) < 0) {
+			throw_io_error("seek " + path);
+		}
+		write_all((const char*)&header, sizeof(header));
+		if (::fdatasync(fd) != 0) {
+			throw_io_error("fdatasync");
+		}
+	}
+
+	void write_all(const char* data, size_t size) {
+		while (size > 0) {
+			ssize_t count = ::write(fd, data, size);
+			if (count < 0 && errno == EINTR) {
+				continue;
+			}
+			if (count < 0) {
+				throw_io_error("write " + path);
+			}
+			data += count;
+			size -= count;
+		}
+	}
+
+	void read_all(char* data, size_t size) {
+		size_t done = 0;
+		while (done < size) {
+			ssize_t count = ::pread(fd, data + done, size - done, done);
+			if (count < 0 && errno == EINTR) {
+				continue;
+			}
+			if (count <= 0) {
+				throw_io_error("read " + path);
+			}
+			done += count;
+		}
+	}
+
+	static void throw_io_error(const std::string& what) {
+		throw std::runtime_error("wal_storage: " + what + ": " + std::strerror(errno));
+	}
+
+private:
+
+	std::string path;
+
+	size_t page_size;
+
+	int fd;
+
+	mutable std::mutex mutex;
+
+	std::condition_variable synced;
+
+	std::vector<char> pending;
+
+	uint64_t next_lsn;
+
+	uint64_t durable_lsn;
+
+	// Last commit whose records are in the wrapped storage.
+	uint64_t applied_lsn;
+
+	// Durable records after the last applied commit.
+	std::vector<char> unapplied;
+
+	std::unordered_map<size_t, cached_page> cache;
+
+	// Frees held back, with the sequence number a commit has to reach.
+	std::deque<std::pair<uint64_t, size_t>> freed;
+
+	bool flushing;
+
+	// Size of the log up to the end of the last durable commit.
+	size_t durable_size;
+
+	bool failed;
+
+	std::string failure;
+
+	size_t sync_count;
+
+	size_t replayed_count;
+
+	std::chrono::microseconds group_commit_delay;
+
+};
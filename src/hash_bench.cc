@@ -0,0 +1,126 @@
+//hash_bench.cc
+
+/*
+ * Throughput and quality of the universal hash families, the numbers in
+ * the comment of hash_families.h.  For each family: nanoseconds per key
+ * for random uint64_t and 16-byte keys, and the chi^2 statistic over
+ * kBuckets buckets (hash % kBuckets, as the tables reduce it) of the
+ * random keys and of the sequential keys 0..n-1.  Then the same for
+ * StringHash on URL-like strings, against std::hash.
+ */
+
+#include "hash_families.h"
+#include "string_hash.h"
+#include "universal_hash.h"
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace data_org_project_names;
+
+struct Key16 { uint64_t a, b; };
+
+const size_t kKeys    = 1 << 20;
+const size_t kBuckets = 1021;
+const size_t kRounds  = 5;
+
+/*
+ * NsPerKey - best of kRounds passes over the keys
+ */
+template<typename Hash, typename Key>
+double NsPerKey(const std::vector<Key>& keys)
+{
+  Hash hash;
+  double best = 1e9;
+  uint64_t sink = 0;
+  for (size_t r = 0; r < kRounds; ++r)
+  {
+    auto start = std::chrono::steady_clock::now();
+    for (auto&& key : keys) sink += hash(key);
+    auto end = std::chrono::steady_clock::now();
+    best = std::min(best, std::chrono::duration<double, std::nano>(end - start).count() / keys.size());
+  }
+  if (sink == 42) printf(" ");
+  return best;
+}
+
+struct IdentityHash {
+  uint64_t operator()(uint64_t key) const { return key; }
+};
+
+/*
+ * ChiSquare - of the keys over kBuckets buckets
+ */
+template<typename Hash>
+double ChiSquare(const std::vector<uint64_t>& keys)
+{
+  Hash hash;
+  std::vector<size_t> counts(kBuckets);
+  for (auto&& key : keys) ++counts[hash(key) % kBuckets];
+
+  double expected = keys.size() / (double)kBuckets;
+  double chi2 = 0;
+  for (auto count : counts) chi2 += (count - expected) * (count - expected) / expected;
+  return chi2;
+}
+
+template<template<typename> class Hash>
+void Report(
+    const char*                  name,
+    const std::vector<uint64_t>& keys8,
+    const std::vector<Key16>&    keys16,
+    const std::vector<uint64_t>& sequential)
+{
+  printf("%-20s %8.2f %13.2f %10.0f %10.0f\n", name,
+      NsPerKey<Hash<uint64_t>>(keys8),
+      NsPerKey<Hash<Key16>>(keys16),
+      ChiSquare<Hash<uint64_t>>(keys8),
+      ChiSquare<Hash<uint64_t>>(sequential));
+}
+
+/*
+ * ReportStrings - ns per string and chi^2 of the strings
+ */
+template<typename Hash>
+void ReportStrings(const char* name, const std::vector<std::string_view>& strings)
+{
+  std::vector<uint64_t> hashes;
+  Hash hash;
+  for (auto&& str : strings) hashes.push_back(hash(str));
+
+  printf("%-20s %8.2f %10.0f\n", name,
+      NsPerKey<Hash>(strings),
+      ChiSquare<IdentityHash>(hashes));
+}
+
+int main()
+{
+  std::mt19937_64 random(1);
+  std::vector<uint64_t> keys8(kKeys);
+  std::vector<Key16> keys16(kKeys);
+  std::vector<uint64_t> sequential(kKeys);
+  for (auto& key : keys8) key = random();
+  for (auto& key : keys16) key = {random(), random()};
+  for (size_t i = 0; i < kKeys; ++i) sequential[i] = i;
+
+  printf("%-20s %8s %13s %10s %10s\n", "", "uint64_t", "16-byte key", "chi^2", "chi^2 seq");
+  Report<UniHash>("UniHash", keys8, keys16, sequential);
+  Report<MultiplyShiftHash>("MultiplyShiftHash", keys8, keys16, sequential);
+  Report<MersenneHash>("MersenneHash", keys8, keys16, sequential);
+  Report<TabHash>("TabHash", keys8, keys16, sequential);
+  Report<TwistedTabHash>("TwistedTabHash", keys8, keys16, sequential);
+
+  std::vector<std::string> urls;
+  for (size_t i = 0; i < kKeys; ++i)
+    urls.push_back("https://example.org/catalog/item/" + std::to_string(i) + "?page=" + std::to_string(i % 97));
+  std::vector<std::string_view> views(urls.begin(), urls.end());
+
+  printf("\n%-20s %8s %10s\n", "", "URL", "chi^2");
+  ReportStrings<StringHash>("StringHash", views);
+  ReportStrings<std::hash<std::string_view>>("std::hash", views);
+}
@@ -0,0 +1,1865 @@
+//storage_model_test.cc
+
+#include "test_unit.h"
+//
+
+#include "buffered_file_storage.h"
+#include "checksummed_storage.h"
+#include "concurrent_inmemory_storage.h"
+#include "crc32c.h"
+#include "instrumented_storage.h"
+#include "mmap_storage.h"
+#include "shm_storage.h"
+#include "simulated_disk_storage.h"
+#include "snapshot_storage.h"
+#include "storage_model.h"
+#include "tiered_storage.h"
+#include "wal_storage.h"
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+//
+
+const size_t kPageSize  = 64;
+const size_t kNumPages  = 32;
+const size_t kNumFrames = 4;
+
+/*
+ * FillPage
+ *
+ * Writes a pattern depending on the address, so every page can be
+ * checked after a round trip through the storage.
+ */
+void
+FillPage(char* page, size_t address, size_t pageSize)
+{
+  for (size_t i = 0; i < pageSize; ++i) page[i] = (char)(address * 31 + i);
+}
+
+bool
+CheckPage(const char* page, size_t address, size_t pageSize)
+{
+  for (size_t i = 0; i < pageSize; ++i)
+  {
+    if (page[i] != (char)(address * 31 + i)) return false;
+  }
+  return true;
+}
+
+/*
+ * BufferedFileStorageTest
+ *
+ * Creates more pages than there are frames, so pages have to be
+ * evicted and read back from the file.
+ */
+class BufferedFileStorageTest : public TestBase {
+ public:
+  BufferedFileStorageTest() :
+    TestBase("BufferedFileStorageTest"),
+    path_("buffered_file_storage_test.dat"),
+    successes_(0), failures_(0) {}
+
+  void Run() override
+  {
+    std::remove(path_.c_str());
+
+    Eviction();
+    PinnedFrames();
+    Reopen();
+    WriteError();
+    BadFreeMap();
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+    std::remove(path_.c_str());
+    std::remove((path_ + ".fsm").c_str());
+  }
+
+ private:
+
+  void Eviction()
+  {
+    buffered_file_storage model(path_, kPageSize, kNumFrames);
+
+    for (size_t i = 0; i < kNumPages; ++i)
+    {
+      size_t address = model.create_page();
+      TEST(address == i);
+      char* page = model.load_page(address);
+      FillPage(page, address, kPageSize);
+      model.save_page(address, page);
+      model.release_page(address); //create_page pinned it too
+    }
+
+    TEST(model.get_page_count() == kNumPages);
+
+    for (size_t i = 0; i < kNumPages; ++i)
+    {
+      TEST(CheckPage(model.load_page(i), i, kPageSize));
+      model.release_page(i);
+    }
+  }
+
+  void PinnedFrames()
+  {
+    buffered_file_storage model(path_, kPageSize, kNumFrames);
+
+    for (size_t i = 0; i < kNumFrames; ++i) model.load_page(i);
+
+    bool thrown = false;
+    try { model.load_page(kNumFrames); }
+    catch (const std::runtime_error&) { thrown = true; }
+    TEST(thrown);
+
+    model.release_page(0);
+    TEST(CheckPage(model.load_page(kNumFrames), kNumFrames, kPageSize));
+  }
+
+  void Reopen()
+  {
+    buffered_file_storage model(path_, kPageSize, kNumFrames);
+
+    TEST(model.get_page_count() == kNumPages);
+
+    for (size_t i = 0; i < kNumPages; ++i)
+    {
+      TEST(CheckPage(model.load_page(i), i, kPageSize));
+      model.release_page(i);
+    }
+
+    //changed, but never saved: must not reach the file
+    std::memset(model.load_page(7), 0, kPageSize);
+    model.release_page(7);
+
+    for (size_t i = 8; i < 8 + 2*kNumFrames; ++i)
+    {
+      model.load_page(i);
+      model.release_page(i);
+    }
+
+    TEST(CheckPage(model.load_page(7), 7, kPageSize));
+    model.release_page(7);
+  }
+
+  /*
+   * Every write to /dev/full fails: flush reports it, the destructor
+   * must not.
+   */
+  void WriteError()
+  {
+    if (::access("/dev/full", W_OK) != 0) return;
+
+    bool thrown = false;
+    {
+      buffered_file_storage model("/dev/full", kPageSize, kNumFrames);
+      model.release_page(model.create_page());
+      try { model.flush(); }
+      catch (const std::runtime_error&) { thrown = true; }
+    }
+    TEST(thrown);
+  }
+
+  /*
+   * A free-space map which is not one makes the constructor throw; the
+   * lowest free descriptor is the same before and after.
+   */
+  void BadFreeMap()
+  {
+    std::ofstream(path_ + ".fsm") << "this is not a free-space map at all";
+    int before = dup(0);
+    close(before);
+    bool thrown = false;
+    try { buffered_file_storage model(path_, kPageSize, kNumFrames); }
+    catch (const std::runtime_error&) { thrown = true; }
+    int after = dup(0);
+    close(after);
+    TEST(thrown);
+    TEST(after == before);
+  }
+
+  std::string path_;
+  size_t      successes_;
+  size_t      failures_;
+};
+
+/*
+ * CheckpointTest
+ *
+ * A full checkpoint, two deltas, a restore, and a compaction.  The page
+ * size is not a multiple of a word, so record checksums cross words.
+ */
+class CheckpointTest : public TestBase {
+ public:
+  CheckpointTest() :
+    TestBase("CheckpointTest"),
+    path_("checkpoint_test.dat"),
+    successes_(0), failures_(0) {}
+
+  void Run() override
+  {
+    const size_t pageSize = 100;
+    std::remove(path_.c_str());
+    std::remove((path_ + ".delta").c_str());
+
+    unsafe_inmemory_storage model(pageSize);
+    model.set_checkpoint_compaction(0.1);
+    for (size_t i = 0; i < kNumPages; ++i)
+    {
+      FillPage(model.load_page(model.create_page()), i, pageSize);
+    }
+    TEST(model.get_dirty_page_count() == kNumPages);
+    TEST(model.checkpoint(path_) == kNumPages);
+    TEST(model.get_dirty_page_count() == 0);
+
+    Modify(model, 3, 4, pageSize);
+    Modify(model, 17, 18, pageSize);
+    TEST(model.checkpoint(path_) == 2);
+    TEST(model.checkpoint(path_) == 0);
+
+    size_t address = model.create_page();
+    FillPage(model.load_page(address), address, pageSize);
+    Modify(model, 3, 5, pageSize);
+    TEST(model.checkpoint(path_) == 2);
+
+    unsafe_inmemory_storage restored(pageSize);
+    restored.restore_checkpoint(path_);
+    TEST(Same(model, restored, pageSize));
+
+    //2 + 2 records are more than a tenth of the snapshot, so compact
+    Modify(model, 0, 6, pageSize);
+    TEST(model.checkpoint(path_) == kNumPages + 1);
+    TEST(!std::ifstream(path_ + ".delta"));
+
+    unsafe_inmemory_storage compacted(pageSize);
+    compacted.restore_checkpoint(path_);
+    TEST(Same(model, compacted, pageSize));
+    TEST(!std::ifstream(path_ + ".tmp"));
+
+    //a delta with a valid checksum but a page beyond its page count
+    AppendDelta(kNumPages + 1, kNumPages + 1, pageSize);
+    bool thrown = false;
+    try { compacted.restore_checkpoint(path_); }
+    catch (const std::runtime_error&) { thrown = true; }
+    TEST(thrown);
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+    std::remove(path_.c_str());
+    std::remove((path_ + ".delta").c_str());
+  }
+
+ private:
+  static void Modify(storage_model& model, size_t address, size_t pattern, size_t pageSize)
+  {
+    char* page = model.load_page(address);
+    FillPage(page, pattern, pageSize);
+    model.save_page(address, page);
+  }
+
+  //a delta of one record and an empty free list
+  void AppendDelta(uint64_t pageCount, uint64_t address, size_t pageSize)
+  {
+    std::vector<char> record(sizeof(address) + pageSize, 0);
+    std::memcpy(record.data(), &address, sizeof(address));
+    uint64_t freeList = 0;
+    uint64_t header[4] = {0, pageCount, 1, 0};
+    std::memcpy(header, "DOPDEL2", 8);
+    header[3] = page_checksum(page_checksum_seed, record.data(), record.size());
+    header[3] = page_checksum(header[3], (const char*)&freeList, sizeof(freeList));
+
+    std::ofstream stream(path_ + ".delta", std::ios::out | std::ios::binary | std::ios::app);
+    stream.write((const char*)header, sizeof(header));
+    stream.write(record.data(), record.size());
+    stream.write((const char*)&freeList, sizeof(freeList));
+  }
+
+  static bool Same(unsafe_inmemory_storage& l, unsafe_inmemory_storage& r, size_t pageSize)
+  {
+    size_t address = 0;
+    try
+    {
+      for (; ; ++address)
+      {
+        if (std::memcmp(l.load_page(address), r.load_page(address), pageSize)) return false;
+      }
+    }
+    catch (const std::out_of_range&) {}
+    return address == kNumPages + 1;
+  }
+
+  std::string path_;
+  size_t      successes_;
+  size_t      failures_;
+};
+
+/*
+ * AsyncLoadTest
+ *
+ * Loads a batch of pages through the given page_io_engine and waits
+ * for all callbacks.
+ */
+class AsyncLoadTest : public TestBase {
+ public:
+  AsyncLoadTest(bool useUring) :
+    TestBase(useUring ? "AsyncLoadTest (io_uring)" : "AsyncLoadTest (thread pool)"),
+    path_("async_load_test.dat"),
+    useUring_(useUring),
+    successes_(0), failures_(0) {}
+
+  void Run() override
+  {
+    std::remove(path_.c_str());
+    {
+      buffered_file_storage model(path_, kPageSize, kNumFrames);
+      for (size_t i = 0; i < kNumPages; ++i)
+      {
+        char* page = model.load_page(model.create_page());
+        FillPage(page, i, kPageSize);
+        model.save_page(i, page);
+        model.release_page(i);
+      }
+    }
+
+    buffered_file_storage model(path_, kPageSize, 2*kNumFrames);
+    if (useUring_) model.set_io_engine(
+        std::unique_ptr<page_io_engine>(new uring_io_engine(4)));
+    else model.set_io_engine(
+        std::unique_ptr<page_io_engine>(new thread_pool_io_engine(2)));
+
+    //the last address repeats the first, it must wait for the same read
+    std::vector<size_t> batch = {3, 9, 27, 1, 30, 12, 5, 3};
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t remaining = batch.size();
+
+    model.load_pages_async(batch.data(), batch.size(),
+        [&](size_t address, char* page) {
+          bool valid = page != nullptr && CheckPage(page, address, kPageSize);
+          std::lock_guard<std::mutex> lock(mutex);
+          TEST(valid);
+          --remaining;
+          done.notify_one();
+        });
+
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      done.wait(lock, [&remaining]() { return remaining == 0; });
+    }
+    for (size_t address : batch) model.release_page(address);
+
+    TEST(CheckPage(model.load_page_future(20).get(), 20, kPageSize));
+    model.release_page(20);
+
+    bool thrown = false;
+    try { model.load_page_future(kNumPages).get(); }
+    catch (const std::out_of_range&) { thrown = true; }
+    TEST(thrown);
+
+    FullPool(model);
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+    std::remove(path_.c_str());
+  }
+
+ private:
+  //all frames but one pinned: one page of the batch is read, the others
+  //come back as nullptr and must not stay reserved as loading
+  void FullPool(buffered_file_storage& model)
+  {
+    std::vector<size_t> pinned;
+    for (size_t i = 0; i + 1 < model.get_frame_count(); ++i)
+    {
+      model.load_page(i);
+      pinned.push_back(i);
+    }
+    std::vector<size_t> batch = {21, 22, 23};
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t remaining = batch.size();
+    std::vector<size_t> missing;
+    model.load_pages_async(batch.data(), batch.size(),
+        [&](size_t address, char* page) {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (page == nullptr) missing.push_back(address);
+          else if (!CheckPage(page, address, kPageSize)) missing.push_back(kNumPages);
+          --remaining;
+          done.notify_one();
+        });
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      done.wait(lock, [&remaining]() { return remaining == 0; });
+    }
+    TEST(missing.size() == batch.size() - 1);
+    for (size_t address : batch)
+    {
+      if (std::find(missing.begin(), missing.end(), address) == missing.end())
+        model.release_page(address);
+    }
+    for (size_t address : pinned) model.release_page(address);
+
+    for (size_t address : missing)
+    {
+      auto page = std::async(std::launch::async, [&model, address]() {
+        return model.load_page(address);
+      });
+      bool ready = page.wait_for(std::chrono::seconds(5)) == std::future_status::ready;
+      TEST(ready);
+      if (!ready) continue;
+      TEST(CheckPage(page.get(), address, kPageSize));
+      model.release_page(address);
+    }
+  }
+
+
+ private:
+  std::string path_;
+  bool        useUring_;
+  size_t      successes_;
+  size_t      failures_;
+};
+
+/*
+ * MmapStorageTest
+ *
+ * Uses an extent of a few pages so the mapping has to grow several
+ * times.
+ */
+class MmapStorageTest : public TestBase {
+ public:
+  MmapStorageTest() :
+    TestBase("MmapStorageTest"),
+    path_("mmap_storage_test.dat"),
+    successes_(0), failures_(0) {}
+
+  void Run() override
+  {
+    std::remove(path_.c_str());
+
+    {
+      mmap_storage model(path_, kPageSize, 3*kPageSize);
+
+      std::vector<char*> pages;
+      for (size_t i = 0; i < kNumPages; ++i)
+      {
+        size_t address = model.create_page();
+        TEST(address == i);
+        pages.push_back(model.load_page(address));
+        FillPage(pages.back(), address, kPageSize);
+      }
+      //growing must not move the pages loaded before
+      for (size_t i = 0; i < kNumPages; ++i)
+      {
+        TEST(model.load_page(i) == pages[i]);
+        TEST(CheckPage(pages[i], i, kPageSize));
+      }
+      model.sync();
+    }
+
+    {
+      mmap_storage model(path_, kPageSize);
+
+      TEST(model.get_page_count() == kNumPages);
+      for (size_t i = 0; i < kNumPages; ++i)
+      {
+        TEST(CheckPage(model.load_page(i), i, kPageSize));
+      }
+
+      bool thrown = false;
+      try { model.load_page(kNumPages); }
+      catch (const std::out_of_range&) { thrown = true; }
+      TEST(thrown);
+    }
+
+    //a file cut short of its page count, and a wrong page size, are
+    //rejected without leaking the descriptor
+    TEST(truncate(path_.c_str(), sysconf(_SC_PAGESIZE) + kNumPages / 2 * kPageSize) == 0);
+    TEST(Rejected(kPageSize));
+    TEST(Rejected(2 * kPageSize));
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+    std::remove(path_.c_str());
+  }
+
+ private:
+  //the lowest free descriptor is the same before and after
+  bool Rejected(size_t pageSize)
+  {
+    int before = dup(0);
+    close(before);
+    bool thrown = false;
+    try { mmap_storage model(path_, pageSize); }
+    catch (const std::runtime_error&) { thrown = true; }
+    int after = dup(0);
+    close(after);
+    return thrown && after == before;
+  }
+
+  std::string path_;
+  size_t      successes_;
+  size_t      failures_;
+};
+
+/*
+ * InmemorySnapshotTest
+ *
+ * The page pattern runs through every byte value, whitespace included.
+ */
+class InmemorySnapshotTest : public TestBase {
+ public:
+  InmemorySnapshotTest(size_t pageSize, size_t numPages) :
+    TestBase("InmemorySnapshotTest"),
+    path_("inmemory_snapshot_test.dat"),
+    pageSize_(pageSize), numPages_(numPages),
+    successes_(0), failures_(0) {}
+
+  void Run() override
+  {
+    {
+      unsafe_inmemory_storage model(pageSize_);
+      for (size_t i = 0; i < numPages_; ++i)
+      {
+        FillPage(model.load_page(model.create_page()), i, pageSize_);
+      }
+      model.save_to_file(path_);
+    }
+
+    unsafe_inmemory_storage model(pageSize_);
+    model.load_from_file(path_);
+    for (size_t i = 0; i < numPages_; ++i)
+    {
+      TEST(CheckPage(model.load_page(i), i, pageSize_));
+    }
+    TEST(model.create_page() == numPages_);
+
+    unsafe_inmemory_storage otherSize(pageSize_ * 2);
+    TEST(Throws([&]() { otherSize.load_from_file(path_); }));
+
+    Corrupt(path_, 100);
+    TEST(Throws([&]() { model.load_from_file(path_); }));
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+    std::remove(path_.c_str());
+  }
+
+ private:
+  static bool Throws(std::function<void()> f)
+  {
+    try { f(); }
+    catch (const std::runtime_error&) { return true; }
+    return false;
+  }
+
+  static void Corrupt(const std::string& path, long offset)
+  {
+    std::FILE* file = fopen(path.c_str(), "r+b");
+    fseek(file, offset, SEEK_SET);
+    int c = fgetc(file);
+    fseek(file, offset, SEEK_SET);
+    fputc(c ^ 0x20, file);
+    fclose(file);
+  }
+
+  std::string path_;
+  size_t      pageSize_;
+  size_t      numPages_;
+  size_t      successes_;
+  size_t      failures_;
+};
+
+/*
+ * WalStorageTest
+ *
+ * Replays a log into an empty storage, as after a crash which lost
+ * everything but the log, and commits from several threads at once.
+ */
+class WalStorageTest : public TestBase {
+ public:
+  WalStorageTest() :
+    TestBase("WalStorageTest"),
+    path_("wal_storage_test.wal"),
+    successes_(0), failures_(0) {}
+
+  void Run() override
+  {
+    std::remove(path_.c_str());
+
+    Recovery();
+    GroupCommit();
+    FailedCommit();
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+    std::remove(path_.c_str());
+  }
+
+ private:
+  void Recovery()
+  {
+    {
+      unsafe_inmemory_storage inner(kPageSize);
+      wal_storage model(&inner, path_);
+      for (size_t i = 0; i < kNumPages; ++i)
+      {
+        size_t address = model.create_page();
+        char* page = model.load_page(address);
+        FillPage(page, address, kPageSize);
+        model.save_page(address, page);
+      }
+      model.commit();
+
+      //logged, but never committed
+      char* page = model.load_page(5);
+      FillPage(page, 99, kPageSize);
+      model.save_page(5, page);
+      model.create_page();
+    }
+
+    //a record torn by the crash
+    std::FILE* file = fopen(path_.c_str(), "ab");
+    fputs("torn", file);
+    fclose(file);
+
+    unsafe_inmemory_storage restored(kPageSize);
+    {
+      wal_storage model(&restored, path_);
+      TEST(model.get_replayed_count() == 2*kNumPages + 1);
+      TEST(Same(restored));
+    }
+
+    //replaying into a storage which already has the pages changes nothing
+    wal_storage model(&restored, path_);
+    TEST(Same(restored));
+  }
+
+  void GroupCommit()
+  {
+    const size_t numThreads = 4;
+    const size_t numCommits = 50;
+
+    unsafe_inmemory_storage inner(kPageSize);
+    wal_storage model(&inner, path_);
+    model.truncate_log();
+    for (size_t i = 0; i < numThreads; ++i) model.create_page();
+    model.set_group_commit_delay(std::chrono::microseconds(200));
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < numThreads; ++i)
+    {
+      threads.emplace_back([&model, i, numCommits]() {
+        for (size_t j = 0; j < numCommits; ++j)
+        {
+          char* page = model.load_page(i);
+          model.update_page(i, page);
+          model.commit();
+        }
+      });
+    }
+    for (auto& thread : threads) thread.join();
+
+    TEST(model.get_sync_count() > 0);
+    TEST(model.get_sync_count() < numThreads * numCommits);
+
+    model.truncate_log();
+    unsafe_inmemory_storage empty(kPageSize);
+    TEST(wal_storage(&empty, path_).get_replayed_count() == 0);
+  }
+
+  //a file size limit makes the write of the second group fail; it runs
+  //in a child, so the limit does not stay on the test
+  void FailedCommit()
+  {
+    std::remove(path_.c_str());
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0)
+    {
+      int status = 0;
+      try
+      {
+        signal(SIGXFSZ, SIG_IGN);
+        unsafe_inmemory_storage inner(kPageSize);
+        wal_storage model(&inner, path_);
+        for (size_t i = 0; i < 4; ++i) model.create_page();
+        model.commit();
+        off_t durable = FileSize();
+
+        rlimit limit = {(rlim_t)durable + kPageSize, RLIM_INFINITY};
+        setrlimit(RLIMIT_FSIZE, &limit);
+        for (size_t i = 0; i < 4; ++i) model.update_page(i, model.load_page(i));
+        bool thrown = false;
+        try { model.commit(); }
+        catch (const std::runtime_error&) { thrown = true; }
+        if (!thrown || !model.is_failed()) status = 1;
+        if (FileSize() != durable) status = 2;
+
+        thrown = false;
+        try { model.commit(); }
+        catch (const std::runtime_error&) { thrown = true; }
+        if (!thrown) status = 3;
+
+        //room on the disk again; truncate_log logs the four pages anew
+        limit.rlim_cur = RLIM_INFINITY;
+        setrlimit(RLIMIT_FSIZE, &limit);
+        model.truncate_log();
+        model.create_page();
+        model.commit();
+        if (model.is_failed()) status = 4;
+      }
+      catch (...) { status = 5; }
+      _exit(status);
+    }
+    int status = -1;
+    waitpid(child, &status, 0);
+    TEST(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    //only the commit after truncate_log is in the log: the pages of the
+    //failed group, the created page and the commit record
+    unsafe_inmemory_storage restored(kPageSize);
+    wal_storage model(&restored, path_);
+    TEST(model.get_replayed_count() == 6);
+  }
+
+  off_t FileSize()
+  {
+    struct stat info;
+    return stat(path_.c_str(), &info) == 0 ? info.st_size : -1;
+  }
+
+  bool Same(unsafe_inmemory_storage& model)
+  {
+    for (size_t i = 0; i < kNumPages; ++i)
+    {
+      if (!CheckPage(model.load_page(i), i, kPageSize)) return false;
+    }
+    try { model.load_page(kNumPages); }
+    catch (const std::out_of_range&) { return true; }
+    return false;
+  }
+
+  std::string path_;
+  size_t      successes_;
+  size_t      failures_;
+};
+
+/*
+ * FreePageTest
+ *
+ * Frees a few pages, takes one back with create_page, and compacts the
+ * rest away; the free list has to survive a reopen.
+ */
+class FreePageTest : public TestBase {
+ public:
+  FreePageTest() :
+    TestBase("FreePageTest"),
+    path_("free_page_test.dat"),
+    freed_({2, 5, 9, 30}),
+    successes_(0), failures_(0) {}
+
+  void Run() override
+  {
+    Remove();
+    Inmemory();
+    Remove();
+    BufferedFile();
+    Remove();
+    Mmap();
+    Remove();
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+  }
+
+ private:
+  void Inmemory()
+  {
+    unsafe_inmemory_storage model(kPageSize);
+    Fill(model);
+    model.checkpoint(path_);
+    Free(model);
+    FreeTwice(model);
+    TEST(model.checkpoint(path_) == freed_.size());
+
+    unsafe_inmemory_storage restored(kPageSize);
+    restored.restore_checkpoint(path_);
+    TEST(restored.get_free_page_count() == freed_.size());
+
+    Reuse(model);
+    Compact(model);
+    TEST(model.get_page_count() == kNumPages - freed_.size() + 1);
+    TEST(model.get_free_page_count() == 0);
+  }
+
+  void BufferedFile()
+  {
+    {
+      buffered_file_storage model(path_, kPageSize, kNumFrames);
+      Fill(model);
+      Free(model);
+    }
+    buffered_file_storage model(path_, kPageSize, kNumFrames);
+    TEST(model.get_free_page_count() == freed_.size());
+    FreeTwice(model);
+
+    Reuse(model);
+
+    //the last page has to move but is pinned: nothing may change
+    size_t freeCount = model.get_free_page_count();
+    model.load_page(kNumPages - 1);
+    bool thrown = false;
+    try { model.compact([](size_t, size_t) {}); }
+    catch (const std::runtime_error&) { thrown = true; }
+    TEST(thrown);
+    TEST(model.get_page_count() == kNumPages);
+    TEST(model.get_free_page_count() == freeCount);
+    model.release_page(kNumPages - 1);
+
+    Compact(model);
+    TEST(model.get_page_count() == kNumPages - freed_.size() + 1);
+    TEST(std::ifstream(path_, std::ios::ate).tellg() ==
+         (std::streamoff)(model.get_page_count() * kPageSize));
+  }
+
+  void Mmap()
+  {
+    {
+      mmap_storage model(path_, kPageSize, 4*kPageSize);
+      Fill(model);
+      Free(model);
+    }
+    mmap_storage model(path_, kPageSize, 4*kPageSize);
+    FreeTwice(model);
+    Reuse(model);
+    Compact(model);
+    TEST(model.get_page_count() == kNumPages - freed_.size() + 1);
+    TEST(model.create_page() == model.get_page_count() - 1);
+  }
+
+  void Fill(storage_model& model)
+  {
+    for (size_t i = 0; i < kNumPages; ++i)
+    {
+      size_t address = model.create_page();
+      char* page = model.load_page(address);
+      FillPage(page, address, kPageSize);
+      model.save_page(address, page);
+      model.release_page(address);
+    }
+  }
+
+  void Free(storage_model& model)
+  {
+    for (size_t address : freed_) model.free_page(address);
+  }
+
+  //a second free would put a cycle in the free list
+  template<typename Model>
+  void FreeTwice(Model& model)
+  {
+    bool thrown = false;
+    try { model.free_page(*freed_.begin()); }
+    catch (const std::runtime_error&) { thrown = true; }
+    TEST(thrown);
+    TEST(model.get_free_page_count() == freed_.size());
+  }
+
+  void Reuse(storage_model& model)
+  {
+    size_t address = model.create_page();
+    TEST(freed_.count(address) == 1);
+    char* page = model.load_page(address);
+    TEST(std::all_of(page, page + kPageSize, [](char c) { return c == 0; }));
+    FillPage(page, address, kPageSize);
+    model.save_page(address, page);
+    model.release_page(address);
+    freed_.erase(address);
+  }
+
+  void Compact(storage_model& model)
+  {
+    std::map<size_t, size_t> moves;
+    size_t moved = model.compact([&moves](size_t from, size_t to) { moves[from] = to; });
+    TEST(moved == moves.size());
+
+    for (size_t i = 0; i < kNumPages; ++i)
+    {
+      if (freed_.count(i)) continue;
+      size_t address = moves.count(i) ? moves[i] : i;
+      TEST(CheckPage(model.load_page(address), i, kPageSize));
+      model.release_page(address);
+    }
+    freed_ = {2, 5, 9, 30};
+  }
+
+  void Remove()
+  {
+    std::remove(path_.c_str());
+    std::remove((path_ + ".delta").c_str());
+    std::remove((path_ + ".fsm").c_str());
+  }
+
+  std::string      path_;
+  std::set<size_t> freed_;
+  size_t           successes_;
+  size_t           failures_;
+};
+
+/*
+ * ChecksumTest
+ *
+ * Both CRC32C implementations against the reference value and each
+ * other, then corruption of an in-memory and a file-backed page.
+ */
+class ChecksumTest : public TestBase {
+ public:
+  ChecksumTest() :
+    TestBase("ChecksumTest"),
+    path_("checksum_test.dat"),
+    successes_(0), failures_(0) {}
+
+  void Run() override
+  {
+    Crc();
+    Inmemory();
+    BufferedFile();
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+    std::remove(path_.c_str());
+  }
+
+ private:
+  void Crc()
+  {
+    TEST(crc32c_software("123456789", 9) == 0xe3069283);
+    TEST(crc32c("123456789", 9) == 0xe3069283);
+
+    std::vector<char> data(1000);
+    FillPage(data.data(), 7, data.size());
+    for (size_t size : {0, 1, 7, 8, 9, 63, 1000})
+    {
+      TEST(crc32c_hardware(data.data(), size) == crc32c_software(data.data(), size));
+    }
+    uint32_t pieces = crc32c_software(data.data() + 13, 987, crc32c(data.data(), 13));
+    TEST(pieces == crc32c(data.data(), data.size()));
+  }
+
+  void Inmemory()
+  {
+    unsafe_inmemory_storage inner(kPageSize + checksummed_storage::trailer_size);
+    checksummed_storage model(&inner);
+    TEST(model.get_page_size() == kPageSize);
+    Fill(model);
+
+    for (size_t i = 0; i < kNumPages; ++i)
+    {
+      TEST(CheckPage(model.load_page(i), i, kPageSize));
+      model.release_page(i);
+    }
+
+    //readers pin the same pages at once; every pin is given back
+    std::atomic<size_t> bad(0);
+    std::vector<std::thread> readers;
+    for (size_t t = 0; t < 4; ++t)
+    {
+      readers.emplace_back([&]() {
+        for (size_t round = 0; round < 100; ++round)
+        {
+          for (size_t i = 0; i < kNumPages; ++i)
+          {
+            bad += !CheckPage(model.load_page(i), i, kPageSize);
+            model.release_page(i);
+          }
+        }
+      });
+    }
+    for (auto& reader : readers) reader.join();
+    TEST(bad == 0);
+    size_t verified = model.get_verified_count();
+    model.load_page(0);
+    model.release_page(0);
+    TEST(model.get_verified_count() == verified + 1);
+
+    //changed in place while pinned, not saved yet
+    char* page = model.load_page(4);
+    page[0] ^= 1;
+    model.load_page(4);
+    model.release_page(4);
+    model.save_page(4, page);
+
+    inner.load_page(3)[10] ^= 1;
+    TEST(Corrupted([&]() { model.load_page(3); }) == 3);
+
+
+    size_t batch[] = {1, 3, 5};
+    char*  pages[3];
+    TEST(Corrupted([&]() { model.load_pages(batch, 3, pages); }) == 3);
+
+    bool thrown = false;
+    try { model.load_page_future(3).get(); }
+    catch (const std::runtime_error&) { thrown = true; }
+    TEST(thrown);
+
+    ConcurrentCheck();
+  }
+
+  //a load which pins a page while another one verifies it must not use
+  //the page before the check has failed; a large page keeps the check
+  //long enough for the loads to overlap
+  void ConcurrentCheck()
+  {
+    const size_t pageSize = 1 << 20;
+    unsafe_inmemory_storage inner(pageSize + checksummed_storage::trailer_size);
+    checksummed_storage model(&inner);
+    model.release_page(model.create_page());
+    inner.load_page(0)[10] ^= 1;
+
+    std::atomic<size_t> used(0);
+    std::vector<std::thread> readers;
+    for (size_t t = 0; t < 4; ++t)
+    {
+      readers.emplace_back([&]() {
+        for (size_t round = 0; round < 50; ++round)
+        {
+          if (Corrupted([&]() { model.load_page(0); }) == 0) continue;
+          ++used;
+          model.release_page(0);
+        }
+      });
+    }
+    for (auto& reader : readers) reader.join();
+    TEST(used == 0);
+  }
+
+  void BufferedFile()
+  {
+    std::remove(path_.c_str());
+    {
+      buffered_file_storage inner(path_, kPageSize + checksummed_storage::trailer_size, kNumFrames);
+      checksummed_storage model(&inner);
+      Fill(model);
+    }
+
+    std::FILE* file = fopen(path_.c_str(), "r+b");
+    fseek(file, 20 * (kPageSize + checksummed_storage::trailer_size) + 1, SEEK_SET);
+    fputc(0x55, file);
+    fclose(file);
+
+    buffered_file_storage inner(path_, kPageSize + checksummed_storage::trailer_size, kNumFrames);
+    checksummed_storage model(&inner);
+    TEST(CheckPage(model.load_page(19), 19, kPageSize));
+    model.release_page(19);
+    TEST(Corrupted([&]() { model.load_page(20); }) == 20);
+    TEST(model.get_verified_count() == 2);
+  }
+
+  static void Fill(storage_model& model)
+  {
+    for (size_t i = 0; i < kNumPages; ++i)
+    {
+      size_t address = model.create_page();
+      char* page = model.load_page(address);
+      FillPage(page, address, kPageSize);
+      model.save_page(address, page);
+      model.release_page(address);
+    }
+  }
+
+  static size_t Corrupted(std::function<void()> f)
+  {
+    try { f(); }
+    catch (const page_corruption_error& e) { return e.get_address(); }
+    return SIZE_MAX;
+  }
+
+  std::string path_;
+  size_t      successes_;
+  size_t      failures_;
+};
+
+/*
+ * ConcurrentStorageTest
+ *
+ * Threads create and fill pages at the same time, then all threads read
+ * all pages.  Segments are small, so many of them are raced for.
+ */
+class ConcurrentStorageTest : public TestBase {
+ public:
+  ConcurrentStorageTest() :
+    TestBase("ConcurrentStorageTest"),
+    successes_(0), failures_(0) {}
+
+  void Run() override
+  {
+    const size_t pageSize   = 1 << 16;
+    const size_t numThreads = 4;
+    const size_t numCreated = 200;
+
+    concurrent_inmemory_storage model(pageSize);
+    std::vector<std::vector<size_t>> created(numThreads);
+
+    RunThreads(numThreads, [&](size_t thread) {
+      for (size_t i = 0; i < numCreated; ++i)
+      {
+        size_t address = model.create_page();
+        FillPage(model.load_page(address), address, pageSize);
+        created[thread].push_back(address);
+      }
+    });
+
+    std::set<size_t> addresses;
+    for (auto& list : created) addresses.insert(list.begin(), list.end());
+    TEST(addresses.size() == numThreads * numCreated);
+    TEST(model.get_page_count() == numThreads * numCreated);
+
+    std::vector<size_t> valid(numThreads, 0);
+    RunThreads(numThreads, [&](size_t thread) {
+      for (size_t address = 0; address < numThreads * numCreated; ++address)
+      {
+        valid[thread] += CheckPage(model.load_page(address), address, pageSize);
+      }
+    });
+    for (size_t count : valid) TEST(count == numThreads * numCreated);
+
+    model.free_page(7);
+    TEST(model.get_free_page_count() == 1);
+    bool freeTwice = false;
+    try { model.free_page(7); }
+    catch (const std::runtime_error&) { freeTwice = true; }
+    TEST(freeTwice);
+    TEST(model.get_free_page_count() == 1);
+    TEST(model.create_page() == 7);
+    char* reused = model.load_page(7);
+    TEST(std::all_of(reused, reused + pageSize, [](char c) { return c == 0; }));
+    TEST(model.create_page() == numThreads * numCreated);
+
+    bool thrown = false;
+    try { model.load_page(numThreads * numCreated + 1); }
+    catch (const std::out_of_range&) { thrown = true; }
+    TEST(thrown);
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+  }
+
+ private:
+  static void RunThreads(size_t numThreads, std::function<void(size_t)> f)
+  {
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < numThreads; ++i) threads.emplace_back(f, i);
+    for (auto& thread : threads) thread.join();
+  }
+
+  size_t successes_;
+  size_t failures_;
+};
+
+/*
+ * InstrumentedStorageTest
+ *
+ * Bucket bounds of the histogram, then the counters of a short run of
+ * calls and of the difference of two snapshots.
+ */
+class InstrumentedStorageTest : public TestBase {
+ public:
+  InstrumentedStorageTest() :
+    TestBase("InstrumentedStorageTest"),
+    successes_(0), failures_(0) {}
+
+  void Run() override
+  {
+    Histogram();
+    Counters();
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+  }
+
+ private:
+  using Stats = instrumented_storage::storage_stats;
+
+  void Histogram()
+  {
+    bool bounded = true;
+    for (uint64_t value : {0ul, 1ul, 7ul, 15ul, 16ul, 17ul, 1000ul, 123456789ul, UINT64_MAX})
+    {
+      size_t bucket = histogram_snapshot::bucket_of(value);
+      bounded &= bucket < histogram_snapshot::bucket_count;
+      bounded &= value <= histogram_snapshot::bucket_limit(bucket);
+      bounded &= bucket == 0 || value > histogram_snapshot::bucket_limit(bucket - 1);
+    }
+    TEST(bounded);
+
+    latency_histogram histogram;
+    for (uint64_t value = 1; value <= 100; ++value) histogram.record(value);
+    histogram_snapshot snapshot = histogram.snapshot();
+    TEST(snapshot.count == 100);
+    TEST(snapshot.max == 100);
+    TEST(snapshot.mean() == 50.5);
+    //within one sub-bucket, an eighth
+    TEST(snapshot.percentile(0.5) >= 50 && snapshot.percentile(0.5) <= 50 + 50/8);
+    TEST(snapshot.percentile(1.0) == 100);
+  }
+
+  void Counters()
+  {
+    unsafe_inmemory_storage inner(kPageSize);
+    instrumented_storage model(&inner);
+
+    for (size_t i = 0; i < 4; ++i) model.create_page();
+    for (size_t i = 0; i < 3; ++i)
+    {
+      model.load_page(i);
+      model.release_page(i);
+    }
+    Stats before = model.snapshot();
+
+    size_t batch[] = {0, 1, 2, 3};
+    char*  pages[4];
+    model.load_pages(batch, 4, pages);
+    model.save_page(1, pages[1]);
+
+    Stats after = model.snapshot();
+    Stats difference = after - before;
+    TEST(after[instrumented_storage::op_create].calls == 4);
+    TEST(after[instrumented_storage::op_load].calls == 7);
+    TEST(difference[instrumented_storage::op_load].calls == 4);
+    TEST(difference[instrumented_storage::op_load].bytes == 4 * kPageSize);
+    TEST(difference[instrumented_storage::op_load].latency.count == 4);
+    TEST(difference[instrumented_storage::op_save].calls == 1);
+    TEST(difference[instrumented_storage::op_release].calls == 0);
+    TEST(after[instrumented_storage::op_release].calls == 3);
+
+    std::ostringstream dump;
+    model.dump(dump);
+    TEST(dump.str().find("load") != std::string::npos);
+    TEST(dump.str().find("free") == std::string::npos);
+
+    model.reset();
+    TEST(model.snapshot()[instrumented_storage::op_load].calls == 0);
+  }
+
+  size_t successes_;
+  size_t failures_;
+};
+
+/*
+ * SimulatedDiskTest
+ *
+ * A seek costs 1000 ns and a page transfer 100 ns; the cache holds two
+ * pages.  The expected times are worked out in the comments.
+ */
+class SimulatedDiskTest : public TestBase {
+ public:
+  SimulatedDiskTest() :
+    TestBase("SimulatedDiskTest"),
+    successes_(0), failures_(0) {}
+
+  void Run() override
+  {
+    disk_model disk = {std::chrono::nanoseconds(1000), kPageSize * 10000000};
+    simulated_disk_storage model(kPageSize, 2, disk);
+
+    for (size_t i = 0; i < 4; ++i) model.create_page();
+    //0 and 1 evicted dirty: seek + 2 transfers
+    TEST(Elapsed(model) == 1200);
+    TEST(model.get_write_count() == 2);
+
+    model.flush();
+    //2 and 3 continue after 1
+    TEST(Elapsed(model) == 1400);
+    TEST(model.get_seek_count() == 1);
+
+    model.load_page(0);
+    model.load_page(0);
+    model.load_page(1);
+    //0 is a seek back, 1 follows it, the second load of 0 is a hit
+    TEST(Elapsed(model) == 2600);
+    TEST(model.get_read_count() == 2);
+    TEST(model.get_hit_count() == 1);
+
+    model.reset_stats();
+    size_t batch[] = {3, 2};
+    model.prefetch_pages(batch, 2);
+    model.load_page(2);
+    model.load_page(3);
+    //read in order after 1, without a seek; the loads are hits
+    TEST(Elapsed(model) == 200);
+    TEST(model.get_seek_count() == 0);
+    TEST(model.get_hit_count() == 2);
+
+    simulated_disk_storage hdd(4096, 16, disk_model::hdd());
+    simulated_disk_storage ssd(4096, 16, disk_model::ssd());
+    for (simulated_disk_storage* device : {&hdd, &ssd})
+    {
+      for (size_t i = 0; i < 64; ++i) device->create_page();
+      device->flush();
+      for (size_t i = 0; i < 64; ++i) device->load_page(i * 7 % 64);
+    }
+    TEST(hdd.get_elapsed() > 10 * ssd.get_elapsed());
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+  }
+
+ private:
+  static long Elapsed(const simulated_disk_storage& model)
+  {
+    return (long)model.get_elapsed().count();
+  }
+
+  size_t successes_;
+  size_t failures_;
+};
+
+/*
+ * TieredStorageTest
+ *
+ * Four hot pages over a file; four pages are accessed far more often
+ * than the others and have to end up hot.  A changed hot page must reach
+ * the file.
+ */
+class TieredStorageTest : public TestBase {
+ public:
+  TieredStorageTest() :
+    TestBase("TieredStorageTest"),
+    path_("tiered_storage_test.dat"),
+    successes_(0), failures_(0) {}
+
+  void Run() override
+  {
+    const size_t numPages = 16;
+    const size_t numHot   = 4;
+    std::remove(path_.c_str());
+
+    {
+      buffered_file_storage cold(path_, kPageSize, kNumFrames);
+      tiered_storage model(&cold, numHot);
+
+      for (size_t i = 0; i < numPages; ++i)
+      {
+        size_t address = model.create_page();
+        char* page = model.load_page(address);
+        FillPage(page, address, kPageSize);
+        model.save_page(address, page);
+        model.release_page(address);
+      }
+      TEST(model.get_hot_page_count() == numHot);
+
+      for (size_t round = 0; round < 20; ++round)
+      {
+        for (size_t i = 10; i < 10 + numHot; ++i)
+        {
+          for (size_t j = 0; j < 3; ++j) Touch(model, i);
+        }
+        Touch(model, round % numPages);
+      }
+      bool hot = true;
+      for (size_t i = 10; i < 10 + numHot; ++i) hot &= model.is_hot(i);
+      TEST(hot);
+      TEST(model.get_demotion_count() >= numHot);
+      TEST(model.get_hot_hit_count() > 200);
+
+      char* page = model.load_page(11);
+      FillPage(page, 99, kPageSize);
+      model.save_page(11, page);
+
+      bool valid = true;
+      for (size_t i = 0; i < numPages; ++i)
+      {
+        valid &= CheckPage(model.load_page(i), i == 11 ? 99 : i, kPageSize);
+        model.release_page(i);
+      }
+      TEST(valid);
+    }
+
+    buffered_file_storage cold(path_, kPageSize, kNumFrames);
+    bool valid = true;
+    for (size_t i = 0; i < numPages; ++i)
+    {
+      valid &= CheckPage(cold.load_page(i), i == 11 ? 99 : i, kPageSize);
+      cold.release_page(i);
+    }
+    TEST(valid);
+
+    WriteError();
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+    std::remove(path_.c_str());
+  }
+
+ private:
+  /*
+   * A cold tier whose writes fail: flush reports it, the destructor
+   * must not.
+   */
+  class FailingStorage : public storage_decorator {
+   public:
+    FailingStorage(storage_model* inner) : storage_decorator(inner) {}
+    void save_page(size_t address, char* page)
+    {
+      inner->release_page(address);
+      throw std::runtime_error("FailingStorage: save_page");
+    }
+  };
+
+  void WriteError()
+  {
+    unsafe_inmemory_storage memory(kPageSize);
+    FailingStorage cold(&memory);
+    bool thrown = false;
+    {
+      tiered_storage model(&cold, 2);
+      size_t address = model.create_page();
+      char* page = model.load_page(address);
+      model.save_page(address, page);
+      model.release_page(address);
+      try { model.flush(); }
+      catch (const std::runtime_error&) { thrown = true; }
+    }
+    TEST(thrown);
+  }
+
+  static void Touch(storage_model& model, size_t address)
+  {
+    model.load_page(address);
+    model.release_page(address);
+  }
+
+  std::string path_;
+  size_t      successes_;
+  size_t      failures_;
+};
+
+/*
+ * SnapshotStorageTest
+ *
+ * Changes pages under two snapshots and checks that each snapshot keeps
+ * reading the pages as they were when it was taken.
+ */
+class SnapshotStorageTest : public TestBase {
+ public:
+  SnapshotStorageTest() :
+    TestBase("SnapshotStorageTest"),
+    successes_(0), failures_(0) {}
+
+  void Run() override
+  {
+    unsafe_inmemory_storage inner(kPageSize);
+    snapshot_storage model(&inner);
+
+    for (size_t i = 0; i < kNumPages; ++i)
+    {
+      size_t address = model.create_page();
+      char* page = model.load_page(address);
+      FillPage(page, address, kPageSize);
+      model.save_page(address, page);
+    }
+    TEST(model.get_preserved_page_count() == 0);
+
+    snapshot_storage::snapshot_id first = model.take_snapshot();
+    Write(model, 2, 50);
+    TEST(CheckPage(model.load_snapshot_page(first, 2), 2, kPageSize));
+    TEST(CheckPage(ReadLive(model, 2), 50, kPageSize));
+
+    // Read through the snapshot before the change.
+    const char* before = model.load_snapshot_page(first, 3);
+    Write(model, 3, 51);
+    TEST(CheckPage(before, 3, kPageSize));
+    TEST(model.load_snapshot_page(first, 3) == before);
+    TEST(model.get_preserved_page_count() == 2);
+
+    // One copy per snapshot, however often the page is changed.
+    Write(model, 2, 52);
+    TEST(model.get_preserved_page_count() == 2);
+
+    snapshot_storage::snapshot_id second = model.take_snapshot();
+    Write(model, 2, 60);
+    TEST(CheckPage(model.load_snapshot_page(first, 2), 2, kPageSize));
+    TEST(CheckPage(model.load_snapshot_page(second, 2), 52, kPageSize));
+    TEST(CheckPage(model.load_snapshot_page(second, 3), 51, kPageSize));
+    TEST(CheckPage(model.load_snapshot_page(second, 4), 4, kPageSize));
+    TEST(CheckPage(ReadLive(model, 2), 60, kPageSize));
+
+    model.release_snapshot(first);
+    TEST(model.get_snapshot_count() == 1);
+    TEST(model.get_preserved_page_count() == 3);
+    TEST(CheckPage(model.load_snapshot_page(second, 2), 52, kPageSize));
+
+    bool thrown = false;
+    try { model.load_snapshot_page(first, 2); }
+    catch (const std::out_of_range&) { thrown = true; }
+    TEST(thrown);
+    TEST(model.compact([](size_t, size_t) {}) == 0);
+
+    model.release_snapshot(second);
+    TEST(model.get_preserved_page_count() == 0);
+    Write(model, 5, 70);
+    TEST(model.get_preserved_page_count() == 0);
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+  }
+
+ private:
+  static void Write(storage_model& model, size_t address, size_t pattern)
+  {
+    char* page = model.load_page(address);
+    FillPage(page, pattern, kPageSize);
+    model.save_page(address, page);
+  }
+
+  static const char* ReadLive(storage_model& model, size_t address)
+  {
+    char* page = model.load_page(address);
+    model.release_page(address);
+    return page;
+  }
+
+  size_t successes_;
+  size_t failures_;
+};
+
+/*
+ * ShmStorageTest
+ *
+ * A writer fills pages of a shared memory object and a forked reader
+ * process attaches to it and checks them; the exit status carries the
+ * result back.
+ */
+class ShmStorageTest : public TestBase {
+ public:
+  ShmStorageTest() :
+    TestBase("ShmStorageTest"),
+    name_("/data_org_project_shm_test"),
+    successes_(0), failures_(0) {}
+
+  void Run() override
+  {
+    shm_storage::remove(name_);
+    shm_storage model(name_, kPageSize, kNumPages);
+    TEST(model.is_writer());
+
+    for (size_t i = 0; i < kNumPages; ++i)
+    {
+      size_t address = model.create_page();
+      char* page = model.load_page(address);
+      FillPage(page, address, kPageSize);
+      model.save_page(address, page);
+    }
+    bool full = false;
+    try { model.create_page(); }
+    catch (const std::bad_alloc&) { full = true; }
+    TEST(full);
+
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0)
+    {
+      int status = 0;
+      try
+      {
+        shm_storage reader(name_);
+        if (reader.is_writer() || reader.get_page_size() != kPageSize) status = 1;
+        for (size_t i = 0; i < kNumPages; ++i)
+        {
+          if (!CheckPage(reader.load_page(i), i, kPageSize)) status = 2;
+        }
+        bool refused = false;
+        try { reader.create_page(); }
+        catch (const std::runtime_error&) { refused = true; }
+        if (!refused) status = 3;
+      }
+      catch (...) { status = 4; }
+      _exit(status);
+    }
+    int status = -1;
+    waitpid(child, &status, 0);
+    TEST(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // A second writer shares the pages and the free list.
+    {
+      shm_storage other(name_, kPageSize, kNumPages);
+      other.free_page(7);
+      TEST(other.get_page_count() == kNumPages);
+    }
+    //the free bits are shared: a second free from the first writer fails
+    bool freeTwice = false;
+    try { model.free_page(7); }
+    catch (const std::runtime_error&) { freeTwice = true; }
+    TEST(freeTwice);
+    TEST(model.create_page() == 7);
+    char* reused = model.load_page(7);
+    TEST(std::all_of(reused, reused + kPageSize, [](char c) { return c == 0; }));
+    TEST(CheckPage(model.load_page(8), 8, kPageSize));
+
+    bool mismatch = false;
+    try { shm_storage wrong(name_, kPageSize * 2, kNumPages); }
+    catch (const std::runtime_error&) { mismatch = true; }
+    TEST(mismatch);
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+    shm_storage::remove(name_);
+  }
+
+ private:
+  std::string name_;
+  size_t      successes_;
+  size_t      failures_;
+};
+
+/*
+ * HugePageTest
+ *
+ * Fills more than one huge-page slab and round-trips it through a
+ * snapshot.  Whether the kernel grants huge pages depends on the
+ * machine, so their coverage is only checked for consistency.
+ */
+class HugePageTest : public TestBase {
+ public:
+  HugePageTest() :
+    TestBase("HugePageTest"),
+    path_("huge_page_test.dat"),
+    successes_(0), failures_(0) {}
+
+  void Run() override
+  {
+    const size_t numPages = 40000;
+    const size_t hugePageSize = 2 << 20;
+
+    unsafe_inmemory_storage model(kPageSize);
+    model.use_huge_pages(true);
+    TEST(model.uses_huge_pages());
+    for (size_t i = 0; i < numPages; ++i)
+    {
+      size_t address = model.create_page();
+      char* page = model.load_page(address);
+      FillPage(page, address, kPageSize);
+      model.save_page(address, page);
+    }
+    TEST((uintptr_t)model.load_page(0) % hugePageSize == 0);
+    TEST(model.get_allocated_bytes() == 2 * hugePageSize);
+    TEST(model.get_huge_page_bytes() <= model.get_allocated_bytes());
+
+    bool refused = false;
+    try { model.use_huge_pages(); }
+    catch (const std::runtime_error&) { refused = true; }
+    TEST(refused);
+
+    model.save_to_file(path_);
+    unsafe_inmemory_storage restored(kPageSize);
+    restored.use_huge_pages();
+    restored.load_from_file(path_);
+    bool valid = true;
+    for (size_t i = 0; i < numPages; ++i)
+    {
+      valid &= CheckPage(restored.load_page(i), i, kPageSize);
+    }
+    TEST(valid);
+    TEST(restored.get_allocated_bytes() % hugePageSize == 0);
+
+    unsafe_inmemory_storage plain(kPageSize);
+    plain.create_page();
+    TEST(plain.get_huge_page_bytes() == 0);
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+    std::remove(path_.c_str());
+  }
+
+ private:
+  std::string path_;
+  size_t      successes_;
+  size_t      failures_;
+};
+
+/*
+ * BackgroundFlushTest
+ *
+ * Writes pages with the background flusher running and checks that
+ * they reach the file without flush, and that a page pinned while it is
+ * changed is written only after its release.
+ */
+class BackgroundFlushTest : public TestBase {
+ public:
+  BackgroundFlushTest() :
+    TestBase("BackgroundFlushTest"),
+    path_("background_flush_test.dat"),
+    successes_(0), failures_(0) {}
+
+  void Run() override
+  {
+    const size_t numFrames = 16;
+    std::remove(path_.c_str());
+
+    buffered_file_storage model(path_, kPageSize, numFrames);
+    model.set_dirty_limits(0.25, 0.5);
+    model.start_flusher(4, std::chrono::milliseconds(5));
+
+    for (size_t i = 0; i < kNumPages; ++i)
+    {
+      size_t address = model.create_page();
+      char* page = model.load_page(address);
+      FillPage(page, address, kPageSize);
+      model.save_page(address, page);
+      model.release_page(address);
+    }
+    TEST(WaitClean(model));
+    TEST(model.get_background_write_count() > 0);
+    TEST(FileMatches(kNumPages, 3, 3));
+
+    char* page = model.load_page(3);
+    FillPage(page, 90, kPageSize);
+    model.update_page(3, page);
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    TEST(model.get_dirty_page_count() == 1);
+    model.release_page(3);
+    TEST(WaitClean(model));
+    TEST(FileMatches(kNumPages, 3, 90));
+
+    model.stop_flusher();
+    page = model.load_page(4);
+    model.save_page(4, page);
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    TEST(model.get_dirty_page_count() == 1);
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+    std::remove(path_.c_str());
+    std::remove((path_ + ".fsm").c_str());
+  }
+
+ private:
+  static bool WaitClean(buffered_file_storage& model)
+  {
+    for (size_t i = 0; i < 1000 && model.get_dirty_page_count() > 0; ++i)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return model.get_dirty_page_count() == 0;
+  }
+
+  // Reads the file directly; the page at changed holds pattern.
+  bool FileMatches(size_t numPages, size_t changed, size_t pattern)
+  {
+    std::ifstream stream(path_, std::ios::in | std::ios::binary);
+    std::vector<char> page(kPageSize);
+    for (size_t i = 0; i < numPages; ++i)
+    {
+      if (!stream.read(page.data(), kPageSize)) return false;
+      if (!CheckPage(page.data(), i == changed ? pattern : i, kPageSize)) return false;
+    }
+    return true;
+  }
+
+  std::string path_;
+  size_t      successes_;
+  size_t      failures_;
+};
+
+/*
+ * PageHandleTest
+ *
+ * Pins every frame through handles and checks that the pins are given
+ * back when the handles are reset, moved over or saved.
+ */
+class PageHandleTest : public TestBase {
+ public:
+  PageHandleTest() :
+    TestBase("PageHandleTest"),
+    path_("page_handle_test.dat"),
+    successes_(0), failures_(0) {}
+
+  void Run() override
+  {
+    std::remove(path_.c_str());
+    buffered_file_storage model(path_, kPageSize, kNumFrames);
+    for (size_t i = 0; i < kNumPages; ++i)
+    {
+      TEST(model.create_page() == i);
+      page_handle page = model.pin_page(i);
+      FillPage(page.get(), i, kPageSize);
+      page.save();
+      TEST(!page);
+      model.release_page(i); // create_page pinned it too
+    }
+
+    {
+      std::vector<page_handle> pinned;
+      for (size_t i = 0; i < kNumFrames; ++i) pinned.push_back(model.pin_page(i));
+      TEST(Pinned(model, kNumFrames));
+
+      page_handle moved = std::move(pinned[0]);
+      TEST(!pinned[0] && moved.get_address() == 0);
+      TEST(Pinned(model, kNumFrames));
+
+      moved.reset();
+      TEST(!Pinned(model, kNumFrames));
+
+      char* page = pinned[1].get();
+      FillPage(page, 77, kPageSize);
+      pinned[1].update();
+    }
+    TEST(!Pinned(model, kNumFrames + 1));
+
+    bool valid = true;
+    for (size_t i = 0; i < kNumPages; ++i)
+    {
+      page_handle page = model.pin_page(i);
+      valid &= CheckPage(page.get(), i == 1 ? 77 : i, kPageSize);
+    }
+    TEST(valid);
+
+    char* detached = model.pin_page(2).detach();
+    TEST(CheckPage(detached, 2, kPageSize));
+    model.release_page(2);
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+    std::remove(path_.c_str());
+  }
+
+ private:
+  // Whether loading the given page fails because every frame is pinned.
+  static bool Pinned(storage_model& model, size_t address)
+  {
+    try { model.pin_page(address); }
+    catch (const std::runtime_error&) { return true; }
+    return false;
+  }
+
+  std::string path_;
+  size_t      successes_;
+  size_t      failures_;
+};
+
+int main(int argc, char** argv) {
+  TestSuite testSuite;
+
+  testSuite.RegisterTest<BufferedFileStorageTest>();
+  testSuite.RegisterTest<CheckpointTest>();
+  testSuite.RegisterTest<AsyncLoadTest>(true);
+  testSuite.RegisterTest<AsyncLoadTest>(false);
+  testSuite.RegisterTest<MmapStorageTest>();
+  testSuite.RegisterTest<InmemorySnapshotTest>(kPageSize, kNumPages);
+  testSuite.RegisterTest<InmemorySnapshotTest>(100, 20000);
+  testSuite.RegisterTest<WalStorageTest>();
+  testSuite.RegisterTest<FreePageTest>();
+  testSuite.RegisterTest<ChecksumTest>();
+  testSuite.RegisterTest<ConcurrentStorageTest>();
+  testSuite.RegisterTest<InstrumentedStorageTest>();
+  testSuite.RegisterTest<SimulatedDiskTest>();
+  testSuite.RegisterTest<TieredStorageTest>();
+  testSuite.RegisterTest<SnapshotStorageTest>();
+  testSuite.RegisterTest<ShmStorageTest>();
+  testSuite.RegisterTest<HugePageTest>();
+  testSuite.RegisterTest<BackgroundFlushTest>();
+  testSuite.RegisterTest<PageHandleTest>();
+  testSuite.Run();
+}
@@ -0,0 +1,659 @@
+//table_test.cc
+
+#include "test_unit.h"
+//
+
+#include "btree_storage_model.h"
+#include "buffered_file_storage.h"
+#include "concurrent_inmemory_storage.h"
+#include "fagin.h"
+#include "larson_kalja.h"
+#include "mmap_storage.h"
+#include "shm_storage.h"
+#include "snapshot_storage.h"
+#include "storage_model.h"
+#include "string_hash.h"
+#include "wal_storage.h"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+//
+
+using namespace data_org_project_names;
+
+using Key  = size_t;
+using Data = size_t;
+
+const size_t kPageSize  = 256;
+const size_t kNumKeys   = 2000;
+const size_t kNumFrames = 16;
+//LkTable does not grow, these hold kNumKeys at about half load
+const size_t kNumLkPages = 512;
+
+/*
+ * TableTest
+ *
+ * Runs LkTable, FaginTable and Btree on one storage backend.  Every
+ * table gets the same random keys; they have to be found again and
+ * visited exactly once by the iterators, in both directions.  Then a
+ * part of them is erased and the storage is compacted, which must not
+ * lose the others.
+ */
+class TableTest : public TestBase {
+ public:
+  TableTest(const string& name) :
+    TestBase(name),
+    path_("table_test.dat"),
+    successes_(0), failures_(0)
+  {
+    std::mt19937_64 random(1);
+    //the keys are below 8 * kNumKeys
+    while (verifier_.size() < kNumKeys) verifier_[random() % (8 * kNumKeys)] = random();
+  }
+
+ protected:
+  /*
+   * Check
+   */
+  template<typename Table>
+  void Check(Table& table)
+  {
+    for (auto&& entry : verifier_) table.insert(entry.first, entry.second + 1);
+    for (auto&& entry : verifier_) table.insert(entry.first, entry.second);
+
+    TEST(table.size() == verifier_.size());
+    TEST(Found(table) == verifier_.size());
+    TEST(Visited(table) == verifier_.size());
+    TEST(VisitedBackwards(table) == verifier_.size());
+
+    std::map<Key, Data> kept;
+    size_t index = 0;
+    for (auto&& entry : verifier_)
+    {
+      if (index++ % 3 == 0) kept.insert(entry);
+      else TEST(table.erase(entry.first));
+    }
+    TEST(!table.erase(8 * kNumKeys));
+
+    table.Compact();
+
+    TEST(table.size() == kept.size());
+    TEST(Found(table) == kept.size());
+    TEST(Visited(table) == kept.size());
+    TEST(VisitedBackwards(table) == kept.size());
+  }
+  /*
+   * Found - number of keys found with their data
+   */
+  template<typename Table>
+  size_t Found(const Table& table)
+  {
+    return Found(table, verifier_);
+  }
+  template<typename Table>
+  size_t Found(const Table& table, const std::map<Key, Data>& entries)
+  {
+    size_t found = 0;
+    for (auto&& entry : entries)
+    {
+      auto result = table.find(entry.first);
+      if (result.first && result.second == entry.second) ++found;
+    }
+    return found;
+  }
+  /*
+   * Visited - number of entries of the table found in the verifier, -1
+   * if the iterator returns one twice
+   */
+  template<typename Table>
+  size_t Visited(const Table& table)
+  {
+    std::map<Key, Data> visited;
+    for (auto&& entry : table)
+    {
+      if (visited.count(entry.key) || !verifier_.count(entry.key)) return -1;
+      if (verifier_[entry.key] == entry.data) visited[entry.key] = entry.data;
+    }
+    return visited.size();
+  }
+  template<typename Table>
+  size_t VisitedBackwards(const Table& table)
+  {
+    std::map<Key, Data> visited;
+    for (auto it = table.end(); it != table.begin(); )
+    {
+      --it;
+      if (visited.count(it->key) || !verifier_.count(it->key)) return -1;
+      if (verifier_[it->key] == it->data) visited[it->key] = it->data;
+    }
+    return visited.size();
+  }
+
+  std::string         path_;
+  std::map<Key, Data> verifier_;
+  size_t              successes_;
+  size_t              failures_;
+};
+
+/*
+ * InmemoryTableTest
+ */
+class InmemoryTableTest : public TableTest {
+ public:
+  InmemoryTableTest() : TableTest("InmemoryTableTest") {}
+
+  void Run() override
+  {
+    {
+      unsafe_inmemory_storage model(kPageSize);
+      LkTable<Key, Data> table(&model, kNumLkPages);
+      Check(table);
+    }
+    {
+      unsafe_inmemory_storage model(kPageSize);
+      FaginTable<Key, Data, UniHash<Key>, unsafe_inmemory_storage> table(&model);
+      Check(table);
+    }
+    {
+      unsafe_inmemory_storage model(kPageSize);
+      Btree<Key, Data> table(&model);
+      Check(table);
+    }
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+  }
+};
+
+/*
+ * BufferedTableTest
+ *
+ * There are far fewer frames than pages, so every pin the tables take
+ * has to be given back.
+ */
+class BufferedTableTest : public TableTest {
+ public:
+  BufferedTableTest() : TableTest("BufferedTableTest") {}
+
+  void Run() override
+  {
+    std::remove(path_.c_str());
+    {
+      buffered_file_storage model(path_, kPageSize, kNumFrames);
+      LkTable<Key, Data, UniHash<Key>, buffered_file_storage> table(&model, kNumLkPages);
+      Check(table);
+    }
+    std::remove(path_.c_str());
+    {
+      buffered_file_storage model(path_, kPageSize, kNumFrames);
+      FaginTable<Key, Data, UniHash<Key>, buffered_file_storage> table(&model);
+      Check(table);
+    }
+    std::remove(path_.c_str());
+    {
+      buffered_file_storage model(path_, kPageSize, kNumFrames);
+      Btree<Key, Data, UniHash<Key>, std::less<Key>, buffered_file_storage> table(&model);
+      Check(table);
+    }
+    std::remove(path_.c_str());
+    {
+      buffered_file_storage model(path_, kPageSize, kNumFrames);
+      EraseAll(model);
+    }
+    std::remove(path_.c_str());
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+  }
+
+ private:
+  /*
+   * EraseAll
+   *
+   * Erasing every key in random order merges the Btree level by level
+   * down to a root leaf: the pages freed on the way must not be pinned,
+   * and after compacting the storage only the root is left.
+   */
+  void EraseAll(buffered_file_storage& model)
+  {
+    Btree<Key, Data, UniHash<Key>, std::less<Key>, buffered_file_storage> table(&model);
+    for (auto&& entry : verifier_) table.insert(entry.first, entry.second);
+
+    std::vector<Key> keys;
+    for (auto&& entry : verifier_) keys.push_back(entry.first);
+    std::shuffle(keys.begin(), keys.end(), std::mt19937_64(2));
+
+    size_t erased = 0;
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+      if (table.erase(keys[i])) ++erased;
+      //the keys still to be erased stay in the table
+      if (i % 500 == 0 && i + 1 < keys.size())
+      {
+        TEST(table.find(keys[i + 1]).first);
+      }
+    }
+    TEST(erased == keys.size());
+    TEST(table.size() == 0);
+    TEST(table.begin() == table.end());
+    TEST(!table.find(keys.front()).first);
+
+    table.Compact();
+    TEST(model.get_page_count() == 1);
+
+    table.insert(keys.front(), 1);
+    TEST(table.find(keys.front()).second == 1);
+  }
+};
+
+/*
+ * MmapTableTest
+ */
+class MmapTableTest : public TableTest {
+ public:
+  MmapTableTest() : TableTest("MmapTableTest") {}
+
+  void Run() override
+  {
+    std::remove(path_.c_str());
+    {
+      mmap_storage model(path_, kPageSize, 16 * kPageSize);
+      LkTable<Key, Data, UniHash<Key>, mmap_storage> table(&model, kNumLkPages);
+      Check(table);
+    }
+    std::remove(path_.c_str());
+    {
+      mmap_storage model(path_, kPageSize, 16 * kPageSize);
+      FaginTable<Key, Data, UniHash<Key>, mmap_storage> table(&model);
+      Check(table);
+    }
+    std::remove(path_.c_str());
+    {
+      mmap_storage model(path_, kPageSize, 16 * kPageSize);
+      Btree<Key, Data, UniHash<Key>, std::less<Key>, mmap_storage> table(&model);
+      Check(table);
+    }
+    std::remove(path_.c_str());
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+  }
+};
+
+/*
+ * WalTableTest
+ *
+ * Inserts into LkTable and Btree through a wal_storage and commits, with
+ * the table's meta page published in a root page (page 0) before every
+ * commit.  Replayed into an empty storage the log has to give back every
+ * page, and the tables have to open from the root page again.  Then a
+ * forked child crashes in the middle of uncommitted inserts and erases
+ * over a buffered_file_storage with few frames, after flushing it: the
+ * reopened table holds exactly what was committed.
+ */
+class WalTableTest : public TableTest {
+ public:
+  WalTableTest() : TableTest("WalTableTest"), logPath_("table_test.wal") {}
+
+  void Run() override
+  {
+    using LkType    = LkTable<Key, Data, UniHash<Key>, wal_storage>;
+    using BtreeType = Btree<Key, Data, UniHash<Key>, std::less<Key>, wal_storage>;
+
+    Logged<LkType>(kNumLkPages);
+    Logged<BtreeType>();
+    Crashed<LkType>(kNumLkPages);
+    Crashed<BtreeType>();
+
+    std::remove(logPath_.c_str());
+    std::remove(path_.c_str());
+    std::remove((path_ + ".fsm").c_str());
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+  }
+
+ private:
+  template<typename Table, typename... Args>
+  void Logged(Args... args)
+  {
+    std::remove(logPath_.c_str());
+    unsafe_inmemory_storage inner(kPageSize);
+    {
+      wal_storage model(&inner, logPath_);
+      model.release_page(model.create_page());
+      Table table(&model, args...);
+
+      size_t index = 0;
+      for (auto&& entry : verifier_)
+      {
+        table.insert(entry.first, entry.second);
+        if (++index % 500 == 0) Commit(table, model);
+      }
+      Commit(table, model);
+      TEST(Found(table) == verifier_.size());
+    }
+    TEST(Replayed(inner));
+
+    unsafe_inmemory_storage restored(kPageSize);
+    wal_storage model(&restored, logPath_);
+    Table table(&model, MetaPage(model), OpenTable());
+    TEST(table.size() == verifier_.size());
+    TEST(Found(table) == verifier_.size());
+    TEST(Visited(table) == verifier_.size());
+  }
+
+  //the child commits the first half of the keys and checkpoints (flush,
+  //truncate_log), so no log record can repair a page; then it inserts
+  //the rest and erases every other committed key without committing
+  template<typename Table, typename... Args>
+  void Crashed(Args... args)
+  {
+    std::remove(logPath_.c_str());
+    std::remove(path_.c_str());
+    std::remove((path_ + ".fsm").c_str());
+
+    std::map<Key, Data> committed;
+    std::map<Key, Data> uncommitted;
+    for (auto&& entry : verifier_)
+    {
+      (committed.size() < kNumKeys / 2 ? committed : uncommitted).insert(entry);
+    }
+
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0)
+    {
+      int status = 0;
+      try
+      {
+        buffered_file_storage inner(path_, kPageSize, kNumFrames);
+        wal_storage model(&inner, logPath_);
+        model.release_page(model.create_page());
+        Table table(&model, args...);
+        for (auto&& entry : committed) table.insert(entry.first, entry.second);
+        Commit(table, model);
+        inner.flush();
+        model.truncate_log();
+
+        size_t index = 0;
+        for (auto&& entry : uncommitted) table.insert(entry.first, entry.second);
+        for (auto&& entry : committed)
+        {
+          if (index++ % 2 == 0) table.erase(entry.first);
+        }
+        table.SaveMeta();
+        inner.flush();
+      }
+      catch (...) { status = 1; }
+      _exit(status);
+    }
+    int status = -1;
+    waitpid(child, &status, 0);
+    TEST(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    buffered_file_storage inner(path_, kPageSize, kNumFrames);
+    wal_storage model(&inner, logPath_);
+    Table table(&model, MetaPage(model), OpenTable());
+    TEST(table.size() == committed.size());
+    TEST(Found(table, committed) == committed.size());
+    TEST(Found(table, uncommitted) == 0);
+    TEST((size_t)std::distance(table.begin(), table.end()) == committed.size());
+  }
+
+  //publishes the meta page in the root page and commits both
+  template<typename Table>
+  void Commit(Table& table, wal_storage& model)
+  {
+    PageId metaPage = table.SaveMeta();
+    char* root = model.load_page(0);
+    std::memcpy(root, &metaPage, sizeof(metaPage));
+    model.save_page(0, root);
+    model.commit();
+  }
+
+  PageId MetaPage(wal_storage& model)
+  {
+    PageId metaPage;
+    std::memcpy(&metaPage, model.load_page(0), sizeof(metaPage));
+    model.release_page(0);
+    return metaPage;
+  }
+
+  bool Replayed(unsafe_inmemory_storage& committed)
+  {
+    unsafe_inmemory_storage restored(kPageSize);
+    wal_storage model(&restored, logPath_);
+    if (restored.get_page_count() != committed.get_page_count()) return false;
+    for (size_t i = 0; i < committed.get_page_count(); ++i)
+    {
+      if (!std::equal(committed.load_page(i), committed.load_page(i) + kPageSize,
+                      restored.load_page(i))) return false;
+    }
+    return true;
+  }
+
+  std::string logPath_;
+};
+
+/*
+ * ShmTableTest
+ *
+ * A writer builds a Btree and an LkTable in shared memory and publishes
+ * the Btree's root and the LkTable's meta page; a forked reader opens
+ * both over a read-only mapping and finds every key.
+ */
+class ShmTableTest : public TableTest {
+ public:
+  ShmTableTest() : TableTest("ShmTableTest"), name_("/data_org_project_table_test") {}
+
+  void Run() override
+  {
+    shm_storage::remove(name_);
+    {
+      shm_storage model(name_, kPageSize, 4096);
+      Btree<Key, Data, UniHash<Key>, std::less<Key>, shm_storage> table(&model);
+      for (auto&& entry : verifier_) table.insert(entry.first, entry.second);
+      LkTable<Key, Data, UniHash<Key>, shm_storage> lkTable(&model, kNumLkPages);
+      for (auto&& entry : verifier_) lkTable.insert(entry.first, entry.second);
+      model.set_root_word(1, table.size());
+      model.set_root_word(0, table.RootId());
+      model.set_root_word(2, lkTable.SaveMeta());
+
+      fflush(stdout);
+      pid_t child = fork();
+      if (child == 0)
+      {
+        int status = 0;
+        try
+        {
+          shm_storage reader(name_);
+          Btree<Key, Data, UniHash<Key>, std::less<Key>, shm_storage>
+            shared(&reader, reader.get_root_word(0), reader.get_root_word(1));
+          if (shared.size() != verifier_.size()) status = 1;
+          if (Found(shared) != verifier_.size()) status = 2;
+          if (shared.find(8 * kNumKeys).first) status = 3;
+
+          LkTable<Key, Data, UniHash<Key>, shm_storage>
+            sharedLk(&reader, reader.get_root_word(2), OpenTable());
+          if (sharedLk.size() != verifier_.size()) status = 5;
+          if (Found(sharedLk) != verifier_.size()) status = 6;
+          if (sharedLk.find(8 * kNumKeys).first) status = 7;
+        }
+        catch (...) { status = 4; }
+        _exit(status);
+      }
+      int status = -1;
+      waitpid(child, &status, 0);
+      TEST(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    shm_storage::remove(name_);
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+  }
+
+ private:
+  std::string name_;
+};
+
+/*
+ * SnapshotTableTest
+ *
+ * A writer thread inserts and erases random keys in a Btree over a
+ * snapshot_storage, splitting and merging pages.  Meanwhile snapshots
+ * are taken between two of its operations, and a Btree opened over a
+ * snapshot_view with the root and size of that moment has to iterate
+ * and find exactly the entries of that moment, while the writer goes on.
+ */
+class SnapshotTableTest : public TableTest {
+ public:
+  SnapshotTableTest() : TableTest("SnapshotTableTest") {}
+
+  void Run() override
+  {
+    const size_t numSnapshots = 20;
+    const size_t opsPerSnapshot = 500;
+
+    concurrent_inmemory_storage inner(kPageSize);
+    snapshot_storage model(&inner);
+    Btree<Key, Data, UniHash<Key>, std::less<Key>, snapshot_storage> table(&model);
+
+    std::map<Key, Data> live = verifier_;
+    for (auto&& entry : live) table.insert(entry.first, entry.second);
+
+    std::mutex mutex;
+    std::atomic<bool> done(false);
+    std::atomic<size_t> ops(0);
+    std::thread writer([&]() {
+      std::mt19937_64 random(2);
+      while (!done)
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        Key key = random() % (8 * kNumKeys);
+        if (live.erase(key)) table.erase(key);
+        else table.insert(key, live[key] = random());
+        ++ops;
+      }
+    });
+
+    size_t matched = 0;
+    size_t preserved = 0;
+    for (size_t i = 0; i < numSnapshots; ++i)
+    {
+      snapshot_storage::snapshot_id snapshot;
+      PageId rootId;
+      size_t size;
+      std::map<Key, Data> expected;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        snapshot = model.take_snapshot();
+        rootId   = table.RootId();
+        size     = table.size();
+        expected = live;
+      }
+      //let the writer change the tree under the snapshot first
+      size_t start = ops;
+      while (ops < start + opsPerSnapshot) std::this_thread::yield();
+
+      snapshot_view view(&model, snapshot);
+      Btree<Key, Data, UniHash<Key>, std::less<Key>, snapshot_view>
+        frozen(&view, rootId, size);
+
+      std::map<Key, Data> visited;
+      for (auto&& entry : frozen) visited[entry.key] = entry.data;
+      size_t found = 0;
+      for (auto&& entry : expected)
+      {
+        auto result = frozen.find(entry.first);
+        if (result.first && result.second == entry.second) ++found;
+      }
+      if (frozen.size() == expected.size() && visited == expected &&
+          found == expected.size()) ++matched;
+
+      preserved += model.get_preserved_page_count();
+      model.release_snapshot(snapshot);
+    }
+    done = true;
+    writer.join();
+
+    TEST(matched == numSnapshots);
+    TEST(preserved > 0);
+    TEST(model.get_preserved_page_count() == 0);
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+  }
+};
+
+/*
+ * StringTableTest
+ *
+ * LkTable with FixedString keys, hashed by UniHash<FixedString<N>>:
+ * strings which share long prefixes have to be found, iterated and
+ * erased like integer keys.
+ */
+class StringTableTest : public TestBase {
+ public:
+  using StringKey = FixedString<24>;
+
+  StringTableTest() :
+    TestBase("StringTableTest"),
+    successes_(0), failures_(0) {}
+
+  void Run() override
+  {
+    const size_t numKeys = 1000;
+    std::map<std::string, Data> verifier;
+    for (size_t i = 0; i < numKeys; ++i)
+      verifier["catalog/item/" + std::to_string(i * 7919)] = i;
+
+    unsafe_inmemory_storage model(kPageSize);
+    LkTable<StringKey, Data> table(&model, kNumLkPages);
+    for (auto&& entry : verifier) table.insert(StringKey(entry.first), entry.second);
+    TEST(table.size() == verifier.size());
+
+    size_t found = 0;
+    for (auto&& entry : verifier)
+    {
+      auto result = table.find(StringKey(entry.first));
+      if (result.first && result.second == entry.second) ++found;
+    }
+    TEST(found == verifier.size());
+    TEST(!table.find(StringKey("catalog/item/1")).first);
+
+    std::map<std::string, Data> visited;
+    for (auto&& entry : table) visited[std::string(entry.key.View())] = entry.data;
+    TEST(visited == verifier);
+
+    size_t erased = 0;
+    for (auto&& entry : verifier) erased += table.erase(StringKey(entry.first));
+    TEST(erased == verifier.size());
+    TEST(table.size() == 0);
+
+    printf("successes: %zu, failures: %zu\n", successes_, failures_);
+  }
+
+ private:
+  size_t successes_;
+  size_t failures_;
+};
+
+int main(int argc, char** argv) {
+  TestSuite testSuite;
+
+  testSuite.RegisterTest<InmemoryTableTest>();
+  testSuite.RegisterTest<BufferedTableTest>();
+  testSuite.RegisterTest<MmapTableTest>();
+  testSuite.RegisterTest<WalTableTest>();
+  testSuite.RegisterTest<ShmTableTest>();
+  testSuite.RegisterTest<SnapshotTableTest>();
+  testSuite.RegisterTest<StringTableTest>();
+  testSuite.Run();
+}
@@ -3,6 +3,8 @@
 #include "test_unit.h"
 //
 
+#include "hash_families.h"
+#include "string_hash.h"
 #include "universal_hash.h"
 
 #include <algorithm>
@@ -118,6 +120,180 @@ struct MyKey {
   char key[16];
 };
 
+/*
+ * ReferenceHash
+ *
+ * The original UniHash::operator(), with its heap copy of the key, kept
+ * to check that the fast path computes the same values.
+ */
+template<typename Key>
+uint64_t ReferenceHash(const UniHash<Key>& uni, const Key& key)
+{
+  Key* fresh = (Key*)calloc(sizeof(key), 1);
+  *fresh = key;
+
+  uint64_t hash = 0;
+  auto reg = (uint32_t*)fresh;
+  auto acc = (uint16_t*)&hash;
+
+  if (sizeof(Key)/2 >= UniHash<Key>::kNumParams)
+  {
+    for (size_t i = 0; i < sizeof(Key)/4; ++i)
+    {
+      auto acc_ = acc + i % 4;
+      *acc_    ^= Hash16(*reg++, uni.parameters[i % 4]);
+    }
+  } else {
+    for (size_t i = 0; i < UniHash<Key>::kNumParams; ++i)
+    {
+      auto reg_ = reg + i % (sizeof(Key)/4);
+      *acc++   ^= Hash16(*reg_, uni.parameters[i]);
+    }
+  }
+
+  free(fresh);
+  return hash;
+}
+
+struct Key12 { uint32_t a, b, c; };
+struct Key16 { uint64_t a, b; };
+
+/*
+ * TestReference
+ *
+ * Counts the keys made from 0..n-1 which the fast path hashes
+ * differently from the reference.
+ */
+template<typename Key, typename MakeKey>
+size_t TestReference(size_t n, MakeKey makeKey)
+{
+  UniHash<Key> uni;
+  size_t failures = 0;
+  for (size_t i = 0; i < n; ++i)
+  {
+    Key key = makeKey(i);
+    if (uni(key) != ReferenceHash(uni, key)) ++failures;
+  }
+  printf("reference %zu-byte keys: %zu failures\n", sizeof(Key), failures);
+  return failures;
+}
+
+/*
+ * TestBatch
+ *
+ * Counts the keys made from 0..n-1 which hash_batch hashes differently
+ * from operator(), for every instruction set the processor has.  n is
+ * not a multiple of the vector width, so the scalar tail is covered too.
+ */
+template<typename Key, typename MakeKey>
+size_t TestBatch(size_t n, MakeKey makeKey)
+{
+  UniHash<Key> uni;
+  std::vector<Key> keys;
+  for (size_t i = 0; i < n; ++i) keys.push_back(makeKey(i));
+
+  size_t failures = 0;
+  for (HashIsa isa : {HashIsa::kScalar, HashIsa::kAvx2, HashIsa::kAvx512})
+  {
+    if (!HashIsaSupported(isa)) continue;
+    std::vector<uint64_t> hashes(n);
+    uni.hash_batch(keys.data(), n, hashes.data(), isa);
+    for (size_t i = 0; i < n; ++i) if (hashes[i] != uni(keys[i])) ++failures;
+  }
+  printf("batch %zu-byte keys: %zu failures\n", sizeof(Key), failures);
+  return failures;
+}
+
+/*
+ * TestFamily
+ *
+ * Counts the keys a family hashes differently in hash_batch, plus the
+ * collisions among them.
+ */
+template<template<typename> class Hash>
+size_t TestFamily(const char* name)
+{
+  Hash<uint64_t> hash;
+  std::vector<uint64_t> keys, hashes(1000);
+  for (size_t i = 0; i < 1000; ++i) keys.push_back(i * 0x9e3779b97f4a7c15);
+  hash.hash_batch(keys.data(), keys.size(), hashes.data());
+
+  size_t failures = 0;
+  for (size_t i = 0; i < keys.size(); ++i) if (hashes[i] != hash(keys[i])) ++failures;
+  failures += keys.size() - std::set<uint64_t>(hashes.begin(), hashes.end()).size();
+  printf("%s: %zu failures\n", name, failures);
+  return failures;
+}
+
+/*
+ * TestFamilies
+ *
+ * Checks the reduction mod 2^61-1 against %, then the families of
+ * hash_families.h.
+ */
+size_t TestFamilies()
+{
+  size_t failures = 0;
+  std::mt19937_64 random(7);
+  for (size_t i = 0; i < 100000; ++i)
+  {
+    unsigned __int128 x = (unsigned __int128)(random() >> 6) << 64 | random();
+    if (ModMersenne61(x) != (uint64_t)(x % kMersenne61)) ++failures;
+  }
+  if (ModMersenne61(kMersenne61) != 0) ++failures;
+  printf("mod 2^61-1: %zu failures\n", failures);
+
+  failures += TestFamily<MultiplyShiftHash>("MultiplyShiftHash");
+  failures += TestFamily<MersenneHash>("MersenneHash");
+  failures += TestFamily<TabHash>("TabHash");
+  failures += TestFamily<TwistedTabHash>("TwistedTabHash");
+  return failures;
+}
+
+/*
+ * TestStrings
+ *
+ * Counts collisions among URL-like strings and all the prefixes of a
+ * long one (every length, so every tail of the 4-chunk loop), copies
+ * hashed differently, and FixedString keys hashed differently from
+ * their strings' equals.
+ */
+size_t TestStrings()
+{
+  std::vector<std::string> strings;
+  std::string longest;
+  for (size_t i = 0; i < 200; ++i) longest += (char)('a' + i % 26);
+  for (size_t n = 0; n <= longest.size(); ++n) strings.push_back(longest.substr(0, n));
+  for (size_t i = 0; i < 10000; ++i)
+    strings.push_back("https://example.org/item/" + std::to_string(i) + "?page=" + std::to_string(i % 7));
+
+  StringHash hash;
+  std::vector<std::string_view> views(strings.begin(), strings.end());
+  std::vector<uint64_t> hashes(views.size());
+  hash.hash_batch(views.data(), views.size(), hashes.data());
+
+  size_t failures = views.size() - std::set<uint64_t>(hashes.begin(), hashes.end()).size();
+  for (size_t i = 0; i < views.size(); ++i)
+    if (hashes[i] != hash(std::string(views[i])) || hashes[i] >= kMersenne61) ++failures;
+
+  UniHash<FixedString<48>> fixedHash;
+  std::set<uint64_t> fixedHashes;
+  for (size_t i = 0; i < 1000; ++i)
+  {
+    FixedString<48> key(strings[longest.size() + 1 + i]);
+    if (key.View() != strings[longest.size() + 1 + i]) ++failures;
+    if (fixedHash(key) != fixedHash(FixedString<48>(key.View()))) ++failures;
+    fixedHashes.insert(fixedHash(key));
+  }
+  failures += 1000 - fixedHashes.size();
+
+  try { FixedString<4> tooLong("abcde"); ++failures; }
+  catch (const std::length_error&) {}
+
+  printf("strings: %zu failures\n", failures);
+  return failures;
+}
+
 int main(int argc, char** argv) {
   if (argc > 1) sampleSize = std::stoull(argv[1]);
  
@@ -125,6 +301,21 @@ int main(int argc, char** argv) {
 
   TestDist<UniHash<MyKey>>(0x1000);
 
+  size_t failures = 0;
+  failures += TestReference<uint32_t>(1000, [](size_t i) { return (uint32_t)i; });
+  failures += TestReference<uint64_t>(1000, [](size_t i) { return i * 0x9e3779b97f4a7c15; });
+  failures += TestReference<Key12>(1000, [](size_t i) { return Key12{(uint32_t)i, 7, (uint32_t)~i}; });
+  failures += TestReference<Key16>(1000, [](size_t i) { return Key16{i, i * i}; });
+  failures += TestReference<MyKey>(1000, [](size_t i) { return MyKey(i); });
+  failures += TestBatch<uint32_t>(1003, [](size_t i) { return (uint32_t)(i % 2 ? ~i : i); });
+  failures += TestBatch<uint64_t>(1003, [](size_t i) { return i * 0x9e3779b97f4a7c15; });
+  failures += TestBatch<Key12>(1003, [](size_t i) { return Key12{(uint32_t)i, 7, (uint32_t)~i}; });
+  failures += TestBatch<Key16>(1003, [](size_t i) { return Key16{i, ~(i * i)}; });
+  failures += TestBatch<MyKey>(1003, [](size_t i) { return MyKey(i); });
+  failures += TestFamilies();
+  failures += TestStrings();
+  if (failures != 0) return 1;
+
   //UniHash<size_t> uni;
   //printf("params:\n%s\n", uni.ToString().c_str());
   //for (size_t i = 0; i < 5; ++i) printf("i: %zu, final hash: %zu\n", i, uni(i));